@@ -0,0 +1,50 @@
+#include "AllocationCheck.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+
+#ifndef NDEBUG
+
+static std::atomic<size_t> heapAllocations(0);
+static thread_local int heapAllowance = 0;
+
+size_t heapAllocationCount() {
+	return heapAllocations;
+}
+
+AllowHeapAllocations::AllowHeapAllocations() {
+	heapAllowance++;
+}
+
+AllowHeapAllocations::~AllowHeapAllocations() {
+	heapAllowance--;
+}
+
+void* operator new(size_t size) {
+	if (heapAllowance == 0) heapAllocations++;
+
+	void* p = std::malloc(size > 0 ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+	std::free(p);
+}
+
+#else
+
+size_t heapAllocationCount() {
+	return 0;
+}
+
+AllowHeapAllocations::AllowHeapAllocations() {}
+
+AllowHeapAllocations::~AllowHeapAllocations() {}
+
+#endif
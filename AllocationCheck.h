@@ -0,0 +1,13 @@
+#pragma once
+#include <cstddef>
+
+// Number of global operator new calls so far (debug builds only, always 0 in release).
+// Used to check that a steady-state frame does not touch the heap.
+size_t heapAllocationCount();
+
+// Heap allocations made while an instance is alive are not counted,
+// for debug-only paths such as console dumps.
+struct AllowHeapAllocations {
+	AllowHeapAllocations();
+	~AllowHeapAllocations();
+};
@@ -25,33 +25,35 @@ void Config::readConfigs(std::string configFilePath) {
 	}
 }
 
-std::string Config::get(std::string key) {
+const std::string& Config::get(const std::string& key) const {
+	static const std::string empty;
 
-	if (this->configs.count(key) <= 0) return "";
+	auto it = this->configs.find(key);
+	if (it == this->configs.end()) return empty;
 
-	return this->configs[key];
+	return it->second;
 }
 
-int Config::getInt(std::string key) {
-	std::string value = this->get(key);
+int Config::getInt(const std::string& key) const {
+	const std::string& value = this->get(key);
 
 	return std::stoi(value);
 }
 
-float Config::getFloat(std::string key) {
-	std::string value = this->get(key);
+float Config::getFloat(const std::string& key) const {
+	const std::string& value = this->get(key);
 	return std::stof(value);
 }
 
-bool Config::getBool(std::string key) {
-	std::string value = this->get(key);
+bool Config::getBool(const std::string& key) const {
+	const std::string& value = this->get(key);
 	bool b;
 	std::istringstream(value) >> std::boolalpha >> b;
 	return b;
 }
 
-glm::vec3 Config::getVec3(std::string key) {
-	std::string value = this->get(key);
+glm::vec3 Config::getVec3(const std::string& key) const {
+	const std::string& value = this->get(key);
 
 	if (value == "#") return glm::vec3(0);
 
@@ -19,11 +19,11 @@ private:
 public:
 	Config(std::string configFilePath);
 
-	std::string get(std::string key);
-	int getInt(std::string key);
-	float getFloat(std::string key);
-	bool getBool(std::string key);
-	glm::vec3 getVec3(std::string key);
+	const std::string& get(const std::string& key) const;
+	int getInt(const std::string& key) const;
+	float getFloat(const std::string& key) const;
+	bool getBool(const std::string& key) const;
+	glm::vec3 getVec3(const std::string& key) const;
 	
 };
 
@@ -0,0 +1,118 @@
+#include "Culling.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE__)
+#include <xmmintrin.h>
+#define CULLING_SSE
+#endif
+
+
+void Frustum::extract(const glm::mat4& viewProj) {
+	// glm matrices are column major: row i is (m[0][i], m[1][i], m[2][i], m[3][i])
+	glm::vec4 row0(viewProj[0][0], viewProj[1][0], viewProj[2][0], viewProj[3][0]);
+	glm::vec4 row1(viewProj[0][1], viewProj[1][1], viewProj[2][1], viewProj[3][1]);
+	glm::vec4 row2(viewProj[0][2], viewProj[1][2], viewProj[2][2], viewProj[3][2]);
+	glm::vec4 row3(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+
+	planes[0] = row3 + row0; // left
+	planes[1] = row3 - row0; // right
+	planes[2] = row3 + row1; // bottom
+	planes[3] = row3 - row1; // top
+	planes[4] = row2;        // near, depth goes from 0 to 1
+	planes[5] = row3 - row2; // far
+}
+
+bool Frustum::intersects(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const {
+	glm::vec3 center = 0.5f * (boundsMin + boundsMax);
+	glm::vec3 extent = 0.5f * (boundsMax - boundsMin);
+
+	for (int p = 0; p < 6; p++) {
+		glm::vec3 normal = glm::vec3(planes[p]);
+		if (glm::dot(normal, center) + planes[p].w + glm::dot(glm::abs(normal), extent) < 0.0f) return false;
+	}
+	return true;
+}
+
+uint32_t CullingSet::add(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	uint32_t index = count++;
+
+	// Whole groups of four, the padding boxes are never reported
+	size_t padded = (count + 3) & ~3u;
+	minX.resize(padded); minY.resize(padded); minZ.resize(padded);
+	maxX.resize(padded); maxY.resize(padded); maxZ.resize(padded);
+	visible.resize(padded);
+
+	update(index, boundsMin, boundsMax);
+	return index;
+}
+
+void CullingSet::update(uint32_t index, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	minX[index] = boundsMin.x; minY[index] = boundsMin.y; minZ[index] = boundsMin.z;
+	maxX[index] = boundsMax.x; maxY[index] = boundsMax.y; maxZ[index] = boundsMax.z;
+}
+
+// A box is outside when, for some plane, its corner farthest along the plane
+// normal is behind it. That corner takes, per axis, the max if the normal
+// component is positive and the min otherwise: it is the same for every box,
+// so it is chosen once per plane, without per-lane selects.
+void CullingSet::cull(const Frustum& frustum) {
+	testedCount = count;
+	visibleCount = 0;
+
+	for (uint32_t first = 0; first < count; first += 4) {
+#ifdef CULLING_SSE
+		__m128 inside = _mm_cmpeq_ps(_mm_setzero_ps(), _mm_setzero_ps()); // all lanes true
+
+		for (int p = 0; p < 6; p++) {
+			const glm::vec4& plane = frustum.planes[p];
+
+			__m128 x = _mm_loadu_ps(plane.x > 0.0f ? &maxX[first] : &minX[first]);
+			__m128 y = _mm_loadu_ps(plane.y > 0.0f ? &maxY[first] : &minY[first]);
+			__m128 z = _mm_loadu_ps(plane.z > 0.0f ? &maxZ[first] : &minZ[first]);
+
+			__m128 distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)), _mm_mul_ps(y, _mm_set1_ps(plane.y))),
+				_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane.z)), _mm_set1_ps(plane.w)));
+
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, _mm_setzero_ps()));
+		}
+
+		int mask = _mm_movemask_ps(inside);
+		for (uint32_t lane = 0; lane < 4; lane++) {
+			visible[first + lane] = (mask >> lane) & 1;
+		}
+#else
+		for (uint32_t i = first; i < first + 4; i++) {
+			bool inside = true;
+			for (int p = 0; p < 6 && inside; p++) {
+				const glm::vec4& plane = frustum.planes[p];
+				float distance =
+					plane.x * (plane.x > 0.0f ? maxX[i] : minX[i]) +
+					plane.y * (plane.y > 0.0f ? maxY[i] : minY[i]) +
+					plane.z * (plane.z > 0.0f ? maxZ[i] : minZ[i]) + plane.w;
+				inside = distance >= 0.0f;
+			}
+			visible[i] = inside;
+		}
+#endif
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		visibleCount += visible[i];
+	}
+}
+
+void transformBounds(const glm::mat4& transform, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+	glm::vec3& outMin, glm::vec3& outMax) {
+	glm::vec3 translation(transform[3]);
+	outMin = translation;
+	outMax = translation;
+
+	for (int column = 0; column < 3; column++) {
+		for (int row = 0; row < 3; row++) {
+			float a = transform[column][row] * boundsMin[column];
+			float b = transform[column][row] * boundsMax[column];
+			outMin[row] += glm::min(a, b);
+			outMax[row] += glm::max(a, b);
+		}
+	}
+}
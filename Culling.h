@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+// The six planes of a view frustum, as (a, b, c, d) with the normals pointing inside:
+// a point is inside when a*x + b*y + c*z + d >= 0 for every plane.
+struct Frustum {
+	glm::vec4 planes[6];
+
+	// From a projection * view matrix, with the [0, 1] depth range of Vulkan
+	void extract(const glm::mat4& viewProj);
+
+	// A single box, for the few objects not in a CullingSet
+	bool intersects(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const;
+};
+
+// Axis aligned bounding boxes tested against a frustum, four at a time with SSE.
+// Bounds are stored as a structure of arrays, padded to a multiple of four boxes.
+class CullingSet
+{
+private:
+	std::vector<float> minX, minY, minZ;
+	std::vector<float> maxX, maxY, maxZ;
+	std::vector<uint8_t> visible;
+	uint32_t count = 0;
+
+	uint32_t testedCount = 0;
+	uint32_t visibleCount = 0;
+
+public:
+	// Returns the index of the box, used to update it and to query its visibility
+	uint32_t add(const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+	void update(uint32_t index, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+	void cull(const Frustum& frustum);
+	bool isVisible(uint32_t index) const { return visible[index] != 0; }
+
+	// Counters of the last cull()
+	uint32_t tested() const { return testedCount; }
+	uint32_t visibleObjects() const { return visibleCount; }
+};
+
+// Bounds of a box after a transformation, still axis aligned (Arvo's method)
+void transformBounds(const glm::mat4& transform, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+	glm::vec3& outMin, glm::vec3& outMax);
@@ -0,0 +1,113 @@
+#include "MemoryTracker.h"
+#include <sstream>
+#include <iomanip>
+
+
+void MemoryTracker::init(VkPhysicalDevice physicalDevice, bool budgetSupported) {
+	this->physicalDevice = physicalDevice;
+	this->budgetSupported = budgetSupported;
+
+	vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+
+	for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+		categoryUsage[i] = 0;
+		categoryPeak[i] = 0;
+	}
+	for (int i = 0; i < VK_MAX_MEMORY_HEAPS; i++) {
+		heapUsage[i] = 0;
+	}
+}
+
+void MemoryTracker::track(VkDeviceMemory memory, VkDeviceSize size, uint32_t memoryTypeIndex,
+	MemoryCategory category, const std::string& owner) {
+
+	Allocation allocation;
+	allocation.size = size;
+	allocation.heapIndex = memoryProperties.memoryTypes[memoryTypeIndex].heapIndex;
+	allocation.category = category;
+	allocation.owner = owner;
+
+	allocations[memory] = allocation;
+
+	categoryUsage[category] += size;
+	if (categoryUsage[category] > categoryPeak[category]) categoryPeak[category] = categoryUsage[category];
+	heapUsage[allocation.heapIndex] += size;
+}
+
+void MemoryTracker::untrack(VkDeviceMemory memory) {
+	auto it = allocations.find(memory);
+	if (it == allocations.end()) return;
+
+	categoryUsage[it->second.category] -= it->second.size;
+	heapUsage[it->second.heapIndex] -= it->second.size;
+
+	allocations.erase(it);
+}
+
+void MemoryTracker::printSummary(std::ostream& out) {
+	out << "---- GPU memory ----" << std::endl;
+
+	for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++) {
+		out << std::left << std::setw(12) << categoryName((MemoryCategory)i)
+			<< std::right << std::setw(12) << formatSize(categoryUsage[i])
+			<< "  (peak " << formatSize(categoryPeak[i]) << ")" << std::endl;
+	}
+
+	VkPhysicalDeviceMemoryBudgetPropertiesEXT budget{};
+	budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+
+	if (budgetSupported) {
+		VkPhysicalDeviceMemoryProperties2 memoryProperties2{};
+		memoryProperties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+		memoryProperties2.pNext = &budget;
+		vkGetPhysicalDeviceMemoryProperties2(physicalDevice, &memoryProperties2);
+	}
+
+	for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+		bool deviceLocal = memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT;
+
+		out << "Heap " << i << (deviceLocal ? " (device) " : " (host)   ")
+			<< std::setw(12) << formatSize(heapUsage[i])
+			<< " of " << formatSize(memoryProperties.memoryHeaps[i].size);
+
+		// The budget and usage reported by the driver include the other processes
+		if (budgetSupported) {
+			out << "  - process usage " << formatSize(budget.heapUsage[i])
+				<< ", budget " << formatSize(budget.heapBudget[i]);
+		}
+		out << std::endl;
+	}
+
+	out << "Live allocations: " << allocations.size() << std::endl;
+}
+
+void MemoryTracker::printAllocations(std::ostream& out) {
+	for (auto& it : allocations) {
+		out << std::left << std::setw(12) << categoryName(it.second.category)
+			<< std::right << std::setw(12) << formatSize(it.second.size)
+			<< "  heap " << it.second.heapIndex
+			<< "  " << it.second.owner << std::endl;
+	}
+}
+
+const char* MemoryTracker::categoryName(MemoryCategory category) {
+	switch (category) {
+	case MEMORY_MESH: return "mesh";
+	case MEMORY_TEXTURE: return "texture";
+	case MEMORY_UNIFORM: return "uniform";
+	case MEMORY_STAGING: return "staging";
+	case MEMORY_ATTACHMENT: return "attachment";
+	default: return "unknown";
+	}
+}
+
+std::string MemoryTracker::formatSize(VkDeviceSize size) {
+	std::ostringstream os;
+	os << std::fixed << std::setprecision(2);
+
+	if (size >= 1024 * 1024 * 1024) os << size / (1024.0 * 1024.0 * 1024.0) << " GB";
+	else if (size >= 1024 * 1024) os << size / (1024.0 * 1024.0) << " MB";
+	else os << size / 1024.0 << " KB";
+
+	return os.str();
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <iostream>
+#include <map>
+#include <string>
+
+enum MemoryCategory {
+	MEMORY_MESH,
+	MEMORY_TEXTURE,
+	MEMORY_UNIFORM,
+	MEMORY_STAGING,
+	MEMORY_ATTACHMENT,
+	MEMORY_CATEGORY_COUNT
+};
+
+// Keeps track of every VkDeviceMemory allocated by BaseProject::createBuffer and
+// BaseProject::createImage, with the category and the name of the object that owns it.
+class MemoryTracker
+{
+private:
+	struct Allocation {
+		VkDeviceSize size;
+		uint32_t heapIndex;
+		MemoryCategory category;
+		std::string owner;
+	};
+
+	VkPhysicalDevice physicalDevice;
+	VkPhysicalDeviceMemoryProperties memoryProperties;
+	bool budgetSupported;
+
+	std::map<VkDeviceMemory, Allocation> allocations;
+	VkDeviceSize categoryUsage[MEMORY_CATEGORY_COUNT];
+	VkDeviceSize categoryPeak[MEMORY_CATEGORY_COUNT];
+	VkDeviceSize heapUsage[VK_MAX_MEMORY_HEAPS];
+
+	static const char* categoryName(MemoryCategory category);
+
+public:
+	// budgetSupported: VK_EXT_memory_budget has been enabled on the device
+	void init(VkPhysicalDevice physicalDevice, bool budgetSupported);
+
+	void track(VkDeviceMemory memory, VkDeviceSize size, uint32_t memoryTypeIndex,
+		MemoryCategory category, const std::string& owner);
+	void untrack(VkDeviceMemory memory);
+
+	// Usage per category and per heap, with the driver budget when available
+	void printSummary(std::ostream& out);
+	// Every allocation still alive, e.g. the ones never freed at shutdown
+	void printAllocations(std::ostream& out);
+
+	size_t liveAllocations() { return allocations.size(); }
+
+	// In KB, MB or GB
+	static std::string formatSize(VkDeviceSize size);
+};
@@ -2,64 +2,111 @@
 
 #include "MonsterTruckSimulator.hpp"
 #include "Config.h"
+#include "TerrainBake.h"
 
 const std::string HUMMER_MODEL_PATH = "models/Hummer.obj";
 const std::string HUMMER_TEXTURE_PATH = "textures/HummerDiff.png";
 
 const std::string TERRAIN_MODEL_PATH = "models/Terrain.obj";
 const std::string TERRAIN_TEXTURE_PATH = "textures/PaloDuroPark.jpg";
+// The terrain is split in TERRAIN_CHUNK_GRID x TERRAIN_CHUNK_GRID chunks, culled and drawn
+// by the GPU with TERRAIN_LODS levels of detail
+const int TERRAIN_CHUNK_GRID = 8;
+const uint32_t TERRAIN_LODS = 3;
+// Ambient occlusion and sky visibility of the terrain, baked on the CPU in a texture of
+// TERRAIN_BAKE_SIZE x TERRAIN_BAKE_SIZE texels with TERRAIN_BAKE_RAYS rays each, ignoring
+// the occluders farther than TERRAIN_BAKE_REACH times the size of the terrain.
+// The bake is kept in the working directory and done again when any of them changes.
+const uint32_t TERRAIN_BAKE_SIZE = 256;
+const uint32_t TERRAIN_BAKE_RAYS = 64;
+const float TERRAIN_BAKE_REACH = 0.25f;
+const std::string TERRAIN_BAKE_PATH = "terrain_bake.bin";
+
+// Lights of all the vehicles, binned in the clusters of the view frustum
+const uint32_t MAX_LIGHTS = 256;
+const uint32_t MAX_CLUSTER_LIGHT_INDICES = 16384;
+
+// Clip planes of the camera
+const float NEAR_PLANE = 0.02f;
+const float FAR_PLANE = 10.0f;
+
+// Shadow maps of the headlights, the first two layers of the array
+const uint32_t HEADLIGHT_SHADOW_MAPS = 2;
+const uint32_t SHADOW_MAP_SIZE = 1024;
 
 const std::string SKY_BOX_CUBE_MODEL_PATH = "models/SkyBoxCube.obj";
 const std::string SKY_BOX_STARS_TEXTURE_PATH = "textures/stars.png";
 const std::string SKY_BOX_CLOUDS_TEXTURE_PATH = "textures/clouds.png";
 
-const std::string CIRCLE_MODEL_PATH = "models/circle.obj";
+// Texels of the sky lookup table over the 24 hours, see initSkyLut
+const int SKY_LUT_SIZE = 256;
+
 const std::string SPEEDOMETER_TEXTURE_PATH = "textures/speedometer.png";
 const std::string WATCH_TEXTURE_PATH = "textures/orologio.png";
 
-
-const std::string RECTANGLE_MODEL_PATH = "models/rectangle.obj";
 const std::string SPEEDOMETER_HAND_TEXTURE_PATH = "textures/speedometer_hand.png";
 
-const std::string WATCH_HAND_MODEL_PATH = "models/watch_hand.obj";
 const std::string WATCH_HAND_TEXTURE_PATH = "textures/watch_hand.png";
 
+// Images of the HUD atlas, in the order of the paths given to TextureAtlas::init
+enum HudSprite {
+	SPRITE_SPEEDOMETER,
+	SPRITE_SPEEDOMETER_HAND,
+	SPRITE_WATCH,
+	SPRITE_WATCH_HAND
+};
+
 
 // The uniform buffer object used in this example
 
+// The lights are in the storage buffers of LightClusters
 struct GlobalUniformBufferObject {
 	alignas(16) glm::mat4 view;
 	alignas(16) glm::mat4 proj;
-	alignas(16) glm::vec3 leftHeadLightPos;
-	alignas(16) glm::vec3 leftHeadLightDir;
-	alignas(16) glm::vec3 rightHeadLightPos;
-	alignas(16) glm::vec3 rightHeadLightDir;
-	alignas(16) glm::vec3 headLightsColor;
-	alignas(16) glm::vec3 leftRearLightPos;
-	alignas(16) glm::vec3 rightRearLightPos;
-	alignas(16) glm::vec3 rearLightsColor;
 	alignas(16) glm::vec3 skyColor;
-	/*alignas(4) float rearLightSize;
-	alignas(4) float rearLightDecay;
-	alignas(4) float headLightSize;
-	alignas(4) float headLightDecay;*/
+	alignas(16) glm::vec4 clusterParams; // LightClusters::shaderParams()
+	alignas(16) glm::mat4 shadowViewProj[MAX_SHADOW_MAPS]; // ShadowMaps::viewProj()
 };
 
-struct UniformBufferObject {
+// aoTexture of the objects without baked ambient occlusion
+const uint32_t NO_BAKED_AO = UINT32_MAX;
+
+// Per-draw data, sent with push constants.
+// texture is the index of the texture in the bindless texture table, aoTexture the one of
+// the baked ambient occlusion (see TerrainBake), read at world xy * aoTransform.xy + aoTransform.zw
+struct ObjectPushConstants {
 	alignas(16) glm::mat4 model;
+	alignas(4) uint32_t texture;
+	alignas(4) uint32_t aoTexture = NO_BAKED_AO;
+	alignas(16) glm::vec4 aoTransform;
 };
 
 struct SkyboxUniformBufferObject {
 	alignas(16) glm::mat4 model;
 	alignas(16) glm::mat4 view;
 	alignas(16) glm::mat4 proj;
-	alignas(16) glm::vec4 skyColor;
-	alignas(16) glm::vec4 progress;
+	alignas(16) glm::vec4 time; // x: time of day in [0, 1], the coordinate in the sky lookup table
 };
 
-struct HoverlayUniformBufferObject {
-	alignas(16) glm::mat4 model;
-	alignas(16) glm::mat4 proj;
+// proj * model, so that the block stays within the 128 bytes guaranteed for push constants
+struct HoverlayPushConstants {
+	alignas(16) glm::mat4 transform;
+	alignas(4) uint32_t texture;
+};
+
+struct SkyboxPushConstants {
+	alignas(4) uint32_t starsTexture;
+	alignas(4) uint32_t cloudsTexture;
+	alignas(4) uint32_t skyLutTexture;
+};
+
+// Rows of the sky lookup table, one per quantity, sampled at the time of day
+enum SkyLutRow {
+	SKY_LUT_COLOR,		// sky color, weight of the stars
+	SKY_LUT_AMBIENT,	// ambient light from the sky (GlobalUniformBufferObject::skyColor)
+	SKY_LUT_SUN,		// direction of the sun packed in [0, 1], how much it is above the horizon
+	SKY_LUT_MOON,		// the same for the moon
+	SKY_LUT_ROWS
 };
 
 
@@ -78,6 +125,17 @@ struct TerrainInfo {
 	glm::vec2 center;
 };
 
+// Parts of the scene recorded on separate secondary command buffers, executed in this order:
+// the optional depth pre-pass, then roughly front to back, the vehicle under the chase camera
+// first, and the sky last, behind everything, shading only the pixels left uncovered
+enum ScenePartition {
+	PARTITION_DEPTH_PREPASS,
+	PARTITION_VEHICLE,
+	PARTITION_TERRAIN,
+	PARTITION_SKYBOX,
+	PARTITION_COUNT
+};
+
 enum WheelPosition {
 	FRONT_RIGHT,
 	FRONT_LEFT,
@@ -119,7 +177,7 @@ struct HummerInfo {
 	glm::vec3 pos;
 	float speed = 0.0;
 
-	HummerInfo(float length, float width, float minZ, glm::vec3 startPos, Config config): 
+	HummerInfo(float length, float width, float minZ, glm::vec3 startPos, const Config& config): 
 		scale(config.getFloat("scale")),
 		length(length * config.getFloat("scale")), 
 		width(width * config.getFloat("scale")), 
@@ -166,53 +224,81 @@ protected:
 	//Config hummerConfig = Config("HummerConfig");
 
 	// Descriptor Layouts [what will be passed to the shaders]
+	// Textures are not in these layouts: they are all in textureTable
 	DescriptorSetLayout globalDSL;
-	DescriptorSetLayout objDSL;
 	DescriptorSetLayout skyboxDSL;
-	DescriptorSetLayout hoverlayDSL;
 	//DescriptorSetLayout skyBoxDSL;
 
 	// Pipelines [Shader couples]
 	Pipeline P1;
+	Pipeline P1Instanced;
+	Pipeline P1Indirect;
 	Pipeline skyBoxPipeline;
 	Pipeline hoverlayPipeline;
 
+	// Same as the opaque scene pipelines: depth only, and shading after it (see depthPrepass)
+	Pipeline P1Depth;
+	Pipeline P1InstancedDepth;
+	Pipeline P1IndirectDepth;
+	Pipeline P1Equal;
+	Pipeline P1InstancedEqual;
+	Pipeline P1IndirectEqual;
+
+	// Same as the scene pipelines, counting the layers of overdraw (see overdrawView)
+	Pipeline P1Overdraw;
+	Pipeline P1InstancedOverdraw;
+	Pipeline P1IndirectOverdraw;
+	Pipeline skyBoxOverdraw;
+
 	// Models, textures and Descriptors (values assigned to the uniforms)
+	// The *UBO members are the offsets of the uniform blocks in uniformRing,
+	// the *PC members the push constants of each draw
 	Model terrainModel;
 	Texture terrainTexture;
-	DescriptorSet terrainDS; // objDSL
+	Texture terrainBakeTexture;
+	ObjectPushConstants terrainPC;
 	TerrainInfo terrainInfo;
 
 	Model hummerModel;
 	Texture hummerTexture;
-	DescriptorSet hummerDS; // objDSL
+	ObjectPushConstants hummerPC;
 	HummerInfo* hummerInfo;
 
 	Model wheelModel;
 	Texture wheelTexture;
-	DescriptorSet wheelDSs[4];
+	ObjectPushConstants wheelsPC;
+	uint32_t wheelInstances;
+	glm::mat4 wheelModels[4];
+	uint32_t visibleWheels = 0;
+
+	// Bounds of everything but the sky box and the HUD, tested against the view frustum every frame
+	CullingSet cullingSet;
+	uint32_t hummerBounds;
+	uint32_t wheelBounds[4];
+
+	// The terrain chunks are culled on the GPU
+	GpuDrawList terrainDraws;
+	LightClusters lightClusters;
+	ShadowMaps shadowMaps;
+	uint32_t shadowMapsResource;
 
 	Model skyBoxModel;
 	Texture skyboxStarsTexture;
 	Texture skyboxCloudsTexture;
-	DescriptorSet skyBoxDS;
+	Texture skyLutTexture;
+	// The values of skyLutTexture, SKY_LUT_ROWS rows of SKY_LUT_SIZE texels
+	std::vector<glm::vec4> skyLut;
+	DescriptorSet skyBoxDS; // skyboxDSL
+	uint32_t skyBoxUBO;
+	SkyboxPushConstants skyBoxPC;
 
 	DescriptorSet globalDS; // globalDSL
+	uint32_t globalUBO;
 
-	Model circleModel;
-	DescriptorSet speedometerDS;
-	Texture speedometerTexture;
-
-	DescriptorSet watchDS;
-	Texture watchTexture;
-
-	Model watchHandModel;
-	DescriptorSet watchHandDS;
-	Texture watchHandTexture;
-
-	Model rectangleModel;
-	DescriptorSet speedometerHandDS;
-	Texture speedometerHandTexture;
+	// The whole HUD is a batch of sprites from a single atlas, drawn with one call
+	TextureAtlas hudAtlas;
+	SpriteBatch hudBatch;
+	HoverlayPushConstants hudPC;
 
 	//glm::vec3 hummerPos = glm::vec3(0.0, 0.0, 0.0);
 	const glm::vec3 defaultCameraDistance = glm::vec3(0.8f, 0.0f, 0.4f);
@@ -227,101 +313,65 @@ protected:
 		windowTitle = "Monster Truck Simulator";
 		initialBackgroundColor = { 1.0f, 1.0f, 1.0f, 1.0f };
 
-		// Descriptor pool sizes
-		uniformBlocksInPool = 12;
-		texturesInPool = 12;
-		setsInPool = 12;
+		// Size of the uniform buffer of each frame in flight
+		uniformRingSize = 64 * 1024;
+
+		// Parts of the scene recorded in parallel, see populateCommandBuffer
+		scenePartitions = PARTITION_COUNT;
+
+		// Size of the per-frame instance buffer of the instanced draws
+		maxInstances = 256;
+
+		// Dynamic resolution: GPU time of a frame, in milliseconds, and lowest render scale
+		gpuFrameBudget = 1000.0f / 60.0f;
+		minRenderScale = 0.5f;
 	}
 
 	// Here you load and setup all your Vulkan objects
 	void localInit() {
 		// Descriptor Layouts [what will be passed to the shaders]
 
-		objDSL.init(this, {
+		skyboxDSL.init(this, {
 			// this array contains the binding:
 			// first  element : the binding number
 			// second element : the time of element (buffer or texture)
 			// third  element : the pipeline stage where it will be used
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT},
-			{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT},
-		});
-
-
-		skyboxDSL.init(this, {
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS},
-			{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT},
-			{2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT},
+			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS},
 			});
 
-		hoverlayDSL.init(this, {
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT},
-			{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT},
-		});
-
 		/*skyBoxDSL.init(this, {
 			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT},
 			{1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}
 		});*/
 
 		globalDSL.init(this, {
-			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS},
-		});
-
-		// Pipelines [Shader couples]
-		// The last array, is a vector of pointer to the layouts of the sets that will
-		// be used in this pipeline. The first element will be set 0, and so on..
-		P1.init(this, "shaders/vert.spv", "shaders/frag.spv", { &globalDSL, &objDSL });
-		skyBoxPipeline.init(this, "shaders/SkyBoxVert.spv", "shaders/SkyBoxFrag.spv", { &skyboxDSL });
-		hoverlayPipeline.init(this, "shaders/hoverlayVert.spv", "shaders/hoverlayFrag.spv", { &hoverlayDSL });
-
-		circleModel.init(this, CIRCLE_MODEL_PATH);
-		speedometerTexture.init(this, SPEEDOMETER_TEXTURE_PATH);
-
-		rectangleModel.init(this, RECTANGLE_MODEL_PATH);
-		speedometerHandTexture.init(this, SPEEDOMETER_HAND_TEXTURE_PATH);
-
-		speedometerDS.init(this, &hoverlayDSL, {
-			{0, UNIFORM, sizeof(HoverlayUniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &speedometerTexture},
+			{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS},
+			// lights, clusters and light indices of the clusters
+			{1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT},
+			{2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT},
+			{3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT},
+			// shadow maps of the spot lights
+			{4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT},
 		});
 
-		watchTexture.init(this, WATCH_TEXTURE_PATH);
-
-		watchDS.init(this, &hoverlayDSL, {
-			{0, UNIFORM, sizeof(HoverlayUniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &watchTexture},
-			});
-
-		speedometerHandDS.init(this, &hoverlayDSL, {
-			{0, UNIFORM, sizeof(HoverlayUniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &speedometerHandTexture},
-		});
-
-		watchHandModel.init(this, WATCH_HAND_MODEL_PATH);
-		watchHandTexture.init(this, WATCH_HAND_TEXTURE_PATH);
-
-		watchHandDS.init(this, &hoverlayDSL, {
-			{0, UNIFORM, sizeof(HoverlayUniformBufferObject), nullptr},
-			{1, TEXTURE, 0, &watchHandTexture},
+		// Models and textures
+		// textureTable.add() returns the index the shaders use to sample the texture
+		hudAtlas.init(this, {
+			SPEEDOMETER_TEXTURE_PATH,
+			SPEEDOMETER_HAND_TEXTURE_PATH,
+			WATCH_TEXTURE_PATH,
+			WATCH_HAND_TEXTURE_PATH
 			});
+		hudPC.texture = textureTable.add(&hudAtlas.texture);
+		hudBatch.init(this, 16);
 
 
-		// Models, textures and Descriptors (values assigned to the uniforms)
 		//hummerModel.init(this, HUMMER_MODEL_PATH);
 		//hummerTexture.init(this, HUMMER_TEXTURE_PATH);
 		hummerModel.init(this, hummerConfig.get("model_path"));
 		hummerTexture.init(this, hummerConfig.get("texture_path"));
-
-		hummerDS.init(this, &objDSL, {
-			// the second parameter, is a pointer to the Uniform Set Layout of this set
-			// the last parameter is an array, with one element per binding of the set.
-			// first  elmenet : the binding number
-			// second element : UNIFORM or TEXTURE (an enum) depending on the type
-			// third  element : only for UNIFORMs, the size of the corresponding C++ object
-			// fourth element : only for TEXTUREs, the pointer to the corresponding texture object
-						{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-						{1, TEXTURE, 0, &hummerTexture},
-			});
+		hummerPC.texture = textureTable.add(&hummerTexture);
+		hummerBounds = cullingSet.add(hummerModel.boundsMin, hummerModel.boundsMax);
 
 		std::cout << "Ind. wheels: " << hummerConfig.getBool("independent_wheels") << std::endl;
 
@@ -330,39 +380,167 @@ protected:
 			wheelModel.init(this, hummerConfig.get("wheel_model_path"));
 			wheelTexture.init(this, hummerConfig.get("wheel_texture_path"));
 
+			// The four wheels are drawn with a single instanced draw call:
+			// their model matrices are written to the instance buffer every frame
+			wheelsPC.model = glm::mat4(1.0f);
+			wheelsPC.texture = textureTable.add(&wheelTexture);
+			wheelInstances = instanceBuffer.reserve(4);
 			for (int i = 0; i < 4; i++) {
-				wheelDSs[i].init(this, &objDSL, {
-							{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-							{1, TEXTURE, 0, &wheelTexture},
-					});
+				wheelBounds[i] = cullingSet.add(wheelModel.boundsMin, wheelModel.boundsMax);
 			}
-			
 		}
 		
 
-		terrainModel.init(this, TERRAIN_MODEL_PATH);
-		terrainTexture.init(this, TERRAIN_TEXTURE_PATH);
+		terrainModel.init(this, TERRAIN_MODEL_PATH, TERRAIN_CHUNK_GRID, TERRAIN_LODS);
+		terrainDraws.init(this, &terrainModel, TERRAIN_CHUNK_GRID * TERRAIN_CHUNK_GRID, "shaders/cullComp.spv");
+		for (const ModelChunk& chunk : terrainModel.chunks) {
+			terrainDraws.add(glm::mat4(1.0f), chunk);
+		}
+		// a chunk switches to a coarser level every two chunk sizes from the camera
+		glm::vec3 chunkSize = terrainModel.chunks[0].boundsMax - terrainModel.chunks[0].boundsMin;
+		terrainDraws.lodDistance = 2.0f * glm::max(chunkSize.x, chunkSize.y);
+
 
-		terrainDS.init(this, &objDSL, {
-						{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-						{1, TEXTURE, 0, &terrainTexture},
+		// Pipelines [Shader couples]
+		// The third array, is a vector of pointer to the layouts of the sets that will
+		// be used in this pipeline. The first element will be set 0, and so on..
+		// The texture table follows the sets of the pipeline, GPU driven draw lists come after it.
+		// The last parameters are the size and the stages of the push constants block of every draw.
+		// They are created in parallel, once all the layouts exist.
+		// The lit and sky pipelines only draw with the variants selected every frame,
+		// the overdraw ones with the variant of OVERDRAW_STEPS.
+		for (Pipeline* pipeline : { &P1, &P1Instanced, &P1Indirect, &P1Equal, &P1InstancedEqual,
+			&P1IndirectEqual, &skyBoxPipeline, &P1Overdraw, &P1InstancedOverdraw, &P1IndirectOverdraw,
+			&skyBoxOverdraw }) {
+			pipeline->defaultVariant = false;
+		}
+		initPipelines({
+			[&] {
+				P1.init(this, "shaders/vert.spv", "shaders/frag.spv", { &globalDSL, &textureTable.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+				initLightingVariants(P1);
+			},
+			[&] {
+				// Same as P1, with the model matrices of the instances read from the instance buffer
+				P1Instanced.init(this, "shaders/vertInstanced.spv", "shaders/frag.spv", { &globalDSL, &textureTable.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, true);
+				initLightingVariants(P1Instanced);
+			},
+			[&] {
+				// Same as P1, with the model matrices of the objects of a GPU driven draw list
+				P1Indirect.init(this, "shaders/vertIndirect.spv", "shaders/frag.spv",
+					{ &globalDSL, &textureTable.layout, &terrainDraws.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+				initLightingVariants(P1Indirect);
+			},
+			[&] {
+				// Drawn last at the far plane: the depth test leaves only the uncovered pixels
+				skyBoxPipeline.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+				skyBoxPipeline.depthWrite = false;
+				skyBoxPipeline.init(this, "shaders/SkyBoxVert.spv", "shaders/SkyBoxFrag.spv", { &skyboxDSL, &textureTable.layout },
+					sizeof(SkyboxPushConstants), VK_SHADER_STAGE_FRAGMENT_BIT);
+				skyBoxPipeline.variant(skyVariant(true));
+				skyBoxPipeline.select(skyVariant(false));
+			},
+			[&] {
+				// Depth pre-pass: same vertex shaders and layouts, no fragment shader
+				P1Depth.init(this, "shaders/vert.spv", "", { &globalDSL, &textureTable.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+				P1InstancedDepth.init(this, "shaders/vertInstanced.spv", "", { &globalDSL, &textureTable.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, true);
+				P1IndirectDepth.init(this, "shaders/vertIndirect.spv", "",
+					{ &globalDSL, &textureTable.layout, &terrainDraws.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+			},
+			[&] {
+				// Lighting after the pre-pass: only the nearest fragment passes, the depth is already there
+				for (Pipeline* pipeline : { &P1Equal, &P1InstancedEqual, &P1IndirectEqual }) {
+					pipeline->depthCompareOp = VK_COMPARE_OP_EQUAL;
+					pipeline->depthWrite = false;
+				}
+				P1Equal.init(this, "shaders/vert.spv", "shaders/frag.spv", { &globalDSL, &textureTable.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+				initLightingVariants(P1Equal);
+				P1InstancedEqual.init(this, "shaders/vertInstanced.spv", "shaders/frag.spv", { &globalDSL, &textureTable.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, true);
+				initLightingVariants(P1InstancedEqual);
+				P1IndirectEqual.init(this, "shaders/vertIndirect.spv", "shaders/frag.spv",
+					{ &globalDSL, &textureTable.layout, &terrainDraws.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+				initLightingVariants(P1IndirectEqual);
+			},
+			[&] {
+				// Overdraw view: same vertex shaders and layouts, the fragments are counted.
+				// LESS_OR_EQUAL lets the pre-pass depth through, showing the single layer left.
+				for (Pipeline* pipeline : { &P1Overdraw, &P1InstancedOverdraw, &P1IndirectOverdraw }) {
+					pipeline->depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+				}
+				P1Overdraw.additiveBlend = true;
+				P1Overdraw.init(this, "shaders/vert.spv", "shaders/overdrawFrag.spv", { &globalDSL, &textureTable.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+				P1InstancedOverdraw.additiveBlend = true;
+				P1InstancedOverdraw.init(this, "shaders/vertInstanced.spv", "shaders/overdrawFrag.spv", { &globalDSL, &textureTable.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, true);
+				P1IndirectOverdraw.additiveBlend = true;
+				P1IndirectOverdraw.init(this, "shaders/vertIndirect.spv", "shaders/overdrawFrag.spv",
+					{ &globalDSL, &textureTable.layout, &terrainDraws.layout },
+					sizeof(ObjectPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT);
+				skyBoxOverdraw.additiveBlend = true;
+				skyBoxOverdraw.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+				skyBoxOverdraw.depthWrite = false;
+				skyBoxOverdraw.init(this, "shaders/SkyBoxVert.spv", "shaders/overdrawFrag.spv", { &skyboxDSL, &textureTable.layout },
+					sizeof(SkyboxPushConstants), VK_SHADER_STAGE_FRAGMENT_BIT);
+				for (Pipeline* pipeline : { &P1Overdraw, &P1InstancedOverdraw, &P1IndirectOverdraw, &skyBoxOverdraw }) {
+					pipeline->select(overdrawVariant());
+				}
+			},
+			[&] {
+				hoverlayPipeline.init(this, "shaders/hoverlayVert.spv", "shaders/hoverlayFrag.spv", { &textureTable.layout },
+					sizeof(HoverlayPushConstants), VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+					false, overlayRenderPass);
+			}
 			});
+		terrainTexture.init(this, TERRAIN_TEXTURE_PATH);
+		terrainPC.texture = textureTable.add(&terrainTexture);
+		initTerrainBake();
+		terrainPC.aoTexture = textureTable.add(&terrainBakeTexture);
 
 
 		skyBoxModel.init(this, SKY_BOX_CUBE_MODEL_PATH);
 		skyboxStarsTexture.init(this, SKY_BOX_STARS_TEXTURE_PATH);
 		skyboxCloudsTexture.init(this, SKY_BOX_CLOUDS_TEXTURE_PATH);
+		skyBoxPC.starsTexture = textureTable.add(&skyboxStarsTexture);
+		skyBoxPC.cloudsTexture = textureTable.add(&skyboxCloudsTexture);
+		initSkyLut();
+		skyBoxPC.skyLutTexture = textureTable.add(&skyLutTexture);
+
 
+		// Descriptors (values assigned to the uniforms)
 		skyBoxDS.init(this, &skyboxDSL, {
+			// the second parameter, is a pointer to the Uniform Set Layout of this set
+			// the last parameter is an array, with one element per binding of the set.
+			// first  elmenet : the binding number
+			// second element : UNIFORM or TEXTURE (an enum) depending on the type
+			// third  element : only for UNIFORMs, the size of the corresponding C++ object
+			// fourth element : only for TEXTUREs, the pointer to the corresponding texture object
 						{0, UNIFORM, sizeof(SkyboxUniformBufferObject), nullptr},
-						{1, TEXTURE, 0, &skyboxStarsTexture},
-						{2, TEXTURE, 0, &skyboxCloudsTexture},
 			});
+		skyBoxUBO = uniformRing.reserve(sizeof(SkyboxUniformBufferObject));
+
 
+		lightClusters.init(this, MAX_LIGHTS, MAX_CLUSTER_LIGHT_INDICES);
+		shadowMaps.init(this, HEADLIGHT_SHADOW_MAPS, SHADOW_MAP_SIZE, "shaders/shadowVert.spv");
+		frameGraph.setImage(shadowMapsResource, shadowMaps.texture.textureImage);
 
+		// fifth element : only for STORAGE buffers, the buffers of the frames in flight
 		globalDS.init(this, &globalDSL, {
-						{0, UNIFORM, sizeof(GlobalUniformBufferObject), nullptr}
+						{0, UNIFORM, sizeof(GlobalUniformBufferObject), nullptr},
+						{1, STORAGE, 0, nullptr, &lightClusters.lightBuffers},
+						{2, STORAGE, 0, nullptr, &lightClusters.gridBuffers},
+						{3, STORAGE, 0, nullptr, &lightClusters.indexBuffers},
+						{4, TEXTURE, 0, &shadowMaps.texture}
 			});
+		globalUBO = uniformRing.reserve(sizeof(GlobalUniformBufferObject));
 
 		initInfo();
 	}
@@ -430,234 +608,298 @@ protected:
 
 	// Here you destroy all the objects you created!		
 	void localCleanup() {
-		hummerDS.cleanup();
 		hummerTexture.cleanup();
 		hummerModel.cleanup();
 
 		if (hummerInfo->independentWheels) {
 
-			for (int i = 0; i < 4; i++) {
-				wheelDSs[i].cleanup();
-			}
-
 			wheelTexture.cleanup();
 			wheelModel.cleanup();
 		}
 
 		delete hummerInfo;
 
-		terrainDS.cleanup();
+		terrainDraws.cleanup();
 		terrainModel.cleanup();
 		terrainTexture.cleanup();
-		speedometerTexture.cleanup();
-		rectangleModel.cleanup();
-		speedometerHandTexture.cleanup();
-
-		watchDS.cleanup();
-		watchTexture.cleanup();
-		watchHandDS.cleanup();
-		watchHandTexture.cleanup();
-		watchHandModel.cleanup();
-		speedometerDS.cleanup();
-		speedometerHandDS.cleanup();
+		hudBatch.cleanup();
+		hudAtlas.cleanup();
+
 		skyBoxDS.cleanup();
 		skyBoxModel.cleanup();
 		skyboxStarsTexture.cleanup();
 		skyboxCloudsTexture.cleanup();
-
-		circleModel.cleanup();
+		skyLutTexture.cleanup();
+		terrainBakeTexture.cleanup();
 
 		globalDS.cleanup();
+		lightClusters.cleanup();
+		shadowMaps.cleanup();
 
 		P1.cleanup();
+		P1Instanced.cleanup();
+		P1Indirect.cleanup();
 		skyBoxPipeline.cleanup();
 
+		P1Depth.cleanup();
+		P1InstancedDepth.cleanup();
+		P1IndirectDepth.cleanup();
+		P1Equal.cleanup();
+		P1InstancedEqual.cleanup();
+		P1IndirectEqual.cleanup();
+
+		P1Overdraw.cleanup();
+		P1InstancedOverdraw.cleanup();
+		P1IndirectOverdraw.cleanup();
+		skyBoxOverdraw.cleanup();
+
 		hoverlayPipeline.cleanup();
 
-		hoverlayDSL.cleanup();
 		skyboxDSL.cleanup();
 		globalDSL.cleanup();
-		objDSL.cleanup();
 	}
 
 	// Here it is the creation of the command buffer:
 	// You send to the GPU all the objects you want to draw,
 	// with their buffers and textures
-	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
+	// Each partition is recorded on its own secondary command buffer, possibly in parallel with
+	// the others: it must bind everything it uses and only read the state set in updateUniformBuffer
+	void populateCommandBuffer(VkCommandBuffer commandBuffer, int partition, int currentFrame) {
 
-		// SKYBOX PIPELINE
+		switch (partition) {
 
-		//GLOBAL
+		case PARTITION_DEPTH_PREPASS:
 
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			skyBoxPipeline.graphicsPipeline);
-		/*
+			// Left empty without the pre-pass
+			if (!depthPrepass) break;
 
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			skyBoxPipeline.pipelineLayout, 0, 1, &globalDS.descriptorSets[currentImage],
-			0, nullptr);*/
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				P1Depth.graphicsPipeline);
 
+			vkCmdBindDescriptorSets(commandBuffer,
+				VK_PIPELINE_BIND_POINT_GRAPHICS,
+				P1Depth.pipelineLayout, 0, 1, globalDS.get(currentFrame),
+				1, &globalUBO);
 
-		// SKYBOX
+			textureTable.bind(commandBuffer, P1Depth, 1);
 
-		VkBuffer skyBoxVertexBuffers[] = { skyBoxModel.vertexBuffer };
-		VkDeviceSize skyBoxOffsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, skyBoxVertexBuffers, skyBoxOffsets);
-		vkCmdBindIndexBuffer(commandBuffer, skyBoxModel.indexBuffer, 0,
-			VK_INDEX_TYPE_UINT32);
+			// The same draws as the vehicle and terrain partitions
+			if (cullingSet.isVisible(hummerBounds)) {
+				hummerModel.bind(commandBuffer);
+				P1Depth.draw(commandBuffer, hummerModel, hummerPC);
+			}
 
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			skyBoxPipeline.pipelineLayout, 0, 1, &skyBoxDS.descriptorSets[currentImage],
-			0, nullptr);
+			if (hummerInfo->independentWheels && visibleWheels > 0) {
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+					P1InstancedDepth.graphicsPipeline);
 
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(skyBoxModel.indices.size()), 1, 0, 0, 0);
+				wheelModel.bind(commandBuffer);
+				instanceBuffer.bind(commandBuffer, currentFrame);
 
+				P1InstancedDepth.draw(commandBuffer, wheelModel, wheelsPC, visibleWheels, wheelInstances);
+			}
 
-		// PIPELINE 1
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				P1IndirectDepth.graphicsPipeline);
 
-		// GLOBAL
+			terrainDraws.bind(commandBuffer, P1IndirectDepth, 2, currentFrame);
 
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.graphicsPipeline);
+			terrainModel.bind(commandBuffer);
+			terrainDraws.draw(commandBuffer, currentFrame, P1IndirectDepth, terrainPC);
+			break;
 
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.pipelineLayout, 0, 1, &globalDS.descriptorSets[currentImage],
-			0, nullptr);
+		case PARTITION_SKYBOX:
 
+			// SKYBOX PIPELINE
 
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				scenePipeline(skyBoxPipeline, skyBoxPipeline, skyBoxOverdraw));
 
-		// HUMMER
+			// the texture table is bound once per pipeline, every draw selects its textures by index
+			textureTable.bind(commandBuffer, skyBoxPipeline, 1);
 
-		VkBuffer hummerVertexBuffers[] = {hummerModel.vertexBuffer};
-		// property .vertexBuffer of models, contains the VkBuffer handle to its vertex buffer
-		VkDeviceSize hummerOffsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, hummerVertexBuffers, hummerOffsets);
-		// property .indexBuffer of models, contains the VkBuffer handle to its index buffer
-		vkCmdBindIndexBuffer(commandBuffer, hummerModel.indexBuffer, 0,
-			VK_INDEX_TYPE_UINT32);
 
-		// property .pipelineLayout of a pipeline contains its layout.
-		// property .descriptorSets of a descriptor set contains its elements.
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.pipelineLayout, 1, 1, &hummerDS.descriptorSets[currentImage],
-			0, nullptr);
+			// SKYBOX
 
-		// property .indices.size() of models, contains the number of triangles * 3 of the mesh.
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(hummerModel.indices.size()), 1, 0, 0, 0);
+			skyBoxModel.bind(commandBuffer);
 
+			vkCmdBindDescriptorSets(commandBuffer,
+				VK_PIPELINE_BIND_POINT_GRAPHICS,
+				skyBoxPipeline.pipelineLayout, 0, 1, skyBoxDS.get(currentFrame),
+				1, &skyBoxUBO);
 
-		//WHEELS
+			skyBoxPipeline.draw(commandBuffer, skyBoxModel, skyBoxPC);
+			break;
 
-		if (hummerInfo->independentWheels) {
+		case PARTITION_VEHICLE:
 
-			VkBuffer wheelVertexBuffers[] = { wheelModel.vertexBuffer };
-			VkDeviceSize wheelOffsets[] = { 0 };
-			vkCmdBindVertexBuffers(commandBuffer, 0, 1, wheelVertexBuffers, wheelOffsets);
-			vkCmdBindIndexBuffer(commandBuffer, wheelModel.indexBuffer, 0,
-				VK_INDEX_TYPE_UINT32);
+			// PIPELINE 1
 
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				scenePipeline(P1, P1Equal, P1Overdraw));
 
+			// property .pipelineLayout of a pipeline contains its layout.
+			// get() of a descriptor set returns the set to use in the current frame.
+			vkCmdBindDescriptorSets(commandBuffer,
+				VK_PIPELINE_BIND_POINT_GRAPHICS,
+				P1.pipelineLayout, 0, 1, globalDS.get(currentFrame),
+				1, &globalUBO);
 
-			for (int i = 0; i < 4; i++) {
-				vkCmdBindDescriptorSets(commandBuffer,
-					VK_PIPELINE_BIND_POINT_GRAPHICS,
-					P1.pipelineLayout, 1, 1, &wheelDSs[i].descriptorSets[currentImage],
-					0, nullptr);
+			textureTable.bind(commandBuffer, P1, 1);
 
-				vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(wheelModel.indices.size()), 1, 0, 0, 0);
-			}
-		}
 
+			// HUMMER
 
-		// TERRAIN
+			if (cullingSet.isVisible(hummerBounds)) {
+				// binds the vertex and index buffers of the model
+				hummerModel.bind(commandBuffer);
 
-		VkBuffer terrainVertexBuffers[] = {terrainModel.vertexBuffer};
-		VkDeviceSize terrainOffsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, terrainVertexBuffers, terrainOffsets);
-		vkCmdBindIndexBuffer(commandBuffer, terrainModel.indexBuffer, 0,
-			VK_INDEX_TYPE_UINT32);
+				// pushes the model matrix and texture index, and draws all the triangles of the mesh
+				P1.draw(commandBuffer, hummerModel, hummerPC);
+			}
 
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			P1.pipelineLayout, 1, 1, &terrainDS.descriptorSets[currentImage],
-			0, nullptr);
 
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(terrainModel.indices.size()), 1, 0, 0, 0);
+			//WHEELS
 
+			// only the visible wheels are in the instance buffer
+			if (hummerInfo->independentWheels && visibleWheels > 0) {
 
+				// the instanced pipeline has a compatible layout: the bound sets are still valid
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+					scenePipeline(P1Instanced, P1InstancedEqual, P1InstancedOverdraw));
 
-		// Hoverlay
+				wheelModel.bind(commandBuffer);
+				instanceBuffer.bind(commandBuffer, currentFrame);
 
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-			hoverlayPipeline.graphicsPipeline);
+				P1Instanced.draw(commandBuffer, wheelModel, wheelsPC, visibleWheels, wheelInstances);
+			}
+			break;
 
+		case PARTITION_TERRAIN:
 
-		// Speedomenter
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				scenePipeline(P1Indirect, P1IndirectEqual, P1IndirectOverdraw));
 
+			vkCmdBindDescriptorSets(commandBuffer,
+				VK_PIPELINE_BIND_POINT_GRAPHICS,
+				P1Indirect.pipelineLayout, 0, 1, globalDS.get(currentFrame),
+				1, &globalUBO);
 
-		VkBuffer circleModelVertexBuffers[] = { circleModel.vertexBuffer };
-		VkDeviceSize circleModelOffsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, circleModelVertexBuffers, circleModelOffsets);
-		vkCmdBindIndexBuffer(commandBuffer, circleModel.indexBuffer, 0,
-			VK_INDEX_TYPE_UINT32);
+			textureTable.bind(commandBuffer, P1Indirect, 1);
+			terrainDraws.bind(commandBuffer, P1Indirect, 2, currentFrame);
 
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			hoverlayPipeline.pipelineLayout, 0, 1, &speedometerDS.descriptorSets[currentImage],
-			0, nullptr);
 
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(circleModel.indices.size()), 1, 0, 0, 0);
+			// TERRAIN
 
-		// WATCH
+			// the visible chunks, at their level of detail, as written by the culling pass
+			terrainModel.bind(commandBuffer);
 
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			hoverlayPipeline.pipelineLayout, 0, 1, &watchDS.descriptorSets[currentImage],
-			0, nullptr);
+			terrainDraws.draw(commandBuffer, currentFrame, P1Indirect, terrainPC);
+			break;
+		}
+	}
 
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(circleModel.indices.size()), 1, 0, 0, 0);
+	std::string partitionName(int partition) {
+		switch (partition) {
+		case PARTITION_DEPTH_PREPASS: return "depth pre-pass";
+		case PARTITION_VEHICLE: return "vehicle";
+		case PARTITION_TERRAIN: return "terrain";
+		case PARTITION_SKYBOX: return "skybox";
+		}
+		return BaseProject::partitionName(partition);
+	}
 
-		// Speedometer hand
+	// The HUD, at the native resolution over the upscaled scene
+	void populateOverlayCommands(VkCommandBuffer commandBuffer, int currentFrame) {
 
-		VkBuffer rectangleModelVertexBuffers[] = { rectangleModel.vertexBuffer };
-		VkDeviceSize rectangleModelOffsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, rectangleModelVertexBuffers, rectangleModelOffsets);
-		vkCmdBindIndexBuffer(commandBuffer, rectangleModel.indexBuffer, 0,
-			VK_INDEX_TYPE_UINT32);
+		// Hoverlay
 
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			hoverlayPipeline.pipelineLayout, 0, 1, &speedometerHandDS.descriptorSets[currentImage],
-			0, nullptr);
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+			hoverlayPipeline.graphicsPipeline);
 
-		//vkCmdPipelineBarrier()
+		textureTable.bind(commandBuffer, hoverlayPipeline, 0);
 
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(rectangleModel.indices.size()), 1, 0, 0, 0);
 
+		// Speedometer, watch and their hands, filled in updateUniformBuffer
 
-		// Watch hand
+		hudBatch.draw(commandBuffer, currentFrame, hoverlayPipeline, hudPC);
+	}
 
-		VkBuffer watchModelVertexBuffers[] = { watchHandModel.vertexBuffer };
-		VkDeviceSize watchModelOffsets[] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, watchModelVertexBuffers, watchModelOffsets);
-		vkCmdBindIndexBuffer(commandBuffer, watchHandModel.indexBuffer, 0,
-			VK_INDEX_TYPE_UINT32);
+	// The pre-pass and overdraw pipelines have the layouts of the normal ones:
+	// the sets bound and the constants pushed through any of them stay valid
+	VkPipeline scenePipeline(Pipeline& pipeline, Pipeline& afterPrepass, Pipeline& overdraw) {
+		if (overdrawView) return overdraw.graphicsPipeline;
+		return depthPrepass ? afterPrepass.graphicsPipeline : pipeline.graphicsPipeline;
+	}
 
-		vkCmdBindDescriptorSets(commandBuffer,
-			VK_PIPELINE_BIND_POINT_GRAPHICS,
-			hoverlayPipeline.pipelineLayout, 0, 1, &watchHandDS.descriptorSets[currentImage],
-			0, nullptr);
+	// The variants selected while drawing are all created in advance
+	void initLightingVariants(Pipeline& pipeline) {
+		pipeline.variant(lightingVariant(false));
+		pipeline.select(lightingVariant(true));
+	}
 
-		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(watchHandModel.indices.size()), 1, 0, 0, 0);
-		
+	// The culling and the shadow maps, then the scene that uses them
+	void setupFrameGraph() {
+		uint32_t terrainDrawsResource = frameGraph.importBuffer("terrain draws");
+		// The image is set once created, in localInit
+		shadowMapsResource = frameGraph.importImage("shadow maps",
+			VK_IMAGE_ASPECT_DEPTH_BIT, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+		frameGraph.addPass("terrain culling", [this](VkCommandBuffer commandBuffer) {
+			terrainDraws.cull(commandBuffer, currentFrame);
+		})
+			.read(depthPyramidResource, ACCESS_COMPUTE_READ)
+			.write(terrainDrawsResource, ACCESS_COMPUTE_WRITE);
+
+		// The terrain is the only caster: the chunks in the light frustum, at full detail,
+		// rendered again only when the light moves
+		frameGraph.addPass("shadow maps", [this](VkCommandBuffer commandBuffer) {
+			shadowMaps.record(commandBuffer, [&](uint32_t shadow) {
+				Frustum lightFrustum;
+				lightFrustum.extract(shadowMaps.viewProj(shadow) * terrainPC.model);
+
+				terrainModel.bind(commandBuffer);
+				for (const ModelChunk& chunk : terrainModel.chunks) {
+					if (lightFrustum.intersects(chunk.boundsMin, chunk.boundsMax)) {
+						shadowMaps.draw(commandBuffer, chunk.lods[0], terrainPC.model);
+					}
+				}
+			});
+		})
+			.write(shadowMapsResource, ACCESS_SHADOW_MAP);
+
+		addScenePass()
+			.read(terrainDrawsResource, ACCESS_INDIRECT_DRAW)
+			.read(shadowMapsResource, ACCESS_FRAGMENT_SAMPLED);
+		addDepthPyramidPass();
+		addOverlayPass();
 	}
 
 	const bool ALWAYS_DAY = false;
 
+	// Cone angles of the headlights, in degrees
+	const float HEADLIGHT_INNER_CONE = 0.0f;
+	const float HEADLIGHT_OUTER_CONE = 60.0f;
+
+	// Specialization constants of shader.frag, in constant_id order
+	ShaderVariant lightingVariant(bool spotLights) {
+		return ShaderVariant()
+			.set(0, CLUSTER_COUNT_X)
+			.set(1, CLUSTER_COUNT_Y)
+			.set(2, CLUSTER_COUNT_Z)
+			.set(3, spotLights);
+	}
+
+	// Specialization constants of SkyBoxShader.frag
+	ShaderVariant skyVariant(bool daytimeOnly) {
+		return ShaderVariant().set(0, daytimeOnly);
+	}
+
+	// Specialization constants of overdraw.frag, the same steps that upscale.frag divides by
+	ShaderVariant overdrawVariant() {
+		return ShaderVariant().set(0, OVERDRAW_STEPS);
+	}
+
 	float getDayTime(float deltaTime, float timeSpeed) {
 
 		if (ALWAYS_DAY) return 12;
@@ -680,6 +922,7 @@ protected:
 		glm::vec4 progress; // ( night, sunrise, day, sunset );
 	};
 
+	// Only evaluated to bake the sky lookup table, see initSkyLut
 	void getSkyInfo(float time, SkyInfo& skyInfo) {
 
 		static const float sunriseStart = 4;
@@ -740,6 +983,120 @@ protected:
 		skyInfo.progress = progressVec;
 	}
 
+	// Ambient occlusion of the terrain, from the file of a previous run if the terrain
+	// has not changed since, otherwise baked on all the cores and saved
+	void initTerrainBake() {
+		// the full detail triangles, the first level of every chunk
+		std::vector<glm::vec3> positions(terrainModel.vertices.size());
+		for (size_t i = 0; i < positions.size(); i++) {
+			positions[i] = terrainModel.vertices[i].pos;
+		}
+		std::vector<uint32_t> indices;
+		for (const ModelChunk& chunk : terrainModel.chunks) {
+			indices.insert(indices.end(), terrainModel.indices.begin() + chunk.lods[0].firstIndex,
+				terrainModel.indices.begin() + chunk.lods[0].firstIndex + chunk.lods[0].indexCount);
+		}
+
+		glm::vec3 extent = terrainModel.boundsMax - terrainModel.boundsMin;
+		float maxDistance = TERRAIN_BAKE_REACH * glm::max(extent.x, extent.y);
+
+		TerrainBake bake;
+		uint64_t key = TerrainBake::key(positions, indices, TERRAIN_BAKE_SIZE, TERRAIN_BAKE_RAYS, maxDistance);
+		if (bake.load(TERRAIN_BAKE_PATH, key)) {
+			std::cout << "Terrain bake loaded from " << TERRAIN_BAKE_PATH << "\n";
+		}
+		else {
+			auto start = std::chrono::high_resolution_clock::now();
+
+			WorkerPool bakeWorkers;
+			bakeWorkers.init(std::max(1u, std::thread::hardware_concurrency()) - 1);
+
+			bake.build(positions, indices, TERRAIN_BAKE_SIZE);
+			bake.bake(bakeWorkers, TERRAIN_BAKE_RAYS, maxDistance);
+
+			std::cout << "Terrain baked in " << std::chrono::duration<float, std::chrono::milliseconds::period>(
+				std::chrono::high_resolution_clock::now() - start).count() << " ms on "
+				<< bakeWorkers.workerCount() << " threads\n";
+			bakeWorkers.cleanup();
+
+			bake.save(TERRAIN_BAKE_PATH, key);
+		}
+
+		// values, not colors: no sRGB decoding, and the borders do not wrap around to the opposite side
+		terrainBakeTexture.format = VK_FORMAT_R8G8B8A8_UNORM;
+		terrainBakeTexture.addressMode = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		terrainBakeTexture.init(this, bake.texels.data(), bake.size, bake.size, "terrain bake", UINT32_MAX);
+
+		glm::vec2 scale = glm::vec2(1.0f) / (bake.boundsMax - bake.boundsMin);
+		terrainPC.aoTransform = glm::vec4(scale, -bake.boundsMin * scale);
+	}
+
+	// The sun rises in the middle of the sunrise of getSkyInfo and sets in the middle of
+	// its sunset, going from east (+x) to west overhead. The moon is opposite to it.
+	glm::vec3 sunDirection(float time) {
+		const float sunrise = 6.5f;
+		const float sunset = 20.5f;
+
+		float sinceSunrise = std::fmod(time - sunrise + 24.0f, 24.0f);
+		float angle = sinceSunrise < sunset - sunrise ?
+			glm::pi<float>() * sinceSunrise / (sunset - sunrise) :
+			glm::pi<float>() * (1.0f + (sinceSunrise - sunset + sunrise) / (24.0f - sunset + sunrise));
+
+		return glm::vec3(glm::cos(angle), 0.0f, glm::sin(angle));
+	}
+
+	// Bakes the 24 hours of getSkyInfo and sunDirection into the sky lookup table, once at load time.
+	// The sky shader samples it at the time of day, sampleSkyLut reads the same values on the CPU.
+	void initSkyLut() {
+		skyLut.resize(SKY_LUT_ROWS * SKY_LUT_SIZE);
+
+		for (int i = 0; i < SKY_LUT_SIZE; i++) {
+			// at the texel centers, where linear filtering returns the texel itself
+			float time = 24.0f * (i + 0.5f) / SKY_LUT_SIZE;
+
+			SkyInfo skyInfo{};
+			getSkyInfo(time, skyInfo);
+
+			// the stars fade out during the sunrise and in during the sunset
+			float stars = 0.0f;
+			if (skyInfo.progress.x >= 0.0f) stars = 1.0f;
+			else if (skyInfo.progress.y >= 0.0f) stars = 1.0f - skyInfo.progress.y;
+			else if (skyInfo.progress.w >= 0.0f) stars = skyInfo.progress.w;
+
+			// the discs fade in and out just around the horizon
+			glm::vec3 sun = sunDirection(time);
+			float sunUp = glm::clamp(sun.z * 10.0f + 0.5f, 0.0f, 1.0f);
+			float moonUp = glm::clamp(-sun.z * 10.0f + 0.5f, 0.0f, 1.0f);
+
+			skyLut[SKY_LUT_COLOR * SKY_LUT_SIZE + i] = glm::vec4(skyInfo.skyColor, stars);
+			skyLut[SKY_LUT_AMBIENT * SKY_LUT_SIZE + i] = glm::vec4(skyInfo.skyColor, 1.0f);
+			skyLut[SKY_LUT_SUN * SKY_LUT_SIZE + i] = glm::vec4(sun * 0.5f + glm::vec3(0.5f), sunUp);
+			skyLut[SKY_LUT_MOON * SKY_LUT_SIZE + i] = glm::vec4(-sun * 0.5f + glm::vec3(0.5f), moonUp);
+		}
+
+		std::vector<unsigned char> pixels(skyLut.size() * 4);
+		for (size_t i = 0; i < skyLut.size(); i++) {
+			for (int c = 0; c < 4; c++) {
+				pixels[4 * i + c] = static_cast<unsigned char>(glm::clamp(skyLut[i][c], 0.0f, 1.0f) * 255.0f + 0.5f);
+			}
+		}
+
+		// values, not colors: no sRGB decoding
+		skyLutTexture.format = VK_FORMAT_R8G8B8A8_UNORM;
+		skyLutTexture.init(this, pixels.data(), SKY_LUT_SIZE, SKY_LUT_ROWS, "sky lookup table", 1);
+	}
+
+	// Same as the linear filtering of the sky shader, wrapping around midnight
+	glm::vec4 sampleSkyLut(SkyLutRow row, float time) {
+		float x = time / 24.0f * SKY_LUT_SIZE - 0.5f;
+		float first = glm::floor(x);
+		int i0 = (static_cast<int>(first) + SKY_LUT_SIZE) % SKY_LUT_SIZE;
+		int i1 = (i0 + 1) % SKY_LUT_SIZE;
+
+		const glm::vec4* texels = &skyLut[row * SKY_LUT_SIZE];
+		return glm::mix(texels[i0], texels[i1], x - first);
+	}
+
 	float easeInCubic(float n) {
 		return n * n * n;
 	}
@@ -804,44 +1161,49 @@ protected:
 
 		bool centerFound = false, frontFound = false, rearFound = false, rightFound = false, leftFound = false;
 
-		for (int i = 0; i < terrainModel.indices.size(); i += 3) {
-			Vertex v1 = terrainModel.vertices[terrainModel.indices[i]];
-			Vertex v2 = terrainModel.vertices[terrainModel.indices[i + 1]];
-			Vertex v3 = terrainModel.vertices[terrainModel.indices[i + 2]];
-
-			float areaTot = triangleArea(v1.pos, v2.pos, v3.pos);
-
-			if (!centerFound && isPointInTriangle(hummerCenter, v1, v2, v3, areaTot)) {
-				glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerCenter, v1.pos), pointDistance2D(hummerCenter, v2.pos), pointDistance2D(hummerCenter, v3.pos)));
-				heights.center = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
-				centerFound = true;
-			}
-
-			if (!frontFound && isPointInTriangle(hummerFront, v1, v2, v3, areaTot)) {
-				glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerFront, v1.pos), pointDistance2D(hummerFront, v2.pos), pointDistance2D(hummerFront, v3.pos)));
-				heights.front = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
-				frontFound = true;
-			}
-
-			if (!rearFound && isPointInTriangle(hummerRear, v1, v2, v3, areaTot)) {
-				glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerRear, v1.pos), pointDistance2D(hummerRear, v2.pos), pointDistance2D(hummerRear, v3.pos)));
-				heights.rear = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
-				rearFound = true;
-			}
-
-			if (!rightFound && isPointInTriangle(hummerRight, v1, v2, v3, areaTot)) {
-				glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerRight, v1.pos), pointDistance2D(hummerRight, v2.pos), pointDistance2D(hummerRight, v3.pos)));
-				heights.right = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
-				rightFound = true;
+		// Only the full detail triangles, the first level of every chunk: the coarser levels
+		// follow them in the same index buffer
+		for (const ModelChunk& chunk : terrainModel.chunks) {
+			const IndexRange& range = chunk.lods[0];
+			for (uint32_t i = range.firstIndex; i < range.firstIndex + range.indexCount; i += 3) {
+				Vertex v1 = terrainModel.vertices[terrainModel.indices[i]];
+				Vertex v2 = terrainModel.vertices[terrainModel.indices[i + 1]];
+				Vertex v3 = terrainModel.vertices[terrainModel.indices[i + 2]];
+
+				float areaTot = triangleArea(v1.pos, v2.pos, v3.pos);
+
+				if (!centerFound && isPointInTriangle(hummerCenter, v1, v2, v3, areaTot)) {
+					glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerCenter, v1.pos), pointDistance2D(hummerCenter, v2.pos), pointDistance2D(hummerCenter, v3.pos)));
+					heights.center = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
+					centerFound = true;
+				}
+
+				if (!frontFound && isPointInTriangle(hummerFront, v1, v2, v3, areaTot)) {
+					glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerFront, v1.pos), pointDistance2D(hummerFront, v2.pos), pointDistance2D(hummerFront, v3.pos)));
+					heights.front = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
+					frontFound = true;
+				}
+
+				if (!rearFound && isPointInTriangle(hummerRear, v1, v2, v3, areaTot)) {
+					glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerRear, v1.pos), pointDistance2D(hummerRear, v2.pos), pointDistance2D(hummerRear, v3.pos)));
+					heights.rear = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
+					rearFound = true;
+				}
+
+				if (!rightFound && isPointInTriangle(hummerRight, v1, v2, v3, areaTot)) {
+					glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerRight, v1.pos), pointDistance2D(hummerRight, v2.pos), pointDistance2D(hummerRight, v3.pos)));
+					heights.right = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
+					rightFound = true;
+				}
+
+				if (!leftFound && isPointInTriangle(hummerLeft, v1, v2, v3, areaTot)) {
+					glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerLeft, v1.pos), pointDistance2D(hummerLeft, v2.pos), pointDistance2D(hummerLeft, v3.pos)));
+					heights.left = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
+					leftFound = true;
+				}
+
+				if (frontFound && rearFound && rightFound && leftFound) return;
 			}
-
-			if (!leftFound && isPointInTriangle(hummerLeft, v1, v2, v3, areaTot)) {
-				glm::vec3 d = glm::normalize(glm::vec3(pointDistance2D(hummerLeft, v1.pos), pointDistance2D(hummerLeft, v2.pos), pointDistance2D(hummerLeft, v3.pos)));
-				heights.left = (v1.pos.z * (1 - d.x) + v2.pos.z * (1 - d.y) + v3.pos.z * (1 - d.z)) / ((1 - d.x) + (1 - d.y) + (1 - d.z));
-				leftFound = true;
-			}
-
-			if (frontFound && rearFound && rightFound && leftFound) return;
 		}
 
 	}
@@ -888,12 +1250,14 @@ protected:
 		return xInBounds && yInBounds;
 	}
 
-	bool singleKeyPress(GLFWwindow* window, int key) {
-		static std::map<int, int> keysStatus;
+	bool singleKeyPress(int key) {
+		// Fixed size tables indexed by key code, no allocations while polling
+		static int keysStatus[GLFW_KEY_LAST + 1];
+		static bool keysPolled[GLFW_KEY_LAST + 1];
 
-		int currentKeyStatus = glfwGetKey(window, key);
+		int currentKeyStatus = getKey(key);
 		
-		if (keysStatus.count(key) > 0) {
+		if (keysPolled[key]) {
 			int prevKeyStatus = keysStatus[key];
 			keysStatus[key] = currentKeyStatus;
 
@@ -904,13 +1268,14 @@ protected:
 		}
 		else {
 			keysStatus[key] = currentKeyStatus;
+			keysPolled[key] = true;
 			return currentKeyStatus;
 		}
 	}
 
 	// Here is where you update the uniforms.
 	// Very likely this will be where you will be writing the logic of your application.
-	void updateUniformBuffer(uint32_t currentImage) {
+	void updateUniformBuffer(uint32_t currentFrame) {
 
 		static float lastTime = 0;
 
@@ -921,6 +1286,9 @@ protected:
 		float deltaT = time - lastTime;
 		lastTime = time;
 
+		// Fixed steps in headless runs, so that the same frames are rendered every time
+		if (headless) deltaT = HEADLESS_TIME_STEP;
+
 
 		static float manualCameraYaw = 0;
 
@@ -941,7 +1309,7 @@ protected:
 		bool reverseGear = false;
 		bool breaking = false;
 
-		int controllerConnected = glfwJoystickPresent(GLFW_JOYSTICK_1);
+		int controllerConnected = !headless && glfwJoystickPresent(GLFW_JOYSTICK_1);
 
 		int count;
 		const unsigned char* controllerBtns = controllerConnected ? glfwGetJoystickButtons(GLFW_JOYSTICK_1, &count) : nullptr;
@@ -971,12 +1339,12 @@ protected:
 
 		// Headlight switch
 		
-		if (glfwGetKey(window, GLFW_KEY_H) && !lockLightSwitch) {
+		if (getKey(GLFW_KEY_H) && !lockLightSwitch) {
 			headlightOn = !headlightOn;
 			lockLightSwitch = true;
 		}
 
-		if (glfwGetKey(window, GLFW_KEY_H) == GLFW_RELEASE) {
+		if (getKey(GLFW_KEY_H) == GLFW_RELEASE) {
 			lockLightSwitch = false;
 		}
 
@@ -989,18 +1357,18 @@ protected:
 		}
 
 		// Go forward
-		bool goForward = glfwGetKey(window, GLFW_KEY_W) || (controllerConnected && controllerAxes[5] > -1);
+		bool goForward = getKey(GLFW_KEY_W) || (controllerConnected && controllerAxes[5] > -1);
 
 		if (goForward) {
-			float enginePower = (glfwGetKey(window, GLFW_KEY_W) ? 1.0 : map(controllerAxes[5], -1.0, 1.0, 0.0, 1.0));
+			float enginePower = (getKey(GLFW_KEY_W) ? 1.0 : map(controllerAxes[5], -1.0, 1.0, 0.0, 1.0));
 			if (hummerInfo->speed < hummerInfo->maxEngineSpeed * enginePower) hummerInfo->speed += hummerInfo->acceleration * enginePower;
 		}
 
 		// Go backward
-		bool goBackward = glfwGetKey(window, GLFW_KEY_S) || (controllerConnected && controllerAxes[4] > -1);
+		bool goBackward = getKey(GLFW_KEY_S) || (controllerConnected && controllerAxes[4] > -1);
 
 		if (goBackward) {
-			float enginePower = (glfwGetKey(window, GLFW_KEY_S) ? 1.0 : map(controllerAxes[4], -1.0, 1.0, 0.0, 1.0));
+			float enginePower = (getKey(GLFW_KEY_S) ? 1.0 : map(controllerAxes[4], -1.0, 1.0, 0.0, 1.0));
 			if (hummerInfo->speed > -hummerInfo->maxEngineSpeed * enginePower) hummerInfo->speed -= hummerInfo->acceleration * enginePower;
 
 			if (hummerInfo->speed < 0) reverseGear = true;
@@ -1037,7 +1405,7 @@ protected:
 		}
 
 		// Break
-		if (glfwGetKey(window, GLFW_KEY_B) || (controllerConnected && controllerBtns[GLFW_GAMEPAD_BUTTON_B])) {
+		if (getKey(GLFW_KEY_B) || (controllerConnected && controllerBtns[GLFW_GAMEPAD_BUTTON_B])) {
 			if (hummerInfo->speed > 0) {
 				hummerInfo->speed -= hummerInfo->breakDeceleretion;
 				if (hummerInfo->speed < 0) hummerInfo->speed = 0;
@@ -1053,12 +1421,12 @@ protected:
 		//Rotation
 		float axisValue = controllerConnected ? (glm::abs(controllerAxes[0]) < 0.1 ? 0.0 : controllerAxes[0]) : 0.0;
 
-		bool rotateLeft = glfwGetKey(window, GLFW_KEY_A) || axisValue < 0.0;
-		bool rotateRight = glfwGetKey(window, GLFW_KEY_D) || axisValue > 0.0;
+		bool rotateLeft = getKey(GLFW_KEY_A) || axisValue < 0.0;
+		bool rotateRight = getKey(GLFW_KEY_D) || axisValue > 0.0;
 
 		float rotationAxis = 0.0f;
 
-		bool rotationWithKeyboard = glfwGetKey(window, GLFW_KEY_A) || glfwGetKey(window, GLFW_KEY_D);
+		bool rotationWithKeyboard = getKey(GLFW_KEY_A) || getKey(GLFW_KEY_D);
 
 		if (rotateLeft || rotateRight) {
 			rotationAxis = (rotateRight ? -1 : 1) * hummerInfo->rotSpeed * (rotationWithKeyboard ? 1.0 : glm::abs(axisValue));
@@ -1070,44 +1438,44 @@ protected:
 
 		axisValue = controllerConnected ? (glm::abs(controllerAxes[2]) < 0.1 ? 0.0 : controllerAxes[2]) : 0.0;
 
-		bool rotateCameraLeft = glfwGetKey(window, GLFW_KEY_LEFT) || axisValue < 0.0;
-		bool rotateCameraRight = glfwGetKey(window, GLFW_KEY_RIGHT) || axisValue > 0.0;
+		bool rotateCameraLeft = getKey(GLFW_KEY_LEFT) || axisValue < 0.0;
+		bool rotateCameraRight = getKey(GLFW_KEY_RIGHT) || axisValue > 0.0;
 
 		if (rotateCameraLeft) {
-			float rotSpeed = glm::radians(2.0) * (glfwGetKey(window, GLFW_KEY_LEFT) ? 1.0 : glm::abs(axisValue));
+			float rotSpeed = glm::radians(2.0) * (getKey(GLFW_KEY_LEFT) ? 1.0 : glm::abs(axisValue));
 			manualCameraYaw -= rotSpeed;
 		}
 		else if (rotateCameraRight) {
-			float rotSpeed = glm::radians(2.0) * (glfwGetKey(window, GLFW_KEY_RIGHT) ? 1.0 : axisValue);
+			float rotSpeed = glm::radians(2.0) * (getKey(GLFW_KEY_RIGHT) ? 1.0 : axisValue);
 			manualCameraYaw += rotSpeed;
 		}
 
 		axisValue = controllerConnected ? (glm::abs(controllerAxes[3]) < 0.1 ? 0.0 : controllerAxes[3]) : 0.0;
 
-		bool rotateCameraUp = glfwGetKey(window, GLFW_KEY_UP) || axisValue > 0.0;
-		bool rotateCameraDown = glfwGetKey(window, GLFW_KEY_DOWN) || axisValue < 0.0;
+		bool rotateCameraUp = getKey(GLFW_KEY_UP) || axisValue > 0.0;
+		bool rotateCameraDown = getKey(GLFW_KEY_DOWN) || axisValue < 0.0;
 
 		if (rotateCameraUp) {
-			float delta = 0.01 * (glfwGetKey(window, GLFW_KEY_UP) ? 1.0 : axisValue);
+			float delta = 0.01 * (getKey(GLFW_KEY_UP) ? 1.0 : axisValue);
 			cameraDistance.z -= delta;
 			if (cameraDistance.z < 0.2) cameraDistance.z = 0.2;
 		}
 		else if (rotateCameraDown) {
-			float delta = 0.01 * (glfwGetKey(window, GLFW_KEY_DOWN) ? 1.0 : glm::abs(axisValue));
+			float delta = 0.01 * (getKey(GLFW_KEY_DOWN) ? 1.0 : glm::abs(axisValue));
 			cameraDistance.z += delta;
 			if (cameraDistance.z > 1.5) cameraDistance.z = 1.5;
 		}
 
 
-		if (glfwGetKey(window, GLFW_KEY_P)) {
+		if (getKey(GLFW_KEY_P)) {
 			cameraDistance.x -= 0.01;
 		}
-		if (glfwGetKey(window, GLFW_KEY_L)) {
+		if (getKey(GLFW_KEY_L)) {
 			cameraDistance.x += 0.01;
 		}
 
 		// Reset camera position
-		if (glfwGetKey(window, GLFW_KEY_R)) {
+		if (getKey(GLFW_KEY_R)) {
 			manualCameraYaw = 0.0;
 			cameraDistance = defaultCameraDistance;
 		}
@@ -1157,17 +1525,17 @@ protected:
 		/*static float debugPitch = 0;
 		static float debugRoll = 0;
 
-		if (glfwGetKey(window, GLFW_KEY_O)) {
+		if (getKey(GLFW_KEY_O)) {
 			debugPitch += glm::radians(2.0);
 		}
-		if (glfwGetKey(window, GLFW_KEY_K)) {
+		if (getKey(GLFW_KEY_K)) {
 			debugPitch -= glm::radians(2.0);
 		}
 
-		if (glfwGetKey(window, GLFW_KEY_I)) {
+		if (getKey(GLFW_KEY_I)) {
 			debugRoll += glm::radians(2.0);
 		}
-		if (glfwGetKey(window, GLFW_KEY_J)) {
+		if (getKey(GLFW_KEY_J)) {
 			debugRoll -= glm::radians(2.0);
 		}
 
@@ -1213,11 +1581,58 @@ protected:
 		static bool timeStopped = false;
 		float dayTime;
 
-		if (singleKeyPress(window, GLFW_KEY_U)) {
+		if (singleKeyPress(GLFW_KEY_U)) {
 			timeStopped = !timeStopped;
 		}
 
-		if (glfwGetKey(window, GLFW_KEY_Y)) dayTime = getDayTime(deltaT, 5.0);
+		// GPU memory debug dump
+		if (singleKeyPress(GLFW_KEY_M)) {
+			AllowHeapAllocations debugDump;
+			memoryTracker.printSummary(std::cout);
+			memoryTracker.printAllocations(std::cout);
+		}
+
+		// Overdraw heatmap
+		if (singleKeyPress(GLFW_KEY_V)) {
+			overdrawView = !overdrawView;
+			AllowHeapAllocations debugDump;
+			std::cout << "Overdraw view " << (overdrawView ? "on" : "off")
+				<< ": black for no layer, from blue for 1 to red for 8 or more\n";
+		}
+
+		// Depth pre-pass, compare the GPU frame times printed with T
+		if (singleKeyPress(GLFW_KEY_Z)) {
+			depthPrepass = !depthPrepass;
+			AllowHeapAllocations debugDump;
+			std::cout << "Depth pre-pass " << (depthPrepass ? "on" : "off") << "\n";
+		}
+
+		// Command buffer recording and GPU timings, and culling counters
+		if (singleKeyPress(GLFW_KEY_T)) {
+			AllowHeapAllocations debugDump;
+			printRecordingStats();
+			printResolutionStats();
+			gpuProfiler.printSummary(std::cout);
+			std::cout << "Culling: " << cullingSet.tested() << " objects tested, "
+				<< cullingSet.visibleObjects() << " visible\n";
+			const CullStats& terrainStats = terrainDraws.lastStats;
+			std::cout << "Terrain chunks: " << terrainStats.tested << " tested, "
+				<< terrainStats.frustumCulled << " outside the frustum, "
+				<< terrainStats.occlusionCulled << " occluded ("
+				<< (terrainStats.tested ? 100.0f * terrainStats.occlusionCulled / terrainStats.tested : 0.0f)
+				<< "%)\n";
+			std::cout << "Lights: " << lightClusters.lights.size() << ", "
+				<< lightClusters.usedIndices / static_cast<float>(CLUSTER_COUNT) << " per cluster on average, "
+				<< lightClusters.busiestCluster << " in the busiest cluster\n";
+			float shadowFrames = static_cast<float>(std::max<uint64_t>(shadowMaps.frames, 1));
+			std::cout << "Shadow maps: " << shadowMaps.renders << " renders, "
+				<< shadowMaps.triangles << " triangles, "
+				<< shadowMaps.recordingTime << " ms recording (average "
+				<< shadowMaps.totalRenders / shadowFrames << " renders, "
+				<< shadowMaps.totalTriangles / shadowFrames << " triangles per frame)\n";
+		}
+
+		if (getKey(GLFW_KEY_Y)) dayTime = getDayTime(deltaT, 5.0);
 		else if(!timeStopped) dayTime = getDayTime(deltaT);
 		else dayTime = getDayTime(deltaT, 0);
 
@@ -1236,11 +1651,8 @@ protected:
 		
 
 		GlobalUniformBufferObject gubo{};
-		UniformBufferObject ubo{};
 		SkyboxUniformBufferObject subo{};
 		//LightsUniformBufferObject lubo{};
-		
-		void* data;
 
 		float cameraYaw = yaw + glm::radians(90.0) + manualCameraYaw;
 
@@ -1255,7 +1667,7 @@ protected:
 
 		gubo.proj = glm::perspective(glm::radians(90.0f),
 			swapChainExtent.width / (float)swapChainExtent.height,
-			0.02f, 10.0f);
+			NEAR_PLANE, FAR_PLANE);
 		gubo.proj[1][1] *= -1;
 
 		subo.view = gubo.view;
@@ -1263,54 +1675,72 @@ protected:
 			swapChainExtent.width / (float)swapChainExtent.height,
 			0.02f, 40.0f);
 		subo.proj[1][1] *= -1;
+		lightClusters.clear();
+
 		// HEADLIGHTS (SPOT LIGHTS)
 
-		gubo.leftHeadLightPos = hummerInfo->pos + hummerInfo->leftHeadLightPos * rotMat;
-		gubo.leftHeadLightDir = glm::vec3(glm::sin(yaw), -glm::cos(yaw), -pitch - glm::radians(35.0));
+		glm::vec3 leftHeadLightPos = hummerInfo->pos + hummerInfo->leftHeadLightPos * rotMat;
+		glm::vec3 rightHeadLightPos = hummerInfo->pos + hummerInfo->rightHeadLightPos * rotMat;
+		glm::vec3 headLightDir = glm::vec3(glm::sin(yaw), -glm::cos(yaw), -pitch - glm::radians(35.0));
 
-		gubo.rightHeadLightPos = hummerInfo->pos + hummerInfo->rightHeadLightPos * rotMat;
-		gubo.rightHeadLightDir = glm::vec3(glm::sin(yaw), -glm::cos(yaw), -pitch - glm::radians(35.0));
+		glm::vec3 headLightsColor = glm::mix(glm::vec3(0.0), glm::vec3(1.0, 1.0, 0.7), headlightIntensity);
 
-		//gubo.headLightSize = 0.225 * hummerInfo->scale;
-		//gubo.headLightDecay = 6.0;
-		
+		// switched off, the headlights are not lit at all
+		if (headlightIntensity > 0.0f) {
+			shadowMaps.setLight(0, leftHeadLightPos, headLightDir, HEADLIGHT_OUTER_CONE, FAR_PLANE, camPos);
+			shadowMaps.setLight(1, rightHeadLightPos, headLightDir, HEADLIGHT_OUTER_CONE, FAR_PLANE, camPos);
 
-		gubo.headLightsColor = glm::mix(glm::vec3(0.0), glm::vec3(1.0, 1.0, 0.7), headlightIntensity);
+			lightClusters.addSpotLight(leftHeadLightPos, headLightDir, headLightsColor,
+				HEADLIGHT_INNER_CONE, HEADLIGHT_OUTER_CONE, FAR_PLANE, 0);
+			lightClusters.addSpotLight(rightHeadLightPos, headLightDir, headLightsColor,
+				HEADLIGHT_INNER_CONE, HEADLIGHT_OUTER_CONE, FAR_PLANE, 1);
+
+			// glow around the headlights
+			lightClusters.addPointLight(leftHeadLightPos, headLightsColor, 0.013f, 6.0f);
+			lightClusters.addPointLight(rightHeadLightPos, headLightsColor, 0.013f, 6.0f);
+		}
 
 
 		// REAR LIGHTS
-		gubo.rearLightsColor = (reverseGear ? glm::vec3(0.2) : glm::vec3(breaking ? 0.2 : 0.1, 0.0, 0.0)); // / glm::vec3(5.0);
+		glm::vec3 rearLightsColor = (reverseGear ? glm::vec3(0.2) : glm::vec3(breaking ? 0.2 : 0.1, 0.0, 0.0)); // / glm::vec3(5.0);
 
-		gubo.leftRearLightPos = hummerInfo->pos + hummerInfo->leftRearLightPos * rotMat;
-		gubo.rightRearLightPos = hummerInfo->pos + hummerInfo->rightRearLightPos * rotMat;
+		lightClusters.addPointLight(hummerInfo->pos + hummerInfo->leftRearLightPos * rotMat,
+			rearLightsColor, 0.01f, 2.0f);
+		lightClusters.addPointLight(hummerInfo->pos + hummerInfo->rightRearLightPos * rotMat,
+			rearLightsColor, 0.01f, 2.0f);
 
-		//gubo.rearLightSize = 0.1 * hummerInfo->scale;
-		//gubo.rearLightDecay = 2.0;
+		lightClusters.build(currentFrame, gubo.view, gubo.proj, NEAR_PLANE, FAR_PLANE);
+		gubo.clusterParams = lightClusters.shaderParams();
+		for (uint32_t shadow = 0; shadow < HEADLIGHT_SHADOW_MAPS; shadow++) {
+			gubo.shadowViewProj[shadow] = shadowMaps.viewProj(shadow);
+		}
 
-		SkyInfo skyInfo{};
+		// without spot lights, their code is compiled out of the fragment shader
+		ShaderVariant lighting = lightingVariant(lightClusters.hasSpotLights());
+		P1.select(lighting);
+		P1Instanced.select(lighting);
+		P1Indirect.select(lighting);
+		P1Equal.select(lighting);
+		P1InstancedEqual.select(lighting);
+		P1IndirectEqual.select(lighting);
 
-		getSkyInfo(dayTime, skyInfo);
+		// the sky of the time of day, baked in the sky lookup table
+		float stars = sampleSkyLut(SKY_LUT_COLOR, dayTime).a;
+		skyBoxPipeline.select(skyVariant(ALWAYS_DAY || stars == 0.0f));
 
-		gubo.skyColor = skyInfo.skyColor;
+		gubo.skyColor = glm::vec3(sampleSkyLut(SKY_LUT_AMBIENT, dayTime));
 
-		vkMapMemory(device, globalDS.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(gubo), 0, &data);
-		memcpy(data, &gubo, sizeof(gubo));
-		vkUnmapMemory(device, globalDS.uniformBuffersMemory[0][currentImage]);
+		uniformRing.write(currentFrame, globalUBO, gubo);
 		
 
 		// HUMMER
-		ubo.model =
+		hummerPC.model =
 			glm::translate(glm::mat4(1.0f), hummerInfo->pos) *
 			glm::rotate(glm::mat4(1.0f), yaw, glm::vec3(0.0, 0.0, 1.0)) *
 			glm::rotate(glm::mat4(1.0f), pitch, glm::vec3(1.0, 0.0, 0.0)) *
 			glm::rotate(glm::mat4(1.0f), roll, glm::vec3(0.0, 1.0, 0.0)) *
 			glm::scale(glm::mat4(1.0f), glm::vec3(hummerInfo->scale));
 
-		vkMapMemory(device, hummerDS.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(ubo), 0, &data);
-		memcpy(data, &ubo, sizeof(ubo));
-		vkUnmapMemory(device, hummerDS.uniformBuffersMemory[0][currentImage]);
 
 
 		// WHEELS
@@ -1333,7 +1763,7 @@ protected:
 					wheelYaw = rotationAxis * 0.5;
 
 
-				ubo.model =
+				wheelModels[i] =
 					glm::translate(glm::mat4(1.0f), wheelPos) *
 					glm::rotate(glm::mat4(1.0f), yaw, glm::vec3(0.0, 0.0, 1.0)) *
 					glm::rotate(glm::mat4(1.0f), pitch, glm::vec3(1.0, 0.0, 0.0)) *
@@ -1342,22 +1772,41 @@ protected:
 					glm::rotate(glm::mat4(1.0f), wheelPitch, glm::vec3(1.0, 0.0, 0.0)) *
 					glm::rotate(glm::mat4(1.0f), wheelRoll, glm::vec3(0.0, 1.0, 0.0)) *
 					glm::scale(glm::mat4(1.0f), glm::vec3(hummerInfo->scale));
-
-				vkMapMemory(device, wheelDSs[i].uniformBuffersMemory[0][currentImage], 0,
-					sizeof(ubo), 0, &data);
-				memcpy(data, &ubo, sizeof(ubo));
-				vkUnmapMemory(device, wheelDSs[i].uniformBuffersMemory[0][currentImage]);
 			}
 		}
 
 
 		// TERRAIN
-		ubo.model = glm::mat4(1.0f);
-		
-		vkMapMemory(device, terrainDS.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(ubo), 0, &data);
-		memcpy(data, &ubo, sizeof(ubo));
-		vkUnmapMemory(device, terrainDS.uniformBuffersMemory[0][currentImage]);
+		terrainPC.model = glm::mat4(1.0f);
+
+
+		// CULLING
+
+		// the bounds of the vehicle follow it
+		glm::vec3 boundsMin, boundsMax;
+		transformBounds(hummerPC.model, hummerModel.boundsMin, hummerModel.boundsMax, boundsMin, boundsMax);
+		cullingSet.update(hummerBounds, boundsMin, boundsMax);
+
+		if (hummerInfo->independentWheels) {
+			for (int i = 0; i < 4; i++) {
+				transformBounds(wheelModels[i], wheelModel.boundsMin, wheelModel.boundsMax, boundsMin, boundsMax);
+				cullingSet.update(wheelBounds[i], boundsMin, boundsMax);
+			}
+		}
+
+		Frustum frustum;
+		frustum.extract(gubo.proj * gubo.view);
+		cullingSet.cull(frustum);
+		terrainDraws.setView(currentFrame, frustum, gubo.proj * gubo.view, camPos);
+
+		visibleWheels = 0;
+		if (hummerInfo->independentWheels) {
+			for (int i = 0; i < 4; i++) {
+				if (cullingSet.isVisible(wheelBounds[i])) {
+					instanceBuffer.data(currentFrame, wheelInstances)[visibleWheels++].model = wheelModels[i];
+				}
+			}
+		}
 
 		// SKYBOX
 
@@ -1365,34 +1814,28 @@ protected:
 			glm::translate(glm::mat4(1.0f), glm::vec3(terrainInfo.center, 1.0)) *
 			glm::scale(glm::mat4(1.0), glm::vec3(20.0));
 
-		subo.skyColor = glm::vec4(skyInfo.skyColor, 1.0);
-		subo.progress = skyInfo.progress;
+		subo.time = glm::vec4(dayTime / 24.0f, 0.0f, 0.0f, 0.0f);
 
-		vkMapMemory(device, skyBoxDS.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(subo), 0, &data);
-		memcpy(data, &subo, sizeof(subo));
-		vkUnmapMemory(device, skyBoxDS.uniformBuffersMemory[0][currentImage]);
+		uniformRing.write(currentFrame, skyBoxUBO, subo);
 
 
 		// Hoverlay
 
-		HoverlayUniformBufferObject hubo {};
-
 		float aspectRatio = (float)swapChainExtent.width / (float)swapChainExtent.height;
 
+		// The HUD space spans [-aspectRatio, aspectRatio] horizontally and [-1, 1] vertically
+		hudPC.transform = glm::ortho(-1.0f * aspectRatio, 1.0f * aspectRatio, -1.0f, 1.0f, 0.0f, 1.0f);
+
+		hudBatch.begin();
+
+		// The dials are behind their hands, that rotate around their left end
+
 		// Speedometer
 
 		glm::vec2 speedometerPos(0.8 * aspectRatio, 0.65);
 
-		hubo.model = 
-			glm::translate(glm::mat4(1.0), glm::vec3(speedometerPos, -0.1)) *
-			glm::scale(glm::mat4(1.0), glm::vec3(0.3));
-		hubo.proj = glm::ortho(-1.0f * aspectRatio, 1.0f * aspectRatio, -1.0f, 1.0f, 0.0f, 1.0f);
-
-		vkMapMemory(device, speedometerDS.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(subo), 0, &data);
-		memcpy(data, &hubo, sizeof(hubo));
-		vkUnmapMemory(device, speedometerDS.uniformBuffersMemory[0][currentImage]);
+		hudBatch.add(currentFrame, hudAtlas.regions[SPRITE_SPEEDOMETER], speedometerPos,
+			glm::vec2(0.6f), 0.0f, glm::vec2(0.5f), -0.1f);
 
 
 		// Speedometer hand
@@ -1404,58 +1847,33 @@ protected:
 
 		float speedometerAngle = map(glm::abs(speed), 0.0, hummerInfo->maxSpeed, minAngle, maxAngle);
 
-		//std::cout << "Speed: " << hummerInfo->speed << " - Angle: " << speedometerAngle << std::endl;
+		hudBatch.add(currentFrame, hudAtlas.regions[SPRITE_SPEEDOMETER_HAND], speedometerPos,
+			glm::vec2(0.26f, 0.05f), speedometerAngle, glm::vec2(0.0f, 0.5f), 0.0f);
 
-		hubo.model = 
-			glm::translate(glm::mat4(1.0), glm::vec3(speedometerPos, 0.0)) *
-			glm::rotate(glm::mat4(1.0), speedometerAngle, glm::vec3(0.0, 0.0, 1.0)) *
-			glm::scale(glm::mat4(1.0), glm::vec3(0.04, 0.065, 0.04));
-		//hubo.proj = glm::ortho(-1.0f * aspectRatio, 1.0f * aspectRatio, -1.0f, 1.0f);
-
-		vkMapMemory(device, speedometerHandDS.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(subo), 0, &data);
-		memcpy(data, &hubo, sizeof(hubo));
-		vkUnmapMemory(device, speedometerHandDS.uniformBuffersMemory[0][currentImage]);
 
 		// Watch
 
 		glm::vec2 watchPos(0.8 * aspectRatio, -0.65);
 
-		hubo.model =
-			glm::translate(glm::mat4(1.0), glm::vec3(watchPos, -0.1)) *
-			glm::scale(glm::mat4(1.0), glm::vec3(0.2));
-		hubo.proj = glm::ortho(-1.0f * aspectRatio, 1.0f * aspectRatio, -1.0f, 1.0f, 0.0f, 1.0f);
+		hudBatch.add(currentFrame, hudAtlas.regions[SPRITE_WATCH], watchPos,
+			glm::vec2(0.4f), 0.0f, glm::vec2(0.5f), -0.1f);
 
-		vkMapMemory(device, watchDS.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(subo), 0, &data);
-		memcpy(data, &hubo, sizeof(hubo));
-		vkUnmapMemory(device, watchDS.uniformBuffersMemory[0][currentImage]);
 
 		// Watch hand
 
 		float watchHandAngle = glm::radians(180.0f + 30.0f * dayTime);
 
-		//std::cout << "Speed: " << hummerInfo->speed << " - Angle: " << speedometerAngle << std::endl;
-
-		hubo.model =
-			glm::translate(glm::mat4(1.0), glm::vec3(watchPos, 0.0)) *
-			glm::rotate(glm::mat4(1.0), watchHandAngle, glm::vec3(0.0, 0.0, 1.0)) *
-			glm::scale(glm::mat4(1.0), glm::vec3(0.04, 0.065, 0.04));
-		//hubo.proj = glm::ortho(-1.0f * aspectRatio, 1.0f * aspectRatio, -1.0f, 1.0f);
-
-		vkMapMemory(device, watchHandDS.uniformBuffersMemory[0][currentImage], 0,
-			sizeof(subo), 0, &data);
-		memcpy(data, &hubo, sizeof(hubo));
-		vkUnmapMemory(device, watchHandDS.uniformBuffersMemory[0][currentImage]);
+		hudBatch.add(currentFrame, hudAtlas.regions[SPRITE_WATCH_HAND], watchPos,
+			glm::vec2(0.17f, 0.034f), watchHandAngle, glm::vec2(0.0f, 0.5f), 0.0f);
 	}
 };
 
 // This is the main: probably you do not need to touch this!
-int main() {
+int main(int argc, char* argv[]) {
 	MonsterTruckSimulator app;
 
 	try {
-		app.run();
+		app.run(argc, argv);
 	}
 	catch (const std::exception& e) {
 		std::cerr << e.what() << std::endl;
@@ -12,10 +12,18 @@
 #include <cstring>
 #include <optional>
 #include <set>
+#include <map>
 #include <cstdint>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
+#include <functional>
+#include <exception>
 #include <array>
+#include <limits>
+#include <unordered_map>
+#include <deque>
+#include <cassert>
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
@@ -31,9 +39,60 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
+#include "MemoryTracker.h"
+#include "AllocationCheck.h"
+#include "WorkerPool.h"
+#include "PipelineCache.h"
+#include "Culling.h"
+#include "Trace.h"
+
 //
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+// Frames the CPU prepares while the GPU still draws the previous ones. Every per-frame
+// resource (command buffers, uniforms, read backs) exists BaseProject::framesInFlight times,
+// chosen with --frames-in-flight: 1 for the lowest latency, up to 3 for throughput.
+const uint32_t MAX_FRAMES_IN_FLIGHT = 3;
+const uint32_t DEFAULT_FRAMES_IN_FLIGHT = 2;
+
+// Compiled pipelines kept between runs, in the working directory
+const std::string PIPELINE_CACHE_PATH = "pipeline_cache.bin";
+
+// Headless runs (--headless): frames rendered when --frames is not given, and the
+// fixed time step of the simulation, so that every run renders the same frames
+const uint32_t DEFAULT_HEADLESS_FRAMES = 300;
+const float HEADLESS_TIME_STEP = 1.0f / 60.0f;
+
+// Dynamic resolution: frames between two changes of the render scale, weight of a new
+// GPU frame time in the running average, largest change of the scale at once, and the
+// fraction of the budget under which the scale grows again
+const uint32_t RENDER_SCALE_SETTLE_FRAMES = 30;
+const float GPU_TIME_SMOOTHING = 0.1f;
+const float MAX_RENDER_SCALE_STEP = 0.1f;
+const float RENDER_SCALE_HEADROOM = 0.8f;
+
+// GPU profiler: frames in its rolling statistics
+const uint32_t GPU_PROFILER_HISTORY = 120;
+
+// --trace: events kept for the trace file, and its rows
+const size_t TRACE_CAPACITY = 1 << 19;
+const uint32_t TRACE_TRACK_MAIN = 1;
+const uint32_t TRACE_TRACK_GPU = 2;
+
+// Strength of the sharpening applied by the upscaler below the native resolution
+const float UPSCALE_SHARPNESS = 0.25f;
+
+// Overdraw view: layers of overdraw a pixel of the scene color can count, each fragment
+// adding 1 / OVERDRAW_STEPS (a specialization constant of overdraw.frag)
+const float OVERDRAW_STEPS = 16.0f;
+
+// Size of the bindless texture table
+const uint32_t MAX_BINDLESS_TEXTURES = 1024;
+
+// Descriptor sets allocated by each descriptor pool, a new pool is created when one is full
+const uint32_t SETS_PER_DESCRIPTOR_POOL = 64;
+
+// Levels of detail of a model chunk, the first one is the full mesh
+const uint32_t MAX_MODEL_LODS = 4;
 
 // Lesson 22.0
 const std::vector<const char*> validationLayers = {
@@ -42,27 +101,45 @@ const std::vector<const char*> validationLayers = {
 
 // Lesson 13
 const std::vector<const char*> deviceExtensions = {
-	VK_KHR_SWAPCHAIN_EXTENSION_NAME
+	VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+	VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME
+};
+
+// Enabled only if the device supports them
+const std::vector<const char*> optionalDeviceExtensions = {
+	VK_EXT_MEMORY_BUDGET_EXTENSION_NAME
 };
 
 // Lesson 17
+// Per-instance data of instanced draws, read from vertex binding 1
+struct InstanceData {
+	glm::mat4 model;
+};
+
 struct Vertex {
 	glm::vec3 pos;
 	glm::vec3 norm;
 	glm::vec2 texCoord;
 
-	static VkVertexInputBindingDescription getBindingDescription() {
-		VkVertexInputBindingDescription bindingDescription{};
-		bindingDescription.binding = 0;
-		bindingDescription.stride = sizeof(Vertex);
-		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+	// Binding 0 is per vertex, binding 1 per instance (used by instanced pipelines only)
+	static std::array<VkVertexInputBindingDescription, 2> getBindingDescriptions() {
+		std::array<VkVertexInputBindingDescription, 2> bindingDescriptions{};
+		bindingDescriptions[0].binding = 0;
+		bindingDescriptions[0].stride = sizeof(Vertex);
+		bindingDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+		bindingDescriptions[1].binding = 1;
+		bindingDescriptions[1].stride = sizeof(InstanceData);
+		bindingDescriptions[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
 
-		return bindingDescription;
+		return bindingDescriptions;
 	}
 
-	static std::array<VkVertexInputAttributeDescription, 3>
+	// The first three attributes are per vertex. The per-instance model matrix
+	// takes one location per column, from 3 to 6.
+	static std::array<VkVertexInputAttributeDescription, 7>
 		getAttributeDescriptions() {
-		std::array<VkVertexInputAttributeDescription, 3>
+		std::array<VkVertexInputAttributeDescription, 7>
 			attributeDescriptions{};
 
 		attributeDescriptions[0].binding = 0;
@@ -80,6 +157,14 @@ struct Vertex {
 		attributeDescriptions[2].format = VK_FORMAT_R32G32_SFLOAT;
 		attributeDescriptions[2].offset = offsetof(Vertex, texCoord);
 
+		for (uint32_t column = 0; column < 4; column++) {
+			attributeDescriptions[3 + column].binding = 1;
+			attributeDescriptions[3 + column].location = 3 + column;
+			attributeDescriptions[3 + column].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+			attributeDescriptions[3 + column].offset =
+				offsetof(InstanceData, model) + column * sizeof(glm::vec4);
+		}
+
 		return attributeDescriptions;
 	}
 };
@@ -179,8 +264,22 @@ void PrintVkError(VkResult result) {
 
 class BaseProject;
 
+struct IndexRange {
+	uint32_t firstIndex;
+	uint32_t indexCount;
+};
+
+// Part of a model drawn on its own: a range of the index buffer for every level of detail
+struct ModelChunk {
+	IndexRange lods[MAX_MODEL_LODS];
+	uint32_t lodCount;
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+};
+
 struct Model {
 	BaseProject* BP;
+	std::string name;
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
 	VkBuffer vertexBuffer;
@@ -188,12 +287,24 @@ struct Model {
 	VkBuffer indexBuffer;
 	VkDeviceMemory indexBufferMemory;
 
+	// Object space bounds, and chunks of the mesh (a single one unless split)
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
+	std::vector<ModelChunk> chunks;
+
 	void loadModel(std::string file);
+	void computeBounds();
+	void splitIntoChunks(int gridSize);
+	void buildLods(uint32_t lodCount, int gridSize);
 	void createIndexBuffer();
 	void createVertexBuffer();
 
-	void init(BaseProject* bp, std::string file);
+	// gridSize > 1 splits the triangles in gridSize x gridSize chunks on the xy plane
+	// (the ground), so that they can be culled separately.
+	// lodCount > 1 adds simplified versions of every chunk, appended to the index buffer.
+	void init(BaseProject* bp, std::string file, int gridSize = 1, uint32_t lodCount = 1);
 	void init(BaseProject* bp, std::vector<Vertex> vertices, std::vector<uint32_t> indices);
+	void bind(VkCommandBuffer commandBuffer);
 	void cleanup();
 };
 
@@ -204,12 +315,21 @@ struct Texture {
 	VkDeviceMemory textureImageMemory;
 	VkImageView textureImageView;
 	VkSampler textureSampler;
+	// Changed before init() for data that is not a color, e.g. UNORM lookup tables,
+	// and for textures that do not tile, clamped to their edges
+	VkFormat format = VK_FORMAT_R8G8B8A8_SRGB;
+	VkSamplerAddressMode addressMode = VK_SAMPLER_ADDRESS_MODE_REPEAT;
 
 	void createTextureImage(std::string file);
+	void createTextureImage(const unsigned char* pixels, int texWidth, int texHeight,
+		const std::string& name, uint32_t maxMipLevels);
 	void createTextureImageView();
 	void createTextureSampler();
 
 	void init(BaseProject* bp, std::string file);
+	// From RGBA pixels already in memory, with at most maxMipLevels mip levels
+	void init(BaseProject* bp, const unsigned char* pixels, int width, int height,
+		const std::string& name, uint32_t maxMipLevels);
 	void cleanup();
 };
 
@@ -228,39 +348,709 @@ struct DescriptorSetLayout {
 	void cleanup();
 };
 
+const uint32_t MAX_SPECIALIZATION_CONSTANTS = 8;
+
+// Values of the specialization constants of a pipeline variant: the constant
+// with constant_id i takes values[i], for i < count. The others keep the
+// default of the shader. Floats are stored with their bit pattern.
+struct ShaderVariant {
+	uint32_t count = 0;
+	uint32_t values[MAX_SPECIALIZATION_CONSTANTS] = {};
+
+	ShaderVariant& set(uint32_t constantId, uint32_t value);
+	ShaderVariant& set(uint32_t constantId, float value);
+	ShaderVariant& set(uint32_t constantId, bool value) { return set(constantId, value ? 1u : 0u); }
+
+	bool operator<(const ShaderVariant& other) const;
+};
+
 struct Pipeline {
 	BaseProject* BP;
+	// The selected variant, the one without specialization after init() (if it is created)
 	VkPipeline graphicsPipeline;
 	VkPipelineLayout pipelineLayout;
+	uint32_t pushConstantSize;
+	VkShaderStageFlags pushConstantStages;
+	bool instanced;
+	VkRenderPass renderPass;
 
+	// Fixed function state of every variant, changed before init() when needed
+	VkCompareOp depthCompareOp = VK_COMPARE_OP_LESS;
+	bool depthWrite = true;
+	// The fragment color is added to the attachment, e.g. to count the layers of overdraw
+	bool additiveBlend = false;
+
+	// False for pipelines that only draw with variants created by variant() and select():
+	// init() does not compile the one without specialization
+	bool defaultVariant = true;
+
+	// Kept to create the variants
+	VkShaderModule vertShaderModule;
+	VkShaderModule fragShaderModule;
+	std::map<ShaderVariant, VkPipeline> variants;
+
+	// pushConstantSize is the size of the per-draw block sent by draw(), 0 if unused.
+	// Instanced pipelines also read the per-instance binding of the vertex input.
+	// Pipelines draw in the scene pass, unless renderPass is given (e.g. overlayRenderPass).
+	// Viewport and scissor are dynamic: the scene pass changes size with the render scale.
+	// Without FragShader the pipeline only writes depth, e.g. for a depth pre-pass.
 	void init(BaseProject* bp, const std::string& VertShader, const std::string& FragShader,
-		std::vector<DescriptorSetLayout*> D);
+		std::vector<DescriptorSetLayout*> D, uint32_t pushConstantSize = 0,
+		VkShaderStageFlags pushConstantStages = VK_SHADER_STAGE_VERTEX_BIT,
+		bool instanced = false, VkRenderPass renderPass = VK_NULL_HANDLE);
 	VkShaderModule createShaderModule(const std::vector<char>& code);
 	static std::vector<char> readFile(const std::string& filename);
 	void cleanup();
+
+	// Returns the pipeline specialized with the given constants, creating it the
+	// first time. Variants used while drawing should be created during init,
+	// compiling one stalls the frame.
+	VkPipeline variant(const ShaderVariant& constants);
+	// Makes the variant the one bound through graphicsPipeline.
+	// Called from the main thread, before the command buffers are recorded.
+	void select(const ShaderVariant& constants) { graphicsPipeline = variant(constants); }
+
+	// Sends the per-draw constants and draws the model (bound with Model::bind).
+	// Instanced pipelines draw instanceCount copies, reading the instance buffer from firstInstance.
+	template <class T>
+	void draw(VkCommandBuffer commandBuffer, Model& M, const T& constants,
+		uint32_t instanceCount = 1, uint32_t firstInstance = 0) {
+		vkCmdPushConstants(commandBuffer, pipelineLayout, pushConstantStages,
+			0, sizeof(T), &constants);
+		vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(M.indices.size()),
+			instanceCount, 0, 0, firstInstance);
+	}
+
+	// Same as draw, for a chunk of the model
+	template <class T>
+	void drawChunk(VkCommandBuffer commandBuffer, const ModelChunk& chunk, const T& constants,
+		uint32_t lod = 0) {
+		vkCmdPushConstants(commandBuffer, pipelineLayout, pushConstantStages,
+			0, sizeof(T), &constants);
+		vkCmdDrawIndexed(commandBuffer, chunk.lods[lod].indexCount, 1, chunk.lods[lod].firstIndex, 0, 0);
+	}
 };
 
-enum DescriptorSetElementType { UNIFORM, TEXTURE };
+enum DescriptorSetElementType { UNIFORM, TEXTURE, STORAGE };
 
 struct DescriptorSetElement {
 	int binding;
 	DescriptorSetElementType type;
 	int size;
 	Texture* tex;
+	// Only for STORAGE buffers: one buffer per frame in flight
+	const std::vector<VkBuffer>* buffers;
 };
 
 struct DescriptorSet {
 	BaseProject* BP;
 
-	std::vector<std::vector<VkBuffer>> uniformBuffers;
-	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
+	// One set per frame in flight if the set has uniform blocks, a single one otherwise
 	std::vector<VkDescriptorSet> descriptorSets;
 
-	std::vector<bool> toFree;
-
 	void init(BaseProject* bp, DescriptorSetLayout* L,
 		std::vector<DescriptorSetElement> E);
 	void cleanup();
+
+	VkDescriptorSet* get(size_t currentFrame) {
+		return &descriptorSets[currentFrame % descriptorSets.size()];
+	}
+};
+
+// One persistently mapped uniform buffer per frame in flight.
+// Every uniform block reserves an aligned slot once, and is bound through a
+// UNIFORM_BUFFER_DYNAMIC descriptor using the slot offset as dynamic offset.
+struct UniformBufferRing {
+	BaseProject* BP;
+	VkDeviceSize size;
+	VkDeviceSize alignment;
+	VkDeviceSize used;
+
+	std::vector<VkBuffer> buffers;
+	std::vector<VkDeviceMemory> buffersMemory;
+	std::vector<void*> mappedMemory;
+
+	void init(BaseProject* bp, VkDeviceSize capacity);
+	uint32_t reserve(VkDeviceSize blockSize);
+	void* data(size_t frame, uint32_t offset);
+	void cleanup();
+
+	template <class T>
+	void write(size_t frame, uint32_t offset, const T& block) {
+		memcpy(data(frame, offset), &block, sizeof(T));
+	}
+};
+
+// Per-instance data of the instanced draws, one persistently mapped vertex
+// buffer per frame in flight. Every group of instances reserves its range once,
+// then writes the data of the current frame through data().
+struct InstanceBuffer {
+	BaseProject* BP;
+	uint32_t capacity;
+	uint32_t used;
+
+	std::vector<VkBuffer> buffers;
+	std::vector<VkDeviceMemory> buffersMemory;
+	std::vector<InstanceData*> mappedMemory;
+
+	void init(BaseProject* bp, uint32_t capacity);
+	uint32_t reserve(uint32_t count);
+	void bind(VkCommandBuffer commandBuffer, size_t frame);
+	void cleanup();
+
+	InstanceData* data(size_t frame, uint32_t firstInstance) {
+		return mappedMemory[frame] + firstInstance;
+	}
+};
+
+// Several images packed in a single texture at load time.
+// regions[i] holds the uv rectangle of the i-th file: (min u, min v, max u, max v).
+struct TextureAtlas {
+	BaseProject* BP;
+	Texture texture;
+	std::vector<glm::vec4> regions;
+
+	// padding is the number of empty texels around every image: mip level n
+	// bleeds 2^n texels, so the number of mip levels is limited accordingly.
+	void init(BaseProject* bp, const std::vector<std::string>& files, int padding = 16);
+	void cleanup();
+};
+
+// Textured 2D quads rebuilt every frame in a persistently mapped vertex buffer,
+// and drawn with a single draw call. All the sprites of a batch share a texture (an atlas).
+struct SpriteBatch {
+	BaseProject* BP;
+	uint32_t capacity;
+	uint32_t count;
+
+	std::vector<VkBuffer> vertexBuffers;
+	std::vector<VkDeviceMemory> vertexBuffersMemory;
+	std::vector<Vertex*> mappedVertices;
+	VkBuffer indexBuffer;
+	VkDeviceMemory indexBufferMemory;
+
+	void init(BaseProject* bp, uint32_t capacity);
+	void cleanup();
+
+	// Sprites must be added again every frame, after begin()
+	void begin();
+	// region: uv rectangle in the atlas. The quad of the given size is rotated by
+	// angle around pivot (in [0,1]x[0,1] quad coordinates), that is placed at pos.
+	void add(size_t frame, const glm::vec4& region, glm::vec2 pos, glm::vec2 size,
+		float angle = 0.0f, glm::vec2 pivot = glm::vec2(0.5f), float depth = 0.0f);
+
+	template <class T>
+	void draw(VkCommandBuffer commandBuffer, size_t frame, Pipeline& P, const T& constants) {
+		if (count == 0) return;
+
+		VkDeviceSize offsets[] = { 0 };
+		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertexBuffers[frame], offsets);
+		vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+
+		vkCmdPushConstants(commandBuffer, P.pipelineLayout, P.pushConstantStages,
+			0, sizeof(T), &constants);
+		vkCmdDrawIndexed(commandBuffer, count * 6, 1, 0, 0, 0);
+	}
+};
+
+// Hierarchical Z buffer: a mip chain where every texel holds the farthest depth
+// of the texels it covers in the level above, the first level covering the depth
+// buffer. It is built by a compute pass after the render pass, and the occlusion
+// tests of the next frame compare the bounds of the objects against it.
+struct DepthPyramid {
+	BaseProject* BP;
+	uint32_t width;
+	uint32_t height;
+	uint32_t levels;
+
+	VkImage image;
+	VkDeviceMemory imageMemory;
+	VkImageView view;
+	std::vector<VkImageView> levelViews;
+	VkSampler sampler;
+
+	// One set per level: the previous level (the depth buffer for the first) and the level to write
+	DescriptorSetLayout layout;
+	std::vector<VkDescriptorSet> descriptorSets;
+	VkPipelineLayout pipelineLayout;
+	VkPipeline pipeline;
+
+	// Part of the pyramid covered by the last frame built, rendered at BaseProject::renderExtent
+	glm::vec2 uvScale;
+
+	void init(BaseProject* bp, const std::string& shader);
+	// Recorded by the depth pyramid pass of the frame graph, after the scene pass
+	void build(VkCommandBuffer commandBuffer);
+	void cleanup();
+};
+
+// Scales the scene, rendered at BaseProject::renderExtent, to the whole swap chain image:
+// bilinear filtering, sharpened below the native resolution. Drawn first in the overlay pass.
+// In the overdraw view it shows the layers counted in the scene color as a heatmap.
+struct Upscaler {
+	BaseProject* BP;
+	VkSampler sampler;
+	DescriptorSetLayout layout;
+	VkDescriptorSet descriptorSet;
+	VkPipelineLayout pipelineLayout;
+	VkPipeline pipeline;
+
+	void init(BaseProject* bp, const std::string& VertShader, const std::string& FragShader);
+	void draw(VkCommandBuffer commandBuffer);
+	void cleanup();
+};
+
+struct UpscalePushConstants {
+	glm::vec2 uvScale;		// rendered area, in uv of the scene color image
+	glm::vec2 uvMax;		// center of the last rendered texel
+	glm::vec2 texelSize;
+	float sharpness;
+	float overdrawSteps;	// overdraw view, 0 otherwise
+};
+
+// An object of a GpuDrawList, as read by the compute and vertex shaders (std430)
+struct GpuObject {
+	glm::mat4 model;
+	glm::vec4 boundsMin;
+	glm::vec4 boundsMax;
+	uint32_t lodFirstIndex[MAX_MODEL_LODS];
+	uint32_t lodIndexCount[MAX_MODEL_LODS];
+	uint32_t lodCount;
+	uint32_t padding[3];
+};
+
+// View of the culling pass, in the uniform buffer ring (std140)
+struct CullUniforms {
+	alignas(16) glm::vec4 planes[6];
+	alignas(16) glm::mat4 prevViewProj;
+	alignas(16) glm::vec4 cameraPos;
+	alignas(8) glm::vec2 pyramidSize;
+	float lodDistance;
+	// distance travelled by the camera since the frame of the depth pyramid
+	float cameraMotion;
+	uint32_t objectCount;
+	uint32_t pyramidLevels;
+	// 0 until the depth pyramid holds a frame
+	uint32_t occlusionCulling;
+	// DepthPyramid::uvScale, at offset 208 like in cull.comp
+	alignas(8) glm::vec2 pyramidUvScale;
+};
+
+// Counters written by the culling pass
+struct CullStats {
+	uint32_t tested;
+	uint32_t frustumCulled;
+	uint32_t occlusionCulled;
+};
+
+// GPU driven drawing of the chunks of a model. Every frame a compute pass
+// (cull()) tests the objects against the view frustum and against the depth
+// pyramid of the previous frame, picks their level of detail from the distance
+// to the camera, and writes an indexed indirect draw for each visible one, and
+// their count. draw() then issues all of them with a single
+// vkCmdDrawIndexedIndirectCount, so the CPU cost does not depend on the number of objects. The vertex shader finds its object at gl_InstanceIndex.
+// The objects are tested in the order of their view depth, sorted by setView(), and the
+// draws keep it within each workgroup: front to back, for the early depth test to reject
+// the hidden fragments. Workgroups append in the order they finish, so across them the
+// order is only roughly front to back.
+struct GpuDrawList {
+	BaseProject* BP;
+	Model* model;
+	uint32_t capacity;
+	uint32_t objectCount;
+
+	// Distance from the camera at which every level of detail switches to the next one
+	float lodDistance;
+
+	// Object data is written at load time, draws and count are written by the GPU every frame
+	VkBuffer objectBuffer;
+	VkDeviceMemory objectBufferMemory;
+	GpuObject* objects;
+	std::vector<VkBuffer> drawBuffers;
+	std::vector<VkDeviceMemory> drawBuffersMemory;
+	std::vector<VkBuffer> countBuffers;
+	std::vector<VkDeviceMemory> countBuffersMemory;
+
+	// World space centers of the objects, and the order of the frame, written to orderBuffers
+	std::vector<glm::vec3> centers;
+	std::vector<float> depths;
+	std::vector<uint32_t> order;
+	std::vector<VkBuffer> orderBuffers;
+	std::vector<VkDeviceMemory> orderBuffersMemory;
+	std::vector<uint32_t*> orderData;
+
+	// Host visible, read back framesInFlight frames later
+	std::vector<VkBuffer> statsBuffers;
+	std::vector<VkDeviceMemory> statsBuffersMemory;
+	std::vector<CullStats*> stats;
+	CullStats lastStats{};
+
+	// Set shared by the compute pass and the vertex shader of the drawing pipeline
+	DescriptorSetLayout layout;
+	std::vector<VkDescriptorSet> descriptorSets;
+	VkPipelineLayout cullPipelineLayout;
+	VkPipeline cullPipeline;
+
+	uint32_t cullUniforms;
+	glm::mat4 prevViewProj;
+	glm::vec3 prevCameraPos;
+	bool hasPreviousView;
+
+	void init(BaseProject* bp, Model* model, uint32_t capacity, const std::string& cullShader);
+	uint32_t add(const glm::mat4& transform, const ModelChunk& chunk);
+	void cleanup();
+
+	// Frustum and camera of the frame being recorded.
+	// Also collects the counters of the last use of the frame resources in lastStats.
+	void setView(size_t frame, const Frustum& frustum, const glm::mat4& viewProj, const glm::vec3& cameraPos);
+	// Must be recorded outside of the render pass
+	void cull(VkCommandBuffer commandBuffer, size_t frame);
+	void bind(VkCommandBuffer commandBuffer, Pipeline& P, uint32_t set, size_t frame);
+
+	// The model must be bound (Model::bind)
+	template <class T>
+	void draw(VkCommandBuffer commandBuffer, size_t frame, Pipeline& P, const T& constants) {
+		vkCmdPushConstants(commandBuffer, P.pipelineLayout, P.pushConstantStages,
+			0, sizeof(T), &constants);
+		vkCmdDrawIndexedIndirectCount(commandBuffer, drawBuffers[frame], 0,
+			countBuffers[frame], 0, objectCount, sizeof(VkDrawIndexedIndirectCommand));
+	}
+};
+
+enum LightType { LIGHT_POINT, LIGHT_SPOT };
+
+// A light of the scene, as read by the fragment shader (std430)
+struct GpuLight {
+	glm::vec4 positionRange;	// world position, distance past which the light is ignored
+	glm::vec4 color;			// w: LightType
+	glm::vec4 direction;		// spot lights: where the light points to
+	glm::vec4 params;			// point lights: size and decay. Spot lights: cos of the inner and outer half cones, shadow map or -1
+};
+
+// Froxels of the view frustum: tiles of the screen, sliced exponentially in depth
+const uint32_t CLUSTER_COUNT_X = 16;
+const uint32_t CLUSTER_COUNT_Y = 9;
+const uint32_t CLUSTER_COUNT_Z = 24;
+const uint32_t CLUSTER_COUNT = CLUSTER_COUNT_X * CLUSTER_COUNT_Y * CLUSTER_COUNT_Z;
+
+// Clustered forward lighting. The lights of a frame are added on the CPU, then
+// build() bins them into the clusters their range reaches, and writes the lights,
+// the list of light indices of every cluster and the range of the list of every
+// cluster to per-frame storage buffers. The fragment shader finds its cluster
+// from its screen position and depth, and only loops over the lights in it.
+struct LightClusters {
+	BaseProject* BP;
+	uint32_t maxLights;
+	uint32_t maxIndices;
+
+	// Lights of the frame being prepared
+	std::vector<GpuLight> lights;
+	uint32_t spotLights;
+
+	// View space bounds of the clusters, for the projection they were computed with
+	std::vector<glm::vec3> clusterMin;
+	std::vector<glm::vec3> clusterMax;
+	glm::mat4 clusterProj;
+	float nearPlane;
+	float farPlane;
+	std::vector<uint32_t> clusterCounts;
+	std::vector<uint32_t> clusterCursors;
+
+	// Per frame, persistently mapped
+	std::vector<VkBuffer> lightBuffers;
+	std::vector<VkDeviceMemory> lightBuffersMemory;
+	std::vector<VkBuffer> gridBuffers;			// offset and count of every cluster
+	std::vector<VkDeviceMemory> gridBuffersMemory;
+	std::vector<VkBuffer> indexBuffers;			// light indices of the clusters
+	std::vector<VkDeviceMemory> indexBuffersMemory;
+	std::vector<GpuLight*> mappedLights;
+	std::vector<glm::uvec2*> mappedGrid;
+	std::vector<uint32_t*> mappedIndices;
+
+	// Counters of the last build
+	uint32_t usedIndices;
+	uint32_t busiestCluster;
+
+	void init(BaseProject* bp, uint32_t maxLights, uint32_t maxIndices);
+	void cleanup();
+
+	// Starts the list of lights of a frame
+	void clear();
+	// The range is where the light falls below 1/256 of its color
+	void addPointLight(const glm::vec3& pos, const glm::vec3& color, float size, float decay);
+	// Cone angles in degrees, the light does not fade within range.
+	// shadowMap is the layer of ShadowMaps rendered for the light, -1 for none.
+	void addSpotLight(const glm::vec3& pos, const glm::vec3& dir, const glm::vec3& color,
+		float innerCone, float outerCone, float range, int shadowMap = -1);
+	bool hasSpotLights() { return spotLights > 0; }
+
+	// Bins the lights and writes them to the buffers of the frame.
+	// nearPlane and farPlane must be the ones of proj.
+	void build(size_t frame, const glm::mat4& view, const glm::mat4& proj, float nearPlane, float farPlane);
+
+	// Size of a tile in pixels, scale and bias giving the depth slice from the log of the view depth
+	glm::vec4 shaderParams();
+
+	void computeClusterBounds(const glm::mat4& proj);
+	uint32_t depthSlice(float depth);
+	// Visits every cluster touched by the sphere, in view space
+	template <class F>
+	void forEachCluster(const glm::vec3& center, float radius, F visit);
+};
+
+const uint32_t MAX_SHADOW_MAPS = 4;
+
+// Shadow maps of spot lights, the layers of a single depth array sampled with
+// depth comparison. Each layer is a cache of the static geometry, rendered again
+// only when its light has moved or turned past a threshold. Lights far from the
+// camera are updated once every few frames. Vehicles cast no shadow: the only
+// vehicle carries the shadowed lights, and the light matrix of a cache trails
+// the moving lamp by up to the threshold, inside the vehicle's own body.
+struct ShadowMaps {
+	BaseProject* BP;
+	uint32_t count;
+	uint32_t size;
+
+	// The layers of the shadow map array, bound like the other textures
+	Texture texture;
+	std::vector<VkImageView> layerViews;
+
+	// Clears a layer and leaves it ready to sample
+	VkRenderPass renderPass;
+	std::vector<VkFramebuffer> layerFramebuffers;
+	VkPipelineLayout pipelineLayout;
+	VkPipeline pipeline;
+
+	struct ShadowedLight {
+		glm::mat4 viewProj;		// of the cache, also used to sample the shadow map
+		glm::vec3 cachedPos;
+		glm::vec3 cachedDir;
+		bool cacheValid;
+		uint32_t framesSinceUpdate;
+		bool render;			// set by setLight, cleared once recorded
+	};
+	std::vector<ShadowedLight> lights;
+
+	// Distance and angle (in degrees) a light moves before its cache is rendered again
+	float moveThreshold;
+	float turnThreshold;
+	// A light is updated every 1 + distance from the camera / throttleDistance frames
+	float throttleDistance;
+
+	// Cost of the shadow passes of the last frame, and totals
+	uint32_t renders;
+	uint32_t triangles;
+	float recordingTime;
+	uint64_t totalRenders;
+	uint64_t totalTriangles;
+	uint64_t frames;
+
+	void init(BaseProject* bp, uint32_t count, uint32_t size, const std::string& VertShader);
+	void cleanup();
+
+	// Called every frame for every shadowed light, decides what is rendered for it
+	void setLight(uint32_t shadow, const glm::vec3& pos, const glm::vec3& dir, float outerCone,
+		float range, const glm::vec3& cameraPos);
+	const glm::mat4& viewProj(uint32_t shadow) { return lights[shadow].viewProj; }
+
+	// Records the passes due this frame, outside of the render pass.
+	// drawCasters(shadow) issues the draws of the casters with draw().
+	template <class D>
+	void record(VkCommandBuffer commandBuffer, D drawCasters);
+	// The model must be bound (Model::bind)
+	void draw(VkCommandBuffer commandBuffer, const IndexRange& range, const glm::mat4& model);
+
+	void beginPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer);
+	void layerBarrier(VkCommandBuffer commandBuffer, uint32_t shadow, VkImageLayout oldLayout,
+		VkImageLayout newLayout, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+		VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
+	// Light matrix of the pass being recorded
+	glm::mat4 passViewProj;
+};
+
+// Bindless textures: a single, partially bound, update-after-bind array of
+// combined image samplers. Shaders pick the texture with the index returned by
+// add(), sent with the push constants of each draw.
+struct TextureTable {
+	BaseProject* BP;
+	DescriptorSetLayout layout;
+	VkDescriptorPool descriptorPool;
+	VkDescriptorSet descriptorSet;
+	uint32_t capacity;
+	uint32_t count;
+
+	void init(BaseProject* bp, uint32_t capacity);
+	uint32_t add(Texture* tex);
+	void bind(VkCommandBuffer commandBuffer, Pipeline& P, uint32_t set);
+	void cleanup();
+};
+
+// GPU time of named scopes of the frames, from timestamps written around them.
+// Every frame in flight has its own query pool, read back once the frame has
+// completed, when its slot is reused: the times arrive framesInFlight frames
+// late, but reading them never stalls. Scopes are added before init(); begin()
+// and end() may be recorded by any thread, each scope at most once per frame.
+struct GpuProfiler {
+	BaseProject* BP;
+	bool supported;
+	std::vector<std::string> names;
+	std::vector<VkQueryPool> queryPools;
+
+	// Nanoseconds per tick, and the valid bits of a timestamp
+	double tickPeriod;
+	uint64_t tickMask;
+	// Trace::now() at tick 0, to line up the GPU scopes with the CPU ones in the trace
+	double traceOffset;
+
+	// Begin and end of every scope, each followed by its availability
+	std::vector<uint64_t> results;
+	// Milliseconds of the last frame read, negative for the scopes it did not record,
+	// and of the last GPU_PROFILER_HISTORY frames, a ring per scope
+	std::vector<float> lastTimes;
+	std::vector<float> history;
+	uint32_t historyNext;
+	uint32_t historySize;
+
+	uint32_t addScope(const std::string& name);
+	void init(BaseProject* bp);
+	void cleanup();
+
+	// Resets the queries of the frame, at the start of its command buffer
+	void beginFrame(VkCommandBuffer commandBuffer, uint32_t frame);
+	void begin(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t scope);
+	void end(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t scope);
+	// The results of the last frame recorded in this slot, which must have completed
+	void readFrame(uint32_t frame);
+	void printSummary(std::ostream& out);
+};
+
+// How a pass of the frame graph uses a resource
+enum FrameGraphAccess {
+	ACCESS_COLOR_ATTACHMENT,		// written as the color attachment of a render pass
+	ACCESS_DEPTH_ATTACHMENT,		// written (and tested) as the depth attachment
+	ACCESS_FRAGMENT_SAMPLED,		// sampled by fragment shaders
+	ACCESS_COMPUTE_SAMPLED_DEPTH,	// depth sampled by compute shaders
+	ACCESS_COMPUTE_READ,			// read by compute shaders, images in the general layout
+	ACCESS_COMPUTE_WRITE,			// written (and read) by compute shaders, general layout
+	ACCESS_INDIRECT_DRAW,			// indirect draws and counts, and storage read by vertex shaders
+	ACCESS_SHADOW_MAP,				// depth written by render passes that leave it ready to sample
+	FRAME_GRAPH_ACCESS_COUNT
+};
+
+// Barriers recorded at once before a pass: a global memory barrier, and the
+// images changing layout. Their handles are filled in when the frame is recorded.
+struct FrameGraphBarriers {
+	VkPipelineStageFlags srcStages;
+	VkPipelineStageFlags dstStages;
+	VkMemoryBarrier memoryBarrier;
+	std::vector<VkImageMemoryBarrier> imageBarriers;
+	std::vector<uint32_t> imageResources;
+};
+
+struct FrameGraphPass {
+	std::string name;
+	std::function<void(VkCommandBuffer)> execute;
+
+	struct Use {
+		uint32_t resource;
+		FrameGraphAccess access;
+	};
+	std::vector<Use> uses;
+
+	// Its GpuProfiler scope, recorded around the pass
+	uint32_t profilerScope;
+
+	// Set by FrameGraph::compile
+	bool alive;
+	FrameGraphBarriers barriers;
+
+	// A pass uses a resource once, as declared
+	FrameGraphPass& read(uint32_t resource, FrameGraphAccess access);
+	FrameGraphPass& write(uint32_t resource, FrameGraphAccess access);
+};
+
+// A buffer or image used by the passes. Transient images are created by the
+// graph and live within a frame; imported resources are owned by someone else.
+struct FrameGraphResource {
+	std::string name;
+	bool isImage;
+	bool transient;
+	// Presented or read back: the passes writing it are never culled
+	bool output;
+	VkImageAspectFlags aspect;
+	// Imported images: the layout kept between frames, or for outputs the layout
+	// left at the end of the frame; outputs come undefined and waited for at acquireStage
+	VkImageLayout layout;
+	VkPipelineStageFlags acquireStage;
+	VkImage image;
+
+	// Transient images, their usage collected from the passes
+	VkFormat format;
+	VkExtent2D extent;
+	VkImageUsageFlags usage;
+	VkImageView view;
+	VkMemoryRequirements requirements;
+	uint32_t memoryBlock;
+	// Lifetime, in indices of the passes
+	uint32_t firstPass;
+	uint32_t lastPass;
+};
+
+// Frame graph: the passes of a frame, in the order they are recorded, with the
+// resources each of them reads and writes. compile() culls the passes whose
+// outputs nobody reads, derives the barriers and layout transitions between
+// the passes (and from one frame to the next), and creates the transient
+// images, aliasing in memory the ones that are never alive at the same time.
+// Render passes begun by a pass must keep their attachments in the layout of
+// the declared access: the graph does the transitions around them.
+struct FrameGraph {
+	BaseProject* BP;
+	std::deque<FrameGraphPass> passes;
+	std::vector<FrameGraphResource> resources;
+
+	// Memory shared by aliased transient images
+	std::vector<VkDeviceMemory> memoryBlocks;
+	VkDeviceSize transientSize;
+	VkDeviceSize unaliasedSize;
+
+	FrameGraphBarriers finalBarriers;
+
+	void init(BaseProject* bp);
+	void cleanup();
+
+	uint32_t importBuffer(const std::string& name);
+	uint32_t importImage(const std::string& name, VkImageAspectFlags aspect, VkImageLayout layout);
+	uint32_t importOutput(const std::string& name, VkImageLayout finalLayout,
+		VkPipelineStageFlags acquireStage);
+	uint32_t createImage(const std::string& name, VkFormat format, VkImageAspectFlags aspect,
+		VkExtent2D extent);
+	// Imported images can be set, or changed, until the frame is recorded
+	void setImage(uint32_t resource, VkImage image) { resources[resource].image = image; }
+	VkImage image(uint32_t resource) { return resources[resource].image; }
+	VkImageView view(uint32_t resource) { return resources[resource].view; }
+
+	FrameGraphPass& addPass(const std::string& name, std::function<void(VkCommandBuffer)> execute);
+
+	void compile();
+	// Records the passes that were not culled, each after its barriers
+	void execute(VkCommandBuffer commandBuffer);
+	void printSummary(std::ostream& out);
+
+	struct ResourceState {
+		VkImageLayout layout;
+		VkPipelineStageFlags writeStages;
+		VkAccessFlags writeAccess;
+		VkPipelineStageFlags readStages;
+		VkPipelineStageFlags visibleStages;
+		VkAccessFlags visibleAccess;
+	};
+	void cullPasses();
+	void createTransients();
+	void simulate(std::vector<ResourceState>& states, bool recordBarriers);
+	void use(ResourceState& state, uint32_t resource, VkPipelineStageFlags stages,
+		VkAccessFlags access, VkImageLayout layout, bool write, FrameGraphBarriers* barriers);
+	void recordBarriers(VkCommandBuffer commandBuffer, FrameGraphBarriers& barriers);
 };
 
 
@@ -271,12 +1061,34 @@ class BaseProject {
 	friend class Pipeline;
 	friend class DescriptorSetLayout;
 	friend class DescriptorSet;
+	friend class UniformBufferRing;
+	friend class InstanceBuffer;
+	friend class TextureAtlas;
+	friend class SpriteBatch;
+	friend class GpuDrawList;
+	friend class DepthPyramid;
+	friend class Upscaler;
+	friend class LightClusters;
+	friend class ShadowMaps;
+	friend class TextureTable;
+	friend class FrameGraph;
+	friend class GpuProfiler;
 public:
 	virtual void setWindowParameters() = 0;
-	void run() {
+	void run(int argc, char* argv[]) {
+		auto startupStart = std::chrono::high_resolution_clock::now();
+
 		setWindowParameters();
-		initWindow();
+		parseArguments(argc, argv);
+		if (!headless) initWindow();
 		initVulkan();
+
+		float startupTime = std::chrono::duration<float, std::chrono::milliseconds::period>(
+			std::chrono::high_resolution_clock::now() - startupStart).count();
+		std::cout << "Startup: " << startupTime << " ms, of which pipelines "
+			<< pipelineCreationTime << " ms with a "
+			<< (pipelineCache.isWarm() ? "warm" : "cold") << " pipeline cache\n";
+
 		mainLoop();
 		cleanup();
 	}
@@ -286,23 +1098,55 @@ protected:
 	uint32_t windowHeight;
 	std::string windowTitle;
 	VkClearColorValue initialBackgroundColor;
-	int uniformBlocksInPool;
-	int texturesInPool;
-	int setsInPool;
+	VkDeviceSize uniformRingSize;
+	int scenePartitions;
+	uint32_t maxInstances;
+
+	// Headless mode: no window, the frames are rendered in offscreen images
+	// with the same render pass, and some of them are saved as PPM files
+	bool headless = false;
+	uint32_t headlessFrames = DEFAULT_HEADLESS_FRAMES;
+	std::vector<uint32_t> dumpFrames;
+	std::string dumpDirectory = ".";
+	std::vector<VkDeviceMemory> offscreenImagesMemory;
 
 	// Lesson 12
-	GLFWwindow* window;
+	GLFWwindow* window = nullptr;
 	VkInstance instance;
 
 	// Lesson 13
-	VkSurfaceKHR surface;
+	VkSurfaceKHR surface = VK_NULL_HANDLE;
 	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkPhysicalDeviceProperties physicalDeviceProperties;
 	VkDevice device;
 	VkQueue graphicsQueue;
 	VkQueue presentQueue;
+	bool memoryBudgetSupported = false;
+	MemoryTracker memoryTracker;
 	VkCommandPool commandPool;
 	std::vector<VkCommandBuffer> commandBuffers;
 
+	// Transient command pool of a recording thread in a frame in flight,
+	// with one secondary command buffer per scene partition it may record
+	struct FrameCommandPool {
+		VkCommandPool pool;
+		std::vector<VkCommandBuffer> secondaryBuffers;
+		uint32_t used;
+	};
+	std::vector<std::vector<FrameCommandPool>> frameCommandPools; // [frame][worker]
+	std::vector<VkCommandBuffer> partitionCommandBuffers; // [partition], this frame
+	std::vector<std::exception_ptr> partitionErrors; // [partition], this frame
+	WorkerPool recordingWorkers;
+
+	PipelineCache pipelineCache;
+	// Time spent in initPipelines(), in milliseconds
+	float pipelineCreationTime = 0.0f;
+
+	// Time spent recording the command buffers, in milliseconds
+	float lastRecordingTime = 0.0f;
+	double totalRecordingTime = 0.0;
+	uint64_t recordedFrames = 0;
+
 	// Lesson 14
 	VkSwapchainKHR swapChain;
 	std::vector<VkImage> swapChainImages;
@@ -311,28 +1155,181 @@ protected:
 	std::vector<VkImageView> swapChainImageViews;
 
 	// Lesson 19
+	// The scene is drawn in renderPass, at renderExtent, to sceneColorImage.
+	// overlayRenderPass draws it upscaled to the swap chain image, then the HUD.
 	VkRenderPass renderPass;
-
-	VkDescriptorPool descriptorPool;
+	VkRenderPass overlayRenderPass;
+	VkImage sceneColorImage;
+	VkImageView sceneColorImageView;
+	VkFramebuffer sceneFramebuffer;
+	Upscaler upscaler;
+
+	// Dynamic resolution: renderExtent is renderScale times the swap chain extent,
+	// lowered when the GPU frame time goes over gpuFrameBudget (in milliseconds),
+	// down to minRenderScale. Both are set in setWindowParameters.
+	float gpuFrameBudget;
+	float minRenderScale;
+	float renderScale = 1.0f;
+	bool fixedRenderScale = false;
+	VkExtent2D renderExtent;
+	uint32_t framesSinceScaleChange = 0;
+	uint32_t renderScaleChanges = 0;
+
+	// Debug view of the layers of overdraw of every pixel: the scene is drawn with additive
+	// pipelines counting fragments (see Pipeline::additiveBlend), the upscaler shows a heatmap
+	bool overdrawView = false;
+
+	// The application draws the depth of its opaque geometry first, then shades with an
+	// EQUAL depth test: every visible pixel runs the fragment shader once
+	bool depthPrepass = false;
+
+	// GPU times of the whole frame, of the passes of the frame graph, of the
+	// partitions of the scene and of the overlay commands
+	GpuProfiler gpuProfiler;
+	uint32_t gpuFrameScope;
+	std::vector<uint32_t> partitionScopes;
+	uint32_t overlayScope;
+	float lastGpuFrameTime = 0.0f;
+	float averageGpuFrameTime = 0.0f;
+
+	std::vector<VkDescriptorPool> descriptorPools;
+	UniformBufferRing uniformRing;
+	InstanceBuffer instanceBuffer;
+	DepthPyramid depthPyramid;
+	TextureTable textureTable;
 
 	// Lesson 22
 	// L22.0 --- Debugging
-	VkDebugUtilsMessengerEXT debugMessenger;
+	// The validation layers and their messenger, on by default except in headless runs:
+	// benchmark machines often lack the layers, and they would weigh on the timings
+	bool validation = true;
+	VkDebugUtilsMessengerEXT debugMessenger = VK_NULL_HANDLE;
 
 	// L22.1 --- depth buffer allocation (Z-buffer)
 	VkImage depthImage;
-	VkDeviceMemory depthImageMemory;
 	VkImageView depthImageView;
 
+	// The passes of a frame; the depth buffer and the scene color are its transient images
+	FrameGraph frameGraph;
+	uint32_t swapChainResource;
+	uint32_t sceneColorResource;
+	uint32_t depthResource;
+	uint32_t depthPyramidResource;
+	uint32_t currentImageIndex = 0;
+
 	// L22.2 --- Frame buffers
 	std::vector<VkFramebuffer> swapChainFramebuffers;
 	size_t currentFrame = 0;
+	// Between 1 and MAX_FRAMES_IN_FLIGHT, fixed once the window is created
+	uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+	size_t framesDrawn = 0;
+
+	// CPU and GPU scopes of every frame, written to tracePath at exit (--trace)
+	Trace trace;
+	std::string tracePath;
 
 	// L22.3 --- Synchronization objects
+	// The binary semaphores order acquire, rendering and present on the GPU. The CPU
+	// waits on gpuTimeline instead: every submission to the graphics queue (frames and
+	// single time commands alike) signals it with the next value of lastSubmission
 	std::vector<VkSemaphore> imageAvailableSemaphores;
 	std::vector<VkSemaphore> renderFinishedSemaphores;
-	std::vector<VkFence> inFlightFences;
-	std::vector<VkFence> imagesInFlight;
+	VkSemaphore gpuTimeline;
+	uint64_t lastSubmission = 0;
+	// The highest value known to be reached, to skip the queries
+	uint64_t completedSubmission = 0;
+	// The submission of the last frame of every slot, and of the last frame drawn to every image
+	std::vector<uint64_t> frameSubmissions;
+	std::vector<uint64_t> imageSubmissions;
+
+	// --headless, --validation, --no-validation, --width <pixels>, --height <pixels>, --render-scale <scale>,
+	// --overdraw, --depth-prepass, --frames-in-flight <count>, --trace <path>, --frames <count>,
+	// --dump <frame>[,<frame>...] and --dump-dir <directory>
+	void parseArguments(int argc, char* argv[]) {
+		bool headlessOptions = false;
+		int validationOption = -1;
+
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+
+			auto value = [&]() -> std::string {
+				if (i + 1 >= argc) {
+					throw std::runtime_error("missing value for " + arg + "!");
+				}
+				return argv[++i];
+			};
+			auto number = [&](const std::string& text) -> uint32_t {
+				try {
+					return static_cast<uint32_t>(std::stoul(text));
+				}
+				catch (const std::exception&) {
+					throw std::runtime_error("invalid value " + text + " for " + arg + "!");
+				}
+			};
+
+			if (arg == "--headless") headless = true;
+			else if (arg == "--validation") validationOption = 1;
+			else if (arg == "--no-validation") validationOption = 0;
+			else if (arg == "--overdraw") overdrawView = true;
+			else if (arg == "--depth-prepass") depthPrepass = true;
+			else if (arg == "--width") windowWidth = number(value());
+			else if (arg == "--render-scale") {
+				std::string text = value();
+				try {
+					renderScale = std::stof(text);
+				}
+				catch (const std::exception&) {
+					throw std::runtime_error("invalid value " + text + " for " + arg + "!");
+				}
+				if (renderScale <= 0.0f || renderScale > 1.0f) {
+					throw std::runtime_error("--render-scale must be in (0, 1]!");
+				}
+				fixedRenderScale = true;
+			}
+			else if (arg == "--height") windowHeight = number(value());
+			else if (arg == "--frames-in-flight") {
+				framesInFlight = number(value());
+				if (framesInFlight < 1 || framesInFlight > MAX_FRAMES_IN_FLIGHT) {
+					throw std::runtime_error("--frames-in-flight must be between 1 and " +
+						std::to_string(MAX_FRAMES_IN_FLIGHT) + "!");
+				}
+			}
+			else if (arg == "--trace") tracePath = value();
+			else if (arg == "--frames") {
+				headlessFrames = number(value());
+				headlessOptions = true;
+			}
+			else if (arg == "--dump-dir") {
+				dumpDirectory = value();
+				headlessOptions = true;
+			}
+			else if (arg == "--dump") {
+				std::stringstream frames(value());
+				std::string frame;
+				while (std::getline(frames, frame, ',')) {
+					dumpFrames.push_back(number(frame));
+				}
+				headlessOptions = true;
+			}
+			else {
+				throw std::runtime_error("unknown argument " + arg + "!");
+			}
+		}
+
+		if (headlessOptions && !headless) {
+			throw std::runtime_error("--frames, --dump and --dump-dir need --headless!");
+		}
+
+		// Reproducible frames: the resolution does not follow the GPU time
+		if (headless) fixedRenderScale = true;
+
+		validation = validationOption >= 0 ? validationOption == 1 : !headless;
+	}
+
+	// Keyboard state, always released in headless mode
+	int getKey(int key) {
+		return headless ? GLFW_RELEASE : glfwGetKey(window, key);
+	}
 
 	// Lesson 12
 	void initWindow() {
@@ -348,18 +1345,40 @@ protected:
 
 	// Lesson 12
 	void initVulkan() {
+		if (!tracePath.empty()) {
+			trace.init(TRACE_CAPACITY);
+			trace.setTrackName(TRACE_TRACK_MAIN, "main thread");
+			trace.setTrackName(TRACE_TRACK_GPU, "graphics queue");
+		}
+
 		createInstance();				// L12
-		setupDebugMessenger();			// L22.0
-		createSurface();				// L13
+		if (validation) setupDebugMessenger();	// L22.0
+		if (!headless) createSurface();	// L13
 		pickPhysicalDevice();			// L14
 		createLogicalDevice();			// L14
-		createSwapChain();				// L15
+		createGpuTimeline();
+		pipelineCache.init(device, physicalDeviceProperties, PIPELINE_CACHE_PATH);
+		if (headless) createOffscreenImages();
+		else createSwapChain();			// L15
 		createImageViews();				// L15
 		createRenderPass();				// L19
 		createCommandPool();			// L13
-		createDepthResources();			// L22.1
+		createFrameGraph();				// L22.1 (depth buffer)
 		createFramebuffers();			// L22.2
+		createGpuProfiler();
+		setRenderScale(renderScale);
 		createDescriptorPool();			// L21
+		uniformRing.init(this, uniformRingSize);
+		instanceBuffer.init(this, maxInstances);
+		textureTable.init(this, MAX_BINDLESS_TEXTURES);
+		depthPyramid.init(this, "shaders/depthPyramidComp.spv");
+		frameGraph.setImage(depthPyramidResource, depthPyramid.image);
+		upscaler.init(this, "shaders/upscaleVert.spv", "shaders/upscaleFrag.spv");
+
+		// Also used by initPipelines() during localInit()
+		uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+		uint32_t threads = std::min(cores, static_cast<uint32_t>(scenePartitions));
+		recordingWorkers.init(threads - 1);
 
 		localInit();
 
@@ -375,19 +1394,12 @@ protected:
 		appInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
 		appInfo.pEngineName = "No Engine";
 		appInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-		appInfo.apiVersion = VK_API_VERSION_1_0;
+		appInfo.apiVersion = VK_API_VERSION_1_2;
 
 		VkInstanceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
 		createInfo.pApplicationInfo = &appInfo;
 
-		uint32_t glfwExtensionCount = 0;
-		const char** glfwExtensions;
-		glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-
-		createInfo.enabledExtensionCount = glfwExtensionCount;
-		createInfo.ppEnabledExtensionNames = glfwExtensions;
-
 		createInfo.enabledLayerCount = 0;
 
 		auto extensions = getRequiredExtensions();
@@ -396,18 +1408,20 @@ protected:
 		createInfo.ppEnabledExtensionNames = extensions.data();
 
 		// For debugging [Lesson 22] - Start
-		if (!checkValidationLayerSupport()) {
-			throw std::runtime_error("validation layers requested, but not available!");
-		}
-
 		VkDebugUtilsMessengerCreateInfoEXT debugCreateInfo;
-		createInfo.enabledLayerCount =
-			static_cast<uint32_t>(validationLayers.size());
-		createInfo.ppEnabledLayerNames = validationLayers.data();
+		if (validation) {
+			if (!checkValidationLayerSupport()) {
+				throw std::runtime_error("validation layers requested, but not available!");
+			}
+
+			createInfo.enabledLayerCount =
+				static_cast<uint32_t>(validationLayers.size());
+			createInfo.ppEnabledLayerNames = validationLayers.data();
 
-		populateDebugMessengerCreateInfo(debugCreateInfo);
-		createInfo.pNext = (VkDebugUtilsMessengerCreateInfoEXT*)
-			&debugCreateInfo;
+			populateDebugMessengerCreateInfo(debugCreateInfo);
+			createInfo.pNext = (VkDebugUtilsMessengerCreateInfoEXT*)
+				&debugCreateInfo;
+		}
 		// For debugging [Lesson 22] - End
 
 		VkResult result = vkCreateInstance(&createInfo, nullptr, &instance);
@@ -420,15 +1434,29 @@ protected:
 
 	// Lesson 12 and L22.0
 	std::vector<const char*> getRequiredExtensions() {
-		uint32_t glfwExtensionCount = 0;
-		const char** glfwExtensions;
-		glfwExtensions =
-			glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+		std::vector<const char*> extensions;
+
+		// The surface extensions are not needed without a window
+		if (!headless) {
+			uint32_t glfwExtensionCount = 0;
+			const char** glfwExtensions;
+			glfwExtensions =
+				glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+
+			extensions.assign(glfwExtensions, glfwExtensions + glfwExtensionCount);
+		}
+		if (validation) extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
 
-		std::vector<const char*> extensions(glfwExtensions,
-			glfwExtensions + glfwExtensionCount);
-		extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+		return extensions;
+	}
 
+	// The swap chain extension is not needed in headless mode
+	std::vector<const char*> getRequiredDeviceExtensions() {
+		std::vector<const char*> extensions;
+		for (const char* extension : deviceExtensions) {
+			if (headless && strcmp(extension, VK_KHR_SWAPCHAIN_EXTENSION_NAME) == 0) continue;
+			extensions.push_back(extension);
+		}
 		return extensions;
 	}
 
@@ -530,6 +1558,8 @@ protected:
 		if (physicalDevice == VK_NULL_HANDLE) {
 			throw std::runtime_error("failed to find a suitable GPU!");
 		}
+
+		vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceProperties);
 	}
 
 	// Lesson 13
@@ -538,18 +1568,40 @@ protected:
 
 		bool extensionsSupported = checkDeviceExtensionSupport(device);
 
-		bool swapChainAdequate = false;
-		if (extensionsSupported) {
+		bool swapChainAdequate = headless;
+		if (extensionsSupported && !headless) {
 			SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
 			swapChainAdequate = !swapChainSupport.formats.empty() &&
 				!swapChainSupport.presentModes.empty();
 		}
 
-		VkPhysicalDeviceFeatures supportedFeatures;
-		vkGetPhysicalDeviceFeatures(device, &supportedFeatures);
+		VkPhysicalDeviceProperties deviceProperties;
+		vkGetPhysicalDeviceProperties(device, &deviceProperties);
+		if (deviceProperties.apiVersion < VK_API_VERSION_1_2) {
+			return false;
+		}
+
+		// Descriptor indexing features used by the bindless texture table
+		VkPhysicalDeviceVulkan12Features supportedFeatures12{};
+		supportedFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
+		VkPhysicalDeviceFeatures2 supportedFeatures{};
+		supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		supportedFeatures.pNext = &supportedFeatures12;
+		vkGetPhysicalDeviceFeatures2(device, &supportedFeatures);
+
+		bool bindlessSupported = supportedFeatures12.runtimeDescriptorArray &&
+			supportedFeatures12.descriptorBindingPartiallyBound &&
+			supportedFeatures12.descriptorBindingSampledImageUpdateAfterBind;
+
+		// Indirect draws written by the GPU driven draw lists
+		bool indirectSupported = supportedFeatures12.drawIndirectCount &&
+			supportedFeatures.features.multiDrawIndirect &&
+			supportedFeatures.features.drawIndirectFirstInstance;
 
 		return indices.isComplete() && extensionsSupported && swapChainAdequate &&
-			supportedFeatures.samplerAnisotropy;
+			supportedFeatures.features.samplerAnisotropy && bindlessSupported &&
+			indirectSupported && supportedFeatures12.timelineSemaphore;
 	}
 
 	// Lesson 13
@@ -566,13 +1618,22 @@ protected:
 
 		int i = 0;
 		for (const auto& queueFamily : queueFamilies) {
-			if (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+			// The culling passes of the GPU driven draw lists run on the graphics queue
+			if ((queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) &&
+				(queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT)) {
 				indices.graphicsFamily = i;
 			}
 
 			VkBool32 presentSupport = false;
-			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
-				&presentSupport);
+			if (headless) {
+				// Nothing is presented, the present queue is the graphics one
+				presentSupport = indices.graphicsFamily.has_value() &&
+					indices.graphicsFamily.value() == static_cast<uint32_t>(i);
+			}
+			else {
+				vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+					&presentSupport);
+			}
 			if (presentSupport) {
 				indices.presentFamily = i;
 			}
@@ -596,8 +1657,9 @@ protected:
 		vkEnumerateDeviceExtensionProperties(device, nullptr,
 			&extensionCount, availableExtensions.data());
 
-		std::set<std::string> requiredExtensions(deviceExtensions.begin(),
-			deviceExtensions.end());
+		std::vector<const char*> requiredDeviceExtensions = getRequiredDeviceExtensions();
+		std::set<std::string> requiredExtensions(requiredDeviceExtensions.begin(),
+			requiredDeviceExtensions.end());
 
 		for (const auto& extension : availableExtensions) {
 			requiredExtensions.erase(extension.extensionName);
@@ -606,6 +1668,21 @@ protected:
 		return requiredExtensions.empty();
 	}
 
+	bool isDeviceExtensionSupported(VkPhysicalDevice device, const char* name) {
+		uint32_t extensionCount;
+		vkEnumerateDeviceExtensionProperties(device, nullptr,
+			&extensionCount, nullptr);
+
+		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+		vkEnumerateDeviceExtensionProperties(device, nullptr,
+			&extensionCount, availableExtensions.data());
+
+		for (const auto& extension : availableExtensions) {
+			if (strcmp(extension.extensionName, name) == 0) return true;
+		}
+		return false;
+	}
+
 	// Lesson 14
 	SwapChainSupportDetails querySwapChainSupport(VkPhysicalDevice device) {
 		SwapChainSupportDetails details;
@@ -656,6 +1733,16 @@ protected:
 
 		VkPhysicalDeviceFeatures deviceFeatures{};
 		deviceFeatures.samplerAnisotropy = VK_TRUE;
+		deviceFeatures.multiDrawIndirect = VK_TRUE;
+		deviceFeatures.drawIndirectFirstInstance = VK_TRUE;
+
+		VkPhysicalDeviceVulkan12Features deviceFeatures12{};
+		deviceFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		deviceFeatures12.runtimeDescriptorArray = VK_TRUE;
+		deviceFeatures12.descriptorBindingPartiallyBound = VK_TRUE;
+		deviceFeatures12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+		deviceFeatures12.drawIndirectCount = VK_TRUE;
+		deviceFeatures12.timelineSemaphore = VK_TRUE;
 
 		VkDeviceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -665,13 +1752,28 @@ protected:
 			static_cast<uint32_t>(queueCreateInfos.size());
 
 		createInfo.pEnabledFeatures = &deviceFeatures;
+		createInfo.pNext = &deviceFeatures12;
+
+		std::vector<const char*> enabledExtensions = getRequiredDeviceExtensions();
+		for (const char* extension : optionalDeviceExtensions) {
+			if (isDeviceExtensionSupported(physicalDevice, extension)) {
+				enabledExtensions.push_back(extension);
+
+				if (strcmp(extension, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) {
+					memoryBudgetSupported = true;
+				}
+			}
+		}
+
 		createInfo.enabledExtensionCount =
-			static_cast<uint32_t>(deviceExtensions.size());
-		createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+			static_cast<uint32_t>(enabledExtensions.size());
+		createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
-		createInfo.enabledLayerCount =
-			static_cast<uint32_t>(validationLayers.size());
-		createInfo.ppEnabledLayerNames = validationLayers.data();
+		if (validation) {
+			createInfo.enabledLayerCount =
+				static_cast<uint32_t>(validationLayers.size());
+			createInfo.ppEnabledLayerNames = validationLayers.data();
+		}
 
 		VkResult result = vkCreateDevice(physicalDevice, &createInfo, nullptr, &device);
 
@@ -682,6 +1784,8 @@ protected:
 
 		vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
 		vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+
+		memoryTracker.init(physicalDevice, memoryBudgetSupported);
 	}
 
 	// Lesson 14
@@ -746,6 +1850,23 @@ protected:
 		swapChainExtent = extent;
 	}
 
+	// Headless mode: one offscreen image per frame in flight takes the place of the swap chain
+	void createOffscreenImages() {
+		swapChainImageFormat = VK_FORMAT_B8G8R8A8_SRGB;
+		swapChainExtent = { windowWidth, windowHeight };
+
+		swapChainImages.resize(framesInFlight);
+		offscreenImagesMemory.resize(framesInFlight);
+		for (size_t i = 0; i < framesInFlight; i++) {
+			createImage(swapChainExtent.width, swapChainExtent.height, 1, swapChainImageFormat,
+				VK_IMAGE_TILING_OPTIMAL,
+				VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+				swapChainImages[i], offscreenImagesMemory[i],
+				MEMORY_ATTACHMENT, "offscreen image");
+		}
+	}
+
 	// Lesson 14
 	VkSurfaceFormatKHR chooseSwapSurfaceFormat(
 		const std::vector<VkSurfaceFormatKHR>& availableFormats)
@@ -835,12 +1956,13 @@ protected:
 		depthAttachment.format = VK_FORMAT_D32_SFLOAT;
 		depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
 		depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-		depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		// The depth is kept, and read to build the depth pyramid
+		depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 		depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-		depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		depthAttachment.finalLayout =
-			VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+		// The frame graph does the layout transitions and the synchronization around the pass
+		depthAttachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+		depthAttachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
 
 		VkAttachmentReference depthAttachmentRef{};
 		depthAttachmentRef.attachment = 1;
@@ -854,8 +1976,8 @@ protected:
 		colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
 		colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-		colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		colorAttachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		colorAttachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
 		VkAttachmentReference colorAttachmentRef{};
 		colorAttachmentRef.attachment = 0;
@@ -868,14 +1990,6 @@ protected:
 		subpass.pColorAttachments = &colorAttachmentRef;
 		subpass.pDepthStencilAttachment = &depthAttachmentRef;
 
-		VkSubpassDependency dependency{};
-		dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-		dependency.dstSubpass = 0;
-		dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-		dependency.srcAccessMask = 0;
-		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-
 		std::array<VkAttachmentDescription, 2> attachments =
 		{ colorAttachment, depthAttachment };
 
@@ -885,8 +1999,6 @@ protected:
 		renderPassInfo.pAttachments = attachments.data();
 		renderPassInfo.subpassCount = 1;
 		renderPassInfo.pSubpasses = &subpass;
-		renderPassInfo.dependencyCount = 1;
-		renderPassInfo.pDependencies = &dependency;
 
 		VkResult result = vkCreateRenderPass(device, &renderPassInfo, nullptr,
 			&renderPass);
@@ -894,29 +2006,56 @@ protected:
 			PrintVkError(result);
 			throw std::runtime_error("failed to create render pass!");
 		}
+
+		// Overlay pass: the upscaler covers the whole image, nothing to load
+		colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+
+		subpass.pDepthStencilAttachment = nullptr;
+
+		renderPassInfo.attachmentCount = 1;
+		renderPassInfo.pAttachments = &colorAttachment;
+
+		result = vkCreateRenderPass(device, &renderPassInfo, nullptr,
+			&overlayRenderPass);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create render pass!");
+		}
 	}
 
 	// Lesson 22.2 
 	void createFramebuffers() {
+		// The scene framebuffer has the full size, the render area follows the render scale
+		std::array<VkImageView, 2> attachments = {
+			sceneColorImageView,
+			depthImageView
+		};
+
+		VkFramebufferCreateInfo framebufferInfo{};
+		framebufferInfo.sType =
+			VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		framebufferInfo.renderPass = renderPass;
+		framebufferInfo.attachmentCount =
+			static_cast<uint32_t>(attachments.size());;
+		framebufferInfo.pAttachments = attachments.data();
+		framebufferInfo.width = swapChainExtent.width;
+		framebufferInfo.height = swapChainExtent.height;
+		framebufferInfo.layers = 1;
+
+		VkResult result = vkCreateFramebuffer(device, &framebufferInfo, nullptr,
+			&sceneFramebuffer);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create framebuffer!");
+		}
+
 		swapChainFramebuffers.resize(swapChainImageViews.size());
 		for (size_t i = 0; i < swapChainImageViews.size(); i++) {
-			std::array<VkImageView, 2> attachments = {
-				swapChainImageViews[i],
-				depthImageView
-			};
+			framebufferInfo.renderPass = overlayRenderPass;
+			framebufferInfo.attachmentCount = 1;
+			framebufferInfo.pAttachments = &swapChainImageViews[i];
 
-			VkFramebufferCreateInfo framebufferInfo{};
-			framebufferInfo.sType =
-				VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-			framebufferInfo.renderPass = renderPass;
-			framebufferInfo.attachmentCount =
-				static_cast<uint32_t>(attachments.size());;
-			framebufferInfo.pAttachments = attachments.data();
-			framebufferInfo.width = swapChainExtent.width;
-			framebufferInfo.height = swapChainExtent.height;
-			framebufferInfo.layers = 1;
-
-			VkResult result = vkCreateFramebuffer(device, &framebufferInfo, nullptr,
+			result = vkCreateFramebuffer(device, &framebufferInfo, nullptr,
 				&swapChainFramebuffers[i]);
 			if (result != VK_SUCCESS) {
 				PrintVkError(result);
@@ -943,25 +2082,107 @@ protected:
 	}
 
 	// Lesson 22.1
-	void createDepthResources() {
-		VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
+	// The resources of the frame graph, its passes set by setupFrameGraph().
+	// The depth buffer and the scene color have the full size, only renderExtent
+	// of them is drawn.
+	void createFrameGraph() {
+		frameGraph.init(this);
+
+		// Offscreen images are only copied out, by saveFrame()
+		swapChainResource = frameGraph.importOutput("swap chain",
+			headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+		sceneColorResource = frameGraph.createImage("scene color", swapChainImageFormat,
+			VK_IMAGE_ASPECT_COLOR_BIT, swapChainExtent);
+		depthResource = frameGraph.createImage("depth", VK_FORMAT_D32_SFLOAT,
+			VK_IMAGE_ASPECT_DEPTH_BIT, swapChainExtent);
+		// Created by depthPyramid.init, built once the culling passes have read it
+		depthPyramidResource = frameGraph.importImage("depth pyramid",
+			VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_GENERAL);
+
+		setupFrameGraph();
+		frameGraph.compile();
+
+		sceneColorImage = frameGraph.image(sceneColorResource);
+		sceneColorImageView = frameGraph.view(sceneColorResource);
+		depthImage = frameGraph.image(depthResource);
+		depthImageView = frameGraph.view(depthResource);
+	}
 
-		createImage(swapChainExtent.width, swapChainExtent.height, 1, depthFormat,
-			VK_IMAGE_TILING_OPTIMAL,
-			VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			depthImage, depthImageMemory);
-		depthImageView = createImageView(depthImage, depthFormat,
-			VK_IMAGE_ASPECT_DEPTH_BIT, 1);
+	// The GPU frame times drive the dynamic resolution. Called once the frame graph is set up:
+	// every pass has a scope
+	void createGpuProfiler() {
+		gpuFrameScope = gpuProfiler.addScope("frame");
+		for (FrameGraphPass& pass : frameGraph.passes) {
+			pass.profilerScope = gpuProfiler.addScope(pass.name);
+		}
+		partitionScopes.resize(scenePartitions);
+		for (int partition = 0; partition < scenePartitions; partition++) {
+			partitionScopes[partition] = gpuProfiler.addScope(partitionName(partition));
+		}
+		overlayScope = gpuProfiler.addScope("overlay commands");
+
+		gpuProfiler.init(this);
+		if (!gpuProfiler.supported) {
+			std::cout << "GPU timestamps not supported, the render scale stays fixed\n";
+		}
 	}
 
-	// Lesson 22.1
-	void createImage(uint32_t width, uint32_t height,
-		uint32_t mipLevels, // New in Lesson 23
-		VkFormat format,
+	// Reads the GPU profile of the frame whose submission has just been waited for
+	void readGpuFrameTime() {
+		if (!gpuProfiler.supported || framesDrawn < framesInFlight) return;
+
+		gpuProfiler.readFrame(static_cast<uint32_t>(currentFrame));
+		if (gpuProfiler.lastTimes[gpuFrameScope] < 0.0f) return;
+
+		lastGpuFrameTime = gpuProfiler.lastTimes[gpuFrameScope];
+		// A single slow frame does not change the resolution
+		averageGpuFrameTime = averageGpuFrameTime > 0.0f ?
+			glm::mix(averageGpuFrameTime, lastGpuFrameTime, GPU_TIME_SMOOTHING) : lastGpuFrameTime;
+	}
+
+	// Moves the render scale towards the one meeting the GPU frame budget. The cost of
+	// the scene grows with its pixels, the square of the scale.
+	void updateRenderScale() {
+		if (fixedRenderScale || averageGpuFrameTime <= 0.0f) return;
+		if (++framesSinceScaleChange < RENDER_SCALE_SETTLE_FRAMES) return;
+
+		float ratio = gpuFrameBudget / averageGpuFrameTime;
+		if (ratio >= 1.0f && ratio <= 1.0f / RENDER_SCALE_HEADROOM) return;
+
+		float scale = renderScale * std::sqrt(ratio);
+		scale = glm::clamp(scale, renderScale - MAX_RENDER_SCALE_STEP, renderScale + MAX_RENDER_SCALE_STEP);
+		scale = glm::clamp(scale, minRenderScale, 1.0f);
+		if (std::abs(scale - renderScale) < 0.01f) return;
+
+		setRenderScale(scale);
+		framesSinceScaleChange = 0;
+		renderScaleChanges++;
+	}
+
+	void setRenderScale(float scale) {
+		renderScale = scale;
+		renderExtent.width = std::max(1u, static_cast<uint32_t>(swapChainExtent.width * scale + 0.5f));
+		renderExtent.height = std::max(1u, static_cast<uint32_t>(swapChainExtent.height * scale + 0.5f));
+	}
+
+	void printResolutionStats() {
+		std::cout << "Resolution: " << renderExtent.width << "x" << renderExtent.height
+			<< " (scale " << renderScale << (fixedRenderScale ? ", fixed" : "") << ") upscaled to "
+			<< swapChainExtent.width << "x" << swapChainExtent.height << ", GPU frame "
+			<< lastGpuFrameTime << " ms, average " << averageGpuFrameTime << " ms, budget "
+			<< gpuFrameBudget << " ms, " << renderScaleChanges << " scale changes\n";
+	}
+
+	// Lesson 22.1
+	void createImage(uint32_t width, uint32_t height,
+		uint32_t mipLevels, // New in Lesson 23
+		VkFormat format,
 		VkImageTiling tiling, VkImageUsageFlags usage,
 		VkMemoryPropertyFlags properties, VkImage& image,
-		VkDeviceMemory& imageMemory) {
+		VkDeviceMemory& imageMemory,
+		MemoryCategory category, const std::string& owner,
+		uint32_t arrayLayers = 1) {
 		VkImageCreateInfo imageInfo{};
 		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -969,7 +2190,7 @@ protected:
 		imageInfo.extent.height = height;
 		imageInfo.extent.depth = 1;
 		imageInfo.mipLevels = mipLevels;
-		imageInfo.arrayLayers = 1;
+		imageInfo.arrayLayers = arrayLayers;
 		imageInfo.format = format;
 		imageInfo.tiling = tiling;
 		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -996,6 +2217,8 @@ protected:
 			VK_SUCCESS) {
 			throw std::runtime_error("failed to allocate image memory!");
 		}
+		memoryTracker.track(imageMemory, allocInfo.allocationSize,
+			allocInfo.memoryTypeIndex, category, owner);
 
 		vkBindImageMemory(device, image, imageMemory, 0);
 	}
@@ -1168,8 +2391,8 @@ protected:
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 		submitInfo.commandBufferCount = 1;
 		submitInfo.pCommandBuffers = &commandBuffer;
-		vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-		vkQueueWaitIdle(graphicsQueue);
+		// Only this submission, not the frames still in flight
+		waitForSubmission(submit(submitInfo, "single time commands"));
 
 		vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
 	}
@@ -1181,7 +2404,8 @@ protected:
 	// Lesson 21
 	void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
 		VkMemoryPropertyFlags properties,
-		VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+		VkBuffer& buffer, VkDeviceMemory& bufferMemory,
+		MemoryCategory category, const std::string& owner) {
 		VkBufferCreateInfo bufferInfo{};
 		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 		bufferInfo.size = size;
@@ -1210,10 +2434,18 @@ protected:
 			PrintVkError(result);
 			throw std::runtime_error("failed to allocate vertex buffer memory!");
 		}
+		memoryTracker.track(bufferMemory, allocInfo.allocationSize,
+			allocInfo.memoryTypeIndex, category, owner);
 
 		vkBindBufferMemory(device, buffer, bufferMemory, 0);
 	}
 
+	// Every memory allocated with createBuffer / createImage must be freed here
+	void freeMemory(VkDeviceMemory memory) {
+		memoryTracker.untrack(memory);
+		vkFreeMemory(device, memory, nullptr);
+	}
+
 	// Lesson 21
 	uint32_t findMemoryType(uint32_t typeFilter,
 		VkMemoryPropertyFlags properties) {
@@ -1232,121 +2464,466 @@ protected:
 	}
 
 	// Lesson 21
+	// Pools are created on demand: allocateDescriptorSets adds a new one
+	// whenever the last pool runs out of space.
 	void createDescriptorPool() {
-		std::array<VkDescriptorPoolSize, 2> poolSizes{};
-		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		poolSizes[0].descriptorCount = static_cast<uint32_t>(uniformBlocksInPool *
-			swapChainImages.size());
+		std::array<VkDescriptorPoolSize, 4> poolSizes{};
+		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+		poolSizes[0].descriptorCount = SETS_PER_DESCRIPTOR_POOL;
 		// New - Lesson 23
 		poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-		poolSizes[1].descriptorCount = static_cast<uint32_t>(texturesInPool *
-			swapChainImages.size());
+		poolSizes[1].descriptorCount = SETS_PER_DESCRIPTOR_POOL;
 		//
+		// GPU driven draw lists and depth pyramid
+		poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		poolSizes[2].descriptorCount = SETS_PER_DESCRIPTOR_POOL;
+		poolSizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		poolSizes[3].descriptorCount = SETS_PER_DESCRIPTOR_POOL;
 
 		VkDescriptorPoolCreateInfo poolInfo{};
 		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
 		poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());;
 		poolInfo.pPoolSizes = poolSizes.data();
-		poolInfo.maxSets = static_cast<uint32_t>(setsInPool * swapChainImages.size());
+		poolInfo.maxSets = SETS_PER_DESCRIPTOR_POOL;
 
+		VkDescriptorPool descriptorPool;
 		VkResult result = vkCreateDescriptorPool(device, &poolInfo, nullptr,
 			&descriptorPool);
 		if (result != VK_SUCCESS) {
 			PrintVkError(result);
 			throw std::runtime_error("failed to create descriptor pool!");
 		}
-	}
-
-	virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
-
-	// Lesson 22.5 (and 13)
-	void createCommandBuffers() {
-		// Lesson 13
-		commandBuffers.resize(swapChainFramebuffers.size());
 
-		VkCommandBufferAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-		allocInfo.commandPool = commandPool;
-		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-		allocInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+		descriptorPools.push_back(descriptorPool);
+	}
 
-		VkResult result = vkAllocateCommandBuffers(device, &allocInfo,
-			commandBuffers.data());
+	void allocateDescriptorSets(uint32_t count, const VkDescriptorSetLayout* layouts,
+		VkDescriptorSet* descriptorSets) {
+		VkDescriptorSetAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		allocInfo.descriptorPool = descriptorPools.back();
+		allocInfo.descriptorSetCount = count;
+		allocInfo.pSetLayouts = layouts;
+
+		VkResult result = vkAllocateDescriptorSets(device, &allocInfo,
+			descriptorSets);
+		if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL) {
+			createDescriptorPool();
+			allocInfo.descriptorPool = descriptorPools.back();
+			result = vkAllocateDescriptorSets(device, &allocInfo, descriptorSets);
+		}
 		if (result != VK_SUCCESS) {
 			PrintVkError(result);
-			throw std::runtime_error("failed to allocate command buffers!");
+			throw std::runtime_error("failed to allocate descriptor sets!");
 		}
+	}
 
-		// Lesson 22.5 --- Draw calls
-		// This is where the commands that actually draw something on screen are!
-		for (size_t i = 0; i < commandBuffers.size(); i++) {
-			VkCommandBufferBeginInfo beginInfo{};
-			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-			beginInfo.flags = 0; // Optional
-			beginInfo.pInheritanceInfo = nullptr; // Optional
+	// Records the draw calls of a scene partition in a secondary command buffer.
+	// Partitions are recorded in parallel, and executed in partition order.
+	virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int partition, int currentFrame) = 0;
 
-			if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
-				VK_SUCCESS) {
-				throw std::runtime_error("failed to begin recording command buffer!");
+	// Creates pipelines in parallel on the worker threads, each job calling the init()
+	// of one of them: the driver compiles them at the same time, sharing the pipeline cache.
+	// An exception thrown by a job is thrown again here once all of them are done.
+	void initPipelines(const std::vector<std::function<void()>>& jobs) {
+		auto creationStart = std::chrono::high_resolution_clock::now();
+
+		std::vector<std::exception_ptr> errors(jobs.size());
+		auto createPipeline = [&](uint32_t job, uint32_t worker) {
+			try {
+				jobs[job]();
+			}
+			catch (...) {
+				errors[job] = std::current_exception();
 			}
+		};
+		recordingWorkers.run(static_cast<uint32_t>(jobs.size()), createPipeline);
+
+		pipelineCreationTime += std::chrono::duration<float, std::chrono::milliseconds::period>(
+			std::chrono::high_resolution_clock::now() - creationStart).count();
+
+		for (std::exception_ptr& error : errors) {
+			if (error) std::rethrow_exception(error);
+		}
+	}
+
+	// The name of a partition of populateCommandBuffer, for its GPU profiler scope
+	virtual std::string partitionName(int partition) {
+		return "partition " + std::to_string(partition);
+	}
 
+	// Records what is drawn at the native resolution over the upscaled scene, such as the HUD,
+	// with pipelines created for overlayRenderPass
+	virtual void populateOverlayCommands(VkCommandBuffer commandBuffer, int currentFrame) {}
+
+	// Adds the passes of a frame to frameGraph, in the order they are recorded, with the
+	// resources they use. Called before localInit(): the passes only use what it creates
+	// once they are recorded. Applications adding their own passes call the add*Pass() below.
+	virtual void setupFrameGraph() {
+		addScenePass();
+		addDepthPyramidPass();
+		addOverlayPass();
+	}
+
+	// The partitions of populateCommandBuffer, in renderPass
+	FrameGraphPass& addScenePass() {
+		return frameGraph.addPass("scene", [this](VkCommandBuffer commandBuffer) {
 			VkRenderPassBeginInfo renderPassInfo{};
 			renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
 			renderPassInfo.renderPass = renderPass;
-			renderPassInfo.framebuffer = swapChainFramebuffers[i];
+			renderPassInfo.framebuffer = sceneFramebuffer;
 			renderPassInfo.renderArea.offset = { 0, 0 };
-			renderPassInfo.renderArea.extent = swapChainExtent;
+			renderPassInfo.renderArea.extent = renderExtent;
 
+			// No layers yet in the overdraw view
 			std::array<VkClearValue, 2> clearValues{};
-			clearValues[0].color = initialBackgroundColor;
+			clearValues[0].color = overdrawView ? VkClearColorValue{} : initialBackgroundColor;
 			clearValues[1].depthStencil = { 1.0f, 0 };
 
 			renderPassInfo.clearValueCount =
 				static_cast<uint32_t>(clearValues.size());
 			renderPassInfo.pClearValues = clearValues.data();
 
-			vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
-				VK_SUBPASS_CONTENTS_INLINE);
+			vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+				VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+			vkCmdExecuteCommands(commandBuffer,
+				static_cast<uint32_t>(partitionCommandBuffers.size()),
+				partitionCommandBuffers.data());
+
+			vkCmdEndRenderPass(commandBuffer);
+		})
+			.write(sceneColorResource, ACCESS_COLOR_ATTACHMENT)
+			.write(depthResource, ACCESS_DEPTH_ATTACHMENT);
+	}
+
+	// For the occlusion tests of the next frame
+	FrameGraphPass& addDepthPyramidPass() {
+		return frameGraph.addPass("depth pyramid", [this](VkCommandBuffer commandBuffer) {
+			depthPyramid.build(commandBuffer);
+		})
+			.read(depthResource, ACCESS_COMPUTE_SAMPLED_DEPTH)
+			.write(depthPyramidResource, ACCESS_COMPUTE_WRITE);
+	}
+
+	// The scene to the swap chain image, then populateOverlayCommands at the native resolution
+	FrameGraphPass& addOverlayPass() {
+		return frameGraph.addPass("overlay", [this](VkCommandBuffer commandBuffer) {
+			VkRenderPassBeginInfo overlayPassInfo{};
+			overlayPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+			overlayPassInfo.renderPass = overlayRenderPass;
+			overlayPassInfo.framebuffer = swapChainFramebuffers[currentImageIndex];
+			overlayPassInfo.renderArea.offset = { 0, 0 };
+			overlayPassInfo.renderArea.extent = swapChainExtent;
+
+			vkCmdBeginRenderPass(commandBuffer, &overlayPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+
+			setViewport(commandBuffer, swapChainExtent);
+			upscaler.draw(commandBuffer);
+			gpuProfiler.begin(commandBuffer, static_cast<uint32_t>(currentFrame), overlayScope);
+			populateOverlayCommands(commandBuffer, currentFrame);
+			gpuProfiler.end(commandBuffer, static_cast<uint32_t>(currentFrame), overlayScope);
+
+			vkCmdEndRenderPass(commandBuffer);
+		})
+			.read(sceneColorResource, ACCESS_FRAGMENT_SAMPLED)
+			.write(swapChainResource, ACCESS_COLOR_ATTACHMENT);
+	}
+
+	// Lesson 22.5 (and 13)
+	// Command buffers are recorded again every frame from transient pools, one for
+	// every frame in flight and recording thread: a pool is only used by its thread,
+	// and it is reset as a whole once the submission of its frame has completed.
+	void createCommandBuffers() {
+		QueueFamilyIndices queueFamilyIndices =
+			findQueueFamilies(physicalDevice);
+
+		frameCommandPools.resize(framesInFlight);
+		commandBuffers.resize(framesInFlight);
+		partitionCommandBuffers.resize(scenePartitions);
+		partitionErrors.resize(scenePartitions);
+
+		for (size_t frame = 0; frame < framesInFlight; frame++) {
+			frameCommandPools[frame].resize(recordingWorkers.workerCount());
+
+			for (FrameCommandPool& framePool : frameCommandPools[frame]) {
+				VkCommandPoolCreateInfo poolInfo{};
+				poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+				poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+				poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+				VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &framePool.pool);
+				if (result != VK_SUCCESS) {
+					PrintVkError(result);
+					throw std::runtime_error("failed to create command pool!");
+				}
+
+				// A thread may end up recording every partition
+				framePool.secondaryBuffers.resize(scenePartitions);
+				framePool.used = 0;
+
+				VkCommandBufferAllocateInfo allocInfo{};
+				allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+				allocInfo.commandPool = framePool.pool;
+				allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+				allocInfo.commandBufferCount = (uint32_t)framePool.secondaryBuffers.size();
+
+				result = vkAllocateCommandBuffers(device, &allocInfo,
+					framePool.secondaryBuffers.data());
+				if (result != VK_SUCCESS) {
+					PrintVkError(result);
+					throw std::runtime_error("failed to allocate command buffers!");
+				}
+			}
+
+			// The primary command buffer comes from the pool of the main thread
+			VkCommandBufferAllocateInfo allocInfo{};
+			allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			allocInfo.commandPool = frameCommandPools[frame][0].pool;
+			allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+			allocInfo.commandBufferCount = 1;
+
+			VkResult result = vkAllocateCommandBuffers(device, &allocInfo,
+				&commandBuffers[frame]);
+			if (result != VK_SUCCESS) {
+				PrintVkError(result);
+				throw std::runtime_error("failed to allocate command buffers!");
+			}
+		}
+
+		std::cout << "Command buffer recording threads: " << recordingWorkers.workerCount()
+			<< ", frames in flight: " << framesInFlight << "\n";
+	}
+
+	// Lesson 22.5 --- Draw calls
+	// This is where the commands that actually draw something on screen are!
+	void recordCommandBuffer(uint32_t imageIndex) {
+		auto recordingStart = std::chrono::high_resolution_clock::now();
+
+		for (FrameCommandPool& framePool : frameCommandPools[currentFrame]) {
+			vkResetCommandPool(device, framePool.pool, 0);
+			framePool.used = 0;
+		}
 
+		VkCommandBufferInheritanceInfo inheritanceInfo{};
+		inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+		inheritanceInfo.renderPass = renderPass;
+		inheritanceInfo.subpass = 0;
+		inheritanceInfo.framebuffer = sceneFramebuffer;
+
+		// Every partition is recorded by whichever thread picks it up,
+		// in a secondary command buffer of that thread's pool. An exception
+		// cannot leave a worker thread: it is thrown again on this one.
+		for (std::exception_ptr& error : partitionErrors) error = nullptr;
+		auto recordPartition = [this, &inheritanceInfo](uint32_t partition, uint32_t worker) {
+			try {
+				FrameCommandPool& framePool = frameCommandPools[currentFrame][worker];
+				VkCommandBuffer commandBuffer = framePool.secondaryBuffers[framePool.used++];
+
+				VkCommandBufferBeginInfo beginInfo{};
+				beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+				beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT |
+					VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+				beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+				if (vkBeginCommandBuffer(commandBuffer, &beginInfo) !=
+					VK_SUCCESS) {
+					throw std::runtime_error("failed to begin recording command buffer!");
+				}
 
-			populateCommandBuffer(commandBuffers[i], i);
+				// Dynamic state is not inherited by secondary command buffers
+				setViewport(commandBuffer, renderExtent);
 
+				gpuProfiler.begin(commandBuffer, static_cast<uint32_t>(currentFrame), partitionScopes[partition]);
+				populateCommandBuffer(commandBuffer, partition, currentFrame);
+				gpuProfiler.end(commandBuffer, static_cast<uint32_t>(currentFrame), partitionScopes[partition]);
 
-			vkCmdEndRenderPass(commandBuffers[i]);
+				if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+					throw std::runtime_error("failed to record command buffer!");
+				}
 
-			if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-				throw std::runtime_error("failed to record command buffer!");
+				partitionCommandBuffers[partition] = commandBuffer;
+			}
+			catch (...) {
+				partitionErrors[partition] = std::current_exception();
 			}
+		};
+
+		recordingWorkers.run(static_cast<uint32_t>(scenePartitions), recordPartition);
+
+		for (std::exception_ptr& error : partitionErrors) {
+			if (error) std::rethrow_exception(error);
+		}
+
+		VkCommandBuffer commandBuffer = commandBuffers[currentFrame];
+
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		beginInfo.pInheritanceInfo = nullptr; // Optional
+
+		if (vkBeginCommandBuffer(commandBuffer, &beginInfo) !=
+			VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+
+		gpuProfiler.beginFrame(commandBuffer, static_cast<uint32_t>(currentFrame));
+		gpuProfiler.begin(commandBuffer, static_cast<uint32_t>(currentFrame), gpuFrameScope);
+
+		// The passes, with the barriers between them
+		currentImageIndex = imageIndex;
+		frameGraph.setImage(swapChainResource, swapChainImages[imageIndex]);
+		frameGraph.execute(commandBuffer);
+
+		gpuProfiler.end(commandBuffer, static_cast<uint32_t>(currentFrame), gpuFrameScope);
+
+		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+
+		auto recordingEnd = std::chrono::high_resolution_clock::now();
+		lastRecordingTime = std::chrono::duration<float, std::chrono::milliseconds::period>(
+			recordingEnd - recordingStart).count();
+		totalRecordingTime += lastRecordingTime;
+		recordedFrames++;
+	}
+
+	void setViewport(VkCommandBuffer commandBuffer, VkExtent2D extent) {
+		VkViewport viewport{};
+		viewport.width = (float)extent.width;
+		viewport.height = (float)extent.height;
+		viewport.minDepth = 0.0f;
+		viewport.maxDepth = 1.0f;
+		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+		VkRect2D scissor{};
+		scissor.offset = { 0, 0 };
+		scissor.extent = extent;
+		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+	}
+
+	void printRecordingStats() {
+		std::cout << "Command recording: last " << lastRecordingTime << " ms, average "
+			<< (recordedFrames > 0 ? totalRecordingTime / recordedFrames : 0.0) << " ms over "
+			<< recordedFrames << " frames, " << scenePartitions << " partitions on "
+			<< recordingWorkers.workerCount() << " threads\n";
+	}
+
+	// Created with the device: the uploads of the initialization already wait on it
+	void createGpuTimeline() {
+		VkSemaphoreTypeCreateInfo typeInfo{};
+		typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+		typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+		typeInfo.initialValue = 0;
+
+		VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		semaphoreInfo.pNext = &typeInfo;
+
+		VkResult result = vkCreateSemaphore(device, &semaphoreInfo, nullptr, &gpuTimeline);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create timeline semaphore!");
+		}
+	}
+
+	// Submits to the graphics queue, signaling gpuTimeline after the semaphores of submitInfo.
+	// Returns the value signaled, to wait for or query the submission.
+	uint64_t submit(VkSubmitInfo submitInfo, const char* what) {
+		uint64_t value = lastSubmission + 1;
+
+		// Binary semaphores ignore their values, but there must be one for each
+		std::array<VkSemaphore, 2> signalSemaphores{};
+		std::array<uint64_t, 2> signalValues = { value, value };
+		assert(submitInfo.signalSemaphoreCount < signalSemaphores.size());
+		for (uint32_t i = 0; i < submitInfo.signalSemaphoreCount; i++) {
+			signalSemaphores[i] = submitInfo.pSignalSemaphores[i];
+		}
+		signalSemaphores[submitInfo.signalSemaphoreCount] = gpuTimeline;
+
+		VkTimelineSemaphoreSubmitInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		timelineInfo.signalSemaphoreValueCount = submitInfo.signalSemaphoreCount + 1;
+		timelineInfo.pSignalSemaphoreValues = signalValues.data();
+
+		submitInfo.pNext = &timelineInfo;
+		submitInfo.signalSemaphoreCount++;
+		submitInfo.pSignalSemaphores = signalSemaphores.data();
+
+		VkResult result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error(std::string("failed to submit ") + what + "!");
+		}
+
+		lastSubmission = value;
+		return value;
+	}
+
+	// Whether the submission that signals value has completed, without blocking
+	bool isSubmissionComplete(uint64_t value) {
+		if (value <= completedSubmission) return true;
+
+		VkResult result = vkGetSemaphoreCounterValue(device, gpuTimeline, &completedSubmission);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to query timeline semaphore!");
+		}
+		return value <= completedSubmission;
+	}
+
+	void waitForSubmission(uint64_t value) {
+		if (value <= completedSubmission) return;
+
+		VkSemaphoreWaitInfo waitInfo{};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &gpuTimeline;
+		waitInfo.pValues = &value;
+
+		VkResult result = vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to wait for timeline semaphore!");
 		}
+		completedSubmission = value;
+	}
+
+	// Frames are numbered from 0 as framesDrawn counts them. The frames older than those
+	// in flight have been waited for when their slot was reused.
+	bool isFrameComplete(size_t frame) {
+		if (frame >= framesDrawn) return false;
+		if (frame + framesInFlight < framesDrawn) return true;
+		return isSubmissionComplete(frameSubmissions[frame % framesInFlight]);
+	}
+
+	void waitForFrame(size_t frame) {
+		// A frame not yet submitted would never complete
+		assert(frame < framesDrawn);
+		if (frame + framesInFlight < framesDrawn) return;
+		waitForSubmission(frameSubmissions[frame % framesInFlight]);
 	}
 
 	// Lesson 22.5
 	void createSyncObjects() {
-		imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-		renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-		inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
-		imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
+		imageAvailableSemaphores.resize(framesInFlight);
+		renderFinishedSemaphores.resize(framesInFlight);
+		// 0 is signaled from the start
+		frameSubmissions.resize(framesInFlight, 0);
+		imageSubmissions.resize(swapChainImages.size(), 0);
 
 		VkSemaphoreCreateInfo semaphoreInfo{};
 		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-		VkFenceCreateInfo fenceInfo{};
-		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-
-		for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+		for (size_t i = 0; i < framesInFlight; i++) {
 			VkResult result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
 				&imageAvailableSemaphores[i]);
 			VkResult result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
 				&renderFinishedSemaphores[i]);
-			VkResult result3 = vkCreateFence(device, &fenceInfo, nullptr,
-				&inFlightFences[i]);
 			if (result1 != VK_SUCCESS ||
-				result2 != VK_SUCCESS ||
-				result3 != VK_SUCCESS) {
+				result2 != VK_SUCCESS) {
 				PrintVkError(result1);
 				PrintVkError(result2);
-				PrintVkError(result3);
 				throw std::runtime_error("failed to create synchronization objects for a frame!!");
 			}
 		}
@@ -1354,6 +2931,23 @@ protected:
 
 	// Lesson 22.6 --- Main Rendering Loop
 	void mainLoop() {
+		if (headless) {
+			auto loopStart = std::chrono::high_resolution_clock::now();
+
+			for (uint32_t frame = 0; frame < headlessFrames; frame++) {
+				drawFrame();
+			}
+			vkDeviceWaitIdle(device);
+
+			float loopTime = std::chrono::duration<float, std::chrono::milliseconds::period>(
+				std::chrono::high_resolution_clock::now() - loopStart).count();
+			std::cout << "Headless: " << headlessFrames << " frames at "
+				<< swapChainExtent.width << "x" << swapChainExtent.height << " in " << loopTime << " ms, "
+				<< (headlessFrames > 0 ? loopTime / headlessFrames : 0.0f) << " ms per frame\n";
+			gpuProfiler.printSummary(std::cout);
+			return;
+		}
+
 		while (!glfwWindowShouldClose(window)) {
 			glfwPollEvents();
 			drawFrame();
@@ -1364,41 +2958,83 @@ protected:
 
 	// Lesson 22.6
 	void drawFrame() {
-		vkWaitForFences(device, 1, &inFlightFences[currentFrame],
-			VK_TRUE, UINT64_MAX);
+		TraceScope frameScope(trace, "frame", TRACE_TRACK_MAIN);
+
+		// The previous frame of this slot: its command buffers, uniforms and counters are free
+		{
+			TraceScope waitScope(trace, "wait for frame slot", TRACE_TRACK_MAIN);
+			waitForSubmission(frameSubmissions[currentFrame]);
+		}
+
+		readGpuFrameTime();
+		updateRenderScale();
 
 		uint32_t imageIndex;
 
-		VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
-			imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+		VkResult result = VK_SUCCESS;
+		if (headless) {
+			imageIndex = static_cast<uint32_t>(currentFrame);
+		}
+		else {
+			TraceScope acquireScope(trace, "acquire image", TRACE_TRACK_MAIN);
+			result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
+				imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+		}
+
+		// With more images than frames in flight, the last frame drawn to this one is in another slot
+		{
+			TraceScope waitScope(trace, "wait for image", TRACE_TRACK_MAIN);
+			waitForSubmission(imageSubmissions[imageIndex]);
+		}
+
+		size_t heapAllocations = heapAllocationCount();
+
+		{
+			TraceScope updateScope(trace, "update", TRACE_TRACK_MAIN);
+			updateUniformBuffer(currentFrame);
+		}
 
-		if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
-			vkWaitForFences(device, 1, &imagesInFlight[imageIndex],
-				VK_TRUE, UINT64_MAX);
+		{
+			TraceScope recordScope(trace, "record", TRACE_TRACK_MAIN);
+			recordCommandBuffer(imageIndex);
 		}
-		imagesInFlight[imageIndex] = inFlightFences[currentFrame];
 
-		updateUniformBuffer(imageIndex);
+		// After the first frames (one per frame in flight, and one more) the simulation and
+		// the recording must not touch the heap: their working data is allocated once, at init
+		assert(framesDrawn <= framesInFlight || heapAllocationCount() == heapAllocations);
+		size_t frameNumber = framesDrawn;
 
+		// Offscreen images are not acquired nor presented: no semaphores
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 		VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame] };
 		VkPipelineStageFlags waitStages[] =
 		{ VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-		submitInfo.waitSemaphoreCount = 1;
+		submitInfo.waitSemaphoreCount = headless ? 0 : 1;
 		submitInfo.pWaitSemaphores = waitSemaphores;
 		submitInfo.pWaitDstStageMask = waitStages;
 		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+		submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
 		VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
-		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.signalSemaphoreCount = headless ? 0 : 1;
 		submitInfo.pSignalSemaphores = signalSemaphores;
 
-		vkResetFences(device, 1, &inFlightFences[currentFrame]);
-
-		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo,
-			inFlightFences[currentFrame]) != VK_SUCCESS) {
-			throw std::runtime_error("failed to submit draw command buffer!");
+		uint64_t submission;
+		{
+			TraceScope submitScope(trace, "submit", TRACE_TRACK_MAIN);
+			submission = submit(submitInfo, "draw command buffer");
+		}
+		frameSubmissions[currentFrame] = submission;
+		imageSubmissions[imageIndex] = submission;
+		// Counted once its submission is known, for isFrameComplete()
+		framesDrawn++;
+
+		if (headless) {
+			if (std::find(dumpFrames.begin(), dumpFrames.end(), frameNumber) != dumpFrames.end()) {
+				saveFrame(imageIndex, dumpDirectory + "/frame_" + std::to_string(frameNumber) + ".ppm");
+			}
+			currentFrame = (currentFrame + 1) % framesInFlight;
+			return;
 		}
 
 		VkPresentInfoKHR presentInfo{};
@@ -1412,60 +3048,185 @@ protected:
 		presentInfo.pImageIndices = &imageIndex;
 		presentInfo.pResults = nullptr; // Optional
 
-		result = vkQueuePresentKHR(presentQueue, &presentInfo);
+		{
+			TraceScope presentScope(trace, "present", TRACE_TRACK_MAIN);
+			result = vkQueuePresentKHR(presentQueue, &presentInfo);
+		}
+
+		currentFrame = (currentFrame + 1) % framesInFlight;
+	}
+
+	// Copies an offscreen image, once its frame is rendered, to a binary PPM file
+	void saveFrame(uint32_t imageIndex, const std::string& path) {
+		uint32_t width = swapChainExtent.width;
+		uint32_t height = swapChainExtent.height;
+		VkDeviceSize imageSize = static_cast<VkDeviceSize>(width) * height * 4;
+
+		VkBuffer readbackBuffer;
+		VkDeviceMemory readbackBufferMemory;
+		createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			readbackBuffer, readbackBufferMemory, MEMORY_STAGING, "frame readback");
+
+		// Submitted after the frame: waits for its color writes and for the final barrier of the
+		// frame graph, which moves the image to TRANSFER_SRC_OPTIMAL at the bottom of the pipe
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+		VkImageMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = swapChainImages[imageIndex];
+		barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+		vkCmdPipelineBarrier(commandBuffer,
+			VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+		VkBufferImageCopy region{};
+		region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+		region.imageExtent = { width, height, 1 };
+		vkCmdCopyImageToBuffer(commandBuffer, swapChainImages[imageIndex],
+			VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffer, 1, &region);
+
+		// The copy made visible to the host, which maps the buffer once the submission completes
+		VkBufferMemoryBarrier hostBarrier{};
+		hostBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		hostBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		hostBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		hostBarrier.buffer = readbackBuffer;
+		hostBarrier.offset = 0;
+		hostBarrier.size = VK_WHOLE_SIZE;
+
+		vkCmdPipelineBarrier(commandBuffer,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+			0, 0, nullptr, 1, &hostBarrier, 0, nullptr);
+
+		endSingleTimeCommands(commandBuffer);
+
+		void* data;
+		VkResult result = vkMapMemory(device, readbackBufferMemory, 0, imageSize, 0, &data);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map frame readback buffer!");
+		}
+
+		// BGRA texels, already sRGB encoded
+		const unsigned char* texels = static_cast<const unsigned char*>(data);
+		std::vector<unsigned char> pixels(static_cast<size_t>(width) * height * 3);
+		for (size_t i = 0; i < static_cast<size_t>(width) * height; i++) {
+			pixels[3 * i + 0] = texels[4 * i + 2];
+			pixels[3 * i + 1] = texels[4 * i + 1];
+			pixels[3 * i + 2] = texels[4 * i + 0];
+		}
+
+		vkUnmapMemory(device, readbackBufferMemory);
+		vkDestroyBuffer(device, readbackBuffer, nullptr);
+		freeMemory(readbackBufferMemory);
+
+		std::ofstream file(path, std::ios::binary);
+		if (!file) {
+			throw std::runtime_error("failed to open " + path + "!");
+		}
+		file << "P6\n" << width << " " << height << "\n255\n";
+		file.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
 
-		currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+		std::cout << "Saved frame to " << path << "\n";
 	}
 
-	virtual void updateUniformBuffer(uint32_t currentImage) = 0;
+	virtual void updateUniformBuffer(uint32_t currentFrame) = 0;
 
 	virtual void localCleanup() = 0;
 
 	// All lessons
 
 	void cleanup() {
-		vkDestroyImageView(device, depthImageView, nullptr);
-		vkDestroyImage(device, depthImage, nullptr);
-		vkFreeMemory(device, depthImageMemory, nullptr);
+		memoryTracker.printSummary(std::cout);
+
+		frameGraph.cleanup();
+		vkDestroyFramebuffer(device, sceneFramebuffer, nullptr);
 
 		for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
 			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
 		}
 
-		vkFreeCommandBuffers(device, commandPool,
-			static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+		recordingWorkers.cleanup();
+		printRecordingStats();
+
+		// Destroying the pools frees their command buffers
+		for (size_t frame = 0; frame < frameCommandPools.size(); frame++) {
+			for (FrameCommandPool& framePool : frameCommandPools[frame]) {
+				vkDestroyCommandPool(device, framePool.pool, nullptr);
+			}
+		}
 
 		vkDestroyRenderPass(device, renderPass, nullptr);
+		vkDestroyRenderPass(device, overlayRenderPass, nullptr);
 
 		for (size_t i = 0; i < swapChainImageViews.size(); i++) {
 			vkDestroyImageView(device, swapChainImageViews[i], nullptr);
 		}
 
-		vkDestroySwapchainKHR(device, swapChain, nullptr);
+		if (headless) {
+			for (size_t i = 0; i < swapChainImages.size(); i++) {
+				vkDestroyImage(device, swapChainImages[i], nullptr);
+				freeMemory(offscreenImagesMemory[i]);
+			}
+		}
+		else {
+			vkDestroySwapchainKHR(device, swapChain, nullptr);
+		}
 
-		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+		for (VkDescriptorPool descriptorPool : descriptorPools) {
+			vkDestroyDescriptorPool(device, descriptorPool, nullptr);
+		}
 
 
 		localCleanup();
 
-		for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+		uniformRing.cleanup();
+		instanceBuffer.cleanup();
+		textureTable.cleanup();
+		depthPyramid.cleanup();
+		upscaler.cleanup();
+
+		gpuProfiler.cleanup();
+		if (trace.enabled()) trace.write(tracePath);
+
+		for (size_t i = 0; i < framesInFlight; i++) {
 			vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
 			vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
-			vkDestroyFence(device, inFlightFences[i], nullptr);
 		}
+		vkDestroySemaphore(device, gpuTimeline, nullptr);
 
 		vkDestroyCommandPool(device, commandPool, nullptr);
 
+		pipelineCache.save();
+		pipelineCache.cleanup();
+
+		if (memoryTracker.liveAllocations() > 0) {
+			std::cout << "Leaked GPU allocations:" << std::endl;
+			memoryTracker.printAllocations(std::cout);
+		}
+
 		vkDestroyDevice(device, nullptr);
 
-		DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
+		if (validation) DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
 
-		vkDestroySurfaceKHR(instance, surface, nullptr);
+		if (!headless) vkDestroySurfaceKHR(instance, surface, nullptr);
 		vkDestroyInstance(instance, nullptr);
 
-		glfwDestroyWindow(window);
+		if (!headless) {
+			glfwDestroyWindow(window);
 
-		glfwTerminate();
+			glfwTerminate();
+		}
 	}
 
 };
@@ -1520,7 +3281,8 @@ void Model::createVertexBuffer() {
 	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		vertexBuffer, vertexBufferMemory);
+		vertexBuffer, vertexBufferMemory,
+		MEMORY_MESH, name);
 
 	void* data;
 	vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
@@ -1533,7 +3295,8 @@ void Model::createIndexBuffer() {
 	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		indexBuffer, indexBufferMemory);
+		indexBuffer, indexBufferMemory,
+		MEMORY_MESH, name);
 
 	void* data;
 	vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
@@ -1541,26 +3304,199 @@ void Model::createIndexBuffer() {
 	vkUnmapMemory(BP->device, indexBufferMemory);
 }
 
-void Model::init(BaseProject* bp, std::string file) {
+void Model::computeBounds() {
+	boundsMin = glm::vec3(std::numeric_limits<float>::max());
+	boundsMax = glm::vec3(-std::numeric_limits<float>::max());
+	for (const Vertex& vertex : vertices) {
+		boundsMin = glm::min(boundsMin, vertex.pos);
+		boundsMax = glm::max(boundsMax, vertex.pos);
+	}
+
+	ModelChunk chunk{};
+	chunk.lods[0] = { 0, static_cast<uint32_t>(indices.size()) };
+	chunk.lodCount = 1;
+	chunk.boundsMin = boundsMin;
+	chunk.boundsMax = boundsMax;
+	chunks.assign(1, chunk);
+}
+
+// Every triangle goes to the cell of its centroid, and the index buffer is
+// reordered so that the triangles of a chunk are contiguous
+void Model::splitIntoChunks(int gridSize) {
+	glm::vec3 size = boundsMax - boundsMin;
+	int cellCount = gridSize * gridSize;
+
+	auto cellOf = [&](size_t triangle) {
+		glm::vec3 centroid = (vertices[indices[triangle * 3]].pos +
+			vertices[indices[triangle * 3 + 1]].pos +
+			vertices[indices[triangle * 3 + 2]].pos) / 3.0f;
+		glm::vec3 cell = (centroid - boundsMin) / size * (float)gridSize;
+		int x = glm::clamp((int)cell.x, 0, gridSize - 1);
+		int y = glm::clamp((int)cell.y, 0, gridSize - 1);
+		return y * gridSize + x;
+	};
+
+	size_t triangleCount = indices.size() / 3;
+	std::vector<uint32_t> cellTriangles(cellCount + 1, 0);
+	for (size_t t = 0; t < triangleCount; t++) {
+		cellTriangles[cellOf(t) + 1]++;
+	}
+	for (int c = 0; c < cellCount; c++) {
+		cellTriangles[c + 1] += cellTriangles[c];
+	}
+
+	std::vector<uint32_t> sorted(indices.size());
+	std::vector<uint32_t> next(cellTriangles.begin(), cellTriangles.end() - 1);
+	for (size_t t = 0; t < triangleCount; t++) {
+		uint32_t position = next[cellOf(t)]++;
+		for (int v = 0; v < 3; v++) {
+			sorted[position * 3 + v] = indices[t * 3 + v];
+		}
+	}
+	indices.swap(sorted);
+
+	chunks.clear();
+	for (int c = 0; c < cellCount; c++) {
+		ModelChunk chunk{};
+		IndexRange range = { cellTriangles[c] * 3, (cellTriangles[c + 1] - cellTriangles[c]) * 3 };
+		if (range.indexCount == 0) continue;
+
+		chunk.lods[0] = range;
+		chunk.lodCount = 1;
+		chunk.boundsMin = glm::vec3(std::numeric_limits<float>::max());
+		chunk.boundsMax = glm::vec3(-std::numeric_limits<float>::max());
+		for (uint32_t i = range.firstIndex; i < range.firstIndex + range.indexCount; i++) {
+			chunk.boundsMin = glm::min(chunk.boundsMin, vertices[indices[i]].pos);
+			chunk.boundsMax = glm::max(chunk.boundsMax, vertices[indices[i]].pos);
+		}
+		chunks.push_back(chunk);
+	}
+}
+
+// Vertex clustering: at every level the vertices are snapped to a grid over the whole
+// model that halves its resolution, the vertices of a chunk in the same cell are merged
+// into their average, and the triangles that collapse are dropped. The vertices on the
+// border between chunks never move: neighbouring chunks match at any levels of detail.
+void Model::buildLods(uint32_t lodCount, int gridSize) {
+	lodCount = std::min(lodCount, MAX_MODEL_LODS);
+	glm::vec3 size = glm::max(boundsMax - boundsMin, glm::vec3(1e-6f));
+
+	// By position: the same point may be a different vertex in every chunk
+	const uint32_t BORDER = std::numeric_limits<uint32_t>::max();
+	std::map<std::array<float, 3>, uint32_t> pointChunks;
+	for (uint32_t c = 0; c < chunks.size(); c++) {
+		const IndexRange& full = chunks[c].lods[0];
+		for (uint32_t i = full.firstIndex; i < full.firstIndex + full.indexCount; i++) {
+			const glm::vec3& pos = vertices[indices[i]].pos;
+			uint32_t& chunk = pointChunks.emplace(std::array<float, 3>{ pos.x, pos.y, pos.z }, c).first->second;
+			if (chunk != c) chunk = BORDER;
+		}
+	}
+	auto onBorder = [&](uint32_t index) {
+		const glm::vec3& pos = vertices[index].pos;
+		return pointChunks[std::array<float, 3>{ pos.x, pos.y, pos.z }] == BORDER;
+	};
+
+	struct Cluster {
+		Vertex sum;
+		uint32_t count;
+		uint32_t vertex;
+	};
+
+	for (ModelChunk& chunk : chunks) {
+		const IndexRange full = chunk.lods[0];
+
+		for (uint32_t lod = 1; lod < lodCount; lod++) {
+			float cellsPerSide = 64.0f * gridSize / (float)(1 << lod);
+
+			// The cluster of every vertex of the chunk, none for the border ones
+			std::unordered_map<uint64_t, uint32_t> cellClusters;
+			std::unordered_map<uint32_t, uint32_t> vertexClusters;
+			std::vector<Cluster> clusters;
+			for (uint32_t i = full.firstIndex; i < full.firstIndex + full.indexCount; i++) {
+				uint32_t index = indices[i];
+				if (vertexClusters.count(index) || onBorder(index)) continue;
+
+				glm::vec3 cell = glm::floor((vertices[index].pos - boundsMin) / size * cellsPerSide);
+				uint64_t key = ((uint64_t)cell.x << 42) | ((uint64_t)cell.y << 21) | (uint64_t)cell.z;
+				auto inserted = cellClusters.emplace(key, static_cast<uint32_t>(clusters.size()));
+				if (inserted.second) clusters.push_back({ { glm::vec3(0.0f), glm::vec3(0.0f), glm::vec2(0.0f) }, 0, 0 });
+
+				Cluster& cluster = clusters[inserted.first->second];
+				cluster.sum.pos += vertices[index].pos;
+				cluster.sum.norm += vertices[index].norm;
+				cluster.sum.texCoord += vertices[index].texCoord;
+				cluster.count++;
+				vertexClusters.emplace(index, inserted.first->second);
+			}
+
+			for (Cluster& cluster : clusters) {
+				Vertex average;
+				average.pos = cluster.sum.pos / (float)cluster.count;
+				average.norm = glm::length(cluster.sum.norm) > 0.0f ? glm::normalize(cluster.sum.norm) : glm::vec3(0.0f, 0.0f, 1.0f);
+				average.texCoord = cluster.sum.texCoord / (float)cluster.count;
+				cluster.vertex = static_cast<uint32_t>(vertices.size());
+				vertices.push_back(average);
+			}
+
+			auto representative = [&](uint32_t index) {
+				auto found = vertexClusters.find(index);
+				return found == vertexClusters.end() ? index : clusters[found->second].vertex;
+			};
+
+			IndexRange range = { static_cast<uint32_t>(indices.size()), 0 };
+			for (uint32_t i = full.firstIndex; i < full.firstIndex + full.indexCount; i += 3) {
+				uint32_t a = representative(indices[i]);
+				uint32_t b = representative(indices[i + 1]);
+				uint32_t c = representative(indices[i + 2]);
+				if (a == b || b == c || a == c) continue;
+
+				indices.push_back(a);
+				indices.push_back(b);
+				indices.push_back(c);
+				range.indexCount += 3;
+			}
+
+			chunk.lods[lod] = range;
+			chunk.lodCount = lod + 1;
+		}
+	}
+}
+
+void Model::init(BaseProject* bp, std::string file, int gridSize, uint32_t lodCount) {
 	BP = bp;
+	name = file;
 	loadModel(file);
+	computeBounds();
+	if (gridSize > 1) splitIntoChunks(gridSize);
+	if (lodCount > 1) buildLods(lodCount, gridSize);
 	createVertexBuffer();
 	createIndexBuffer();
 }
 
 void Model::init(BaseProject* bp, std::vector<Vertex> vertices, std::vector<uint32_t> indices) {
 	BP = bp;
-	vertices = vertices;
-	indices = indices;
+	name = "generated mesh";
+	this->vertices = vertices;
+	this->indices = indices;
+	computeBounds();
 	createVertexBuffer();
 	createIndexBuffer();
 }
 
+void Model::bind(VkCommandBuffer commandBuffer) {
+	VkBuffer vertexBuffers[] = { vertexBuffer };
+	VkDeviceSize offsets[] = { 0 };
+	vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+	vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0,
+		VK_INDEX_TYPE_UINT32);
+}
+
 void Model::cleanup() {
 	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
+	BP->freeMemory(indexBufferMemory);
 	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+	BP->freeMemory(vertexBufferMemory);
 }
 
 
@@ -1577,9 +3513,17 @@ void Texture::createTextureImage(std::string file) {
 		throw std::runtime_error("failed to load texture image!");
 	}
 
+	createTextureImage(pixels, texWidth, texHeight, file, UINT32_MAX);
+
+	stbi_image_free(pixels);
+}
+
+void Texture::createTextureImage(const unsigned char* pixels, int texWidth, int texHeight,
+	const std::string& name, uint32_t maxMipLevels) {
 	VkDeviceSize imageSize = texWidth * texHeight * 4;
 	mipLevels = static_cast<uint32_t>(std::floor(
 		std::log2(std::max(texWidth, texHeight)))) + 1;
+	mipLevels = std::min(mipLevels, maxMipLevels);
 
 	VkBuffer stagingBuffer;
 	VkDeviceMemory stagingBufferMemory;
@@ -1587,35 +3531,35 @@ void Texture::createTextureImage(std::string file) {
 	BP->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		stagingBuffer, stagingBufferMemory);
+		stagingBuffer, stagingBufferMemory,
+		MEMORY_STAGING, name);
 	void* data;
 	vkMapMemory(BP->device, stagingBufferMemory, 0, imageSize, 0, &data);
 	memcpy(data, pixels, static_cast<size_t>(imageSize));
 	vkUnmapMemory(BP->device, stagingBufferMemory);
 
-	stbi_image_free(pixels);
-
-	BP->createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
+	BP->createImage(texWidth, texHeight, mipLevels, format,
 		VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
 		VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
-		textureImageMemory);
+		textureImageMemory,
+		MEMORY_TEXTURE, name);
 
-	BP->transitionImageLayout(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
+	BP->transitionImageLayout(textureImage, format,
 		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels);
 	BP->copyBufferToImage(stagingBuffer, textureImage,
 		static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
 
-	BP->generateMipmaps(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
+	BP->generateMipmaps(textureImage, format,
 		texWidth, texHeight, mipLevels);
 
 	vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-	vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+	BP->freeMemory(stagingBufferMemory);
 }
 
 void Texture::createTextureImageView() {
 	textureImageView = BP->createImageView(textureImage,
-		VK_FORMAT_R8G8B8A8_SRGB,
+		format,
 		VK_IMAGE_ASPECT_COLOR_BIT,
 		mipLevels);
 }
@@ -1625,9 +3569,9 @@ void Texture::createTextureSampler() {
 	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
 	samplerInfo.magFilter = VK_FILTER_LINEAR;
 	samplerInfo.minFilter = VK_FILTER_LINEAR;
-	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+	samplerInfo.addressModeU = addressMode;
+	samplerInfo.addressModeV = addressMode;
+	samplerInfo.addressModeW = addressMode;
 	samplerInfo.anisotropyEnable = VK_TRUE;
 	samplerInfo.maxAnisotropy = 16;
 	samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
@@ -1656,11 +3600,19 @@ void Texture::init(BaseProject* bp, std::string file) {
 	createTextureSampler();
 }
 
+void Texture::init(BaseProject* bp, const unsigned char* pixels, int width, int height,
+	const std::string& name, uint32_t maxMipLevels) {
+	BP = bp;
+	createTextureImage(pixels, width, height, name, maxMipLevels);
+	createTextureImageView();
+	createTextureSampler();
+}
+
 void Texture::cleanup() {
 	vkDestroySampler(BP->device, textureSampler, nullptr);
 	vkDestroyImageView(BP->device, textureImageView, nullptr);
 	vkDestroyImage(BP->device, textureImage, nullptr);
-	vkFreeMemory(BP->device, textureImageMemory, nullptr);
+	BP->freeMemory(textureImageMemory);
 }
 
 
@@ -1668,35 +3620,117 @@ void Texture::cleanup() {
 
 
 void Pipeline::init(BaseProject* bp, const std::string& VertShader, const std::string& FragShader,
-	std::vector<DescriptorSetLayout*> D) {
+	std::vector<DescriptorSetLayout*> D, uint32_t pushConstantSize,
+	VkShaderStageFlags pushConstantStages, bool instanced, VkRenderPass renderPass) {
 	BP = bp;
+	this->pushConstantSize = pushConstantSize;
+	this->pushConstantStages = pushConstantStages;
+	this->instanced = instanced;
+	this->renderPass = renderPass != VK_NULL_HANDLE ? renderPass : BP->renderPass;
+
+	if (pushConstantSize > BP->physicalDeviceProperties.limits.maxPushConstantsSize) {
+		throw std::runtime_error("push constant block is too large!");
+	}
 
 	auto vertShaderCode = readFile(VertShader);
-	auto fragShaderCode = readFile(FragShader);
+	std::vector<char> fragShaderCode;
+	if (!FragShader.empty()) {
+		fragShaderCode = readFile(FragShader);
+	}
 
-	std::cout << "Vertex shader len: " <<
-		vertShaderCode.size() << "\n";
-	std::cout << "Fragment shader len: " <<
-		fragShaderCode.size() << "\n";
+	// A single write, pipelines may be created by several threads at once
+	std::ostringstream lengths;
+	lengths << "Vertex shader len: " << vertShaderCode.size() << "\n"
+		<< "Fragment shader len: " << fragShaderCode.size() << "\n";
+	std::cout << lengths.str();
 
-	VkShaderModule vertShaderModule =
-		createShaderModule(vertShaderCode);
-	VkShaderModule fragShaderModule =
-		createShaderModule(fragShaderCode);
+	vertShaderModule = createShaderModule(vertShaderCode);
+	fragShaderModule = FragShader.empty() ? VK_NULL_HANDLE : createShaderModule(fragShaderCode);
 
-	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-	vertShaderStageInfo.sType =
-		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-	vertShaderStageInfo.module = vertShaderModule;
-	vertShaderStageInfo.pName = "main";
+	// Lesson 21
+	std::vector<VkDescriptorSetLayout> DSL(D.size());
+	for (int i = 0; i < D.size(); i++) {
+		DSL[i] = D[i]->descriptorSetLayout;
+	}
 
-	VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-	fragShaderStageInfo.sType =
-		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-	fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-	fragShaderStageInfo.module = fragShaderModule;
-	fragShaderStageInfo.pName = "main";
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = DSL.size();
+	pipelineLayoutInfo.pSetLayouts = DSL.data();
+
+	// Per-draw data (e.g. the model matrix) is sent with vkCmdPushConstants
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.stageFlags = pushConstantStages;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = pushConstantSize;
+
+	pipelineLayoutInfo.pushConstantRangeCount = pushConstantSize > 0 ? 1 : 0;
+	pipelineLayoutInfo.pPushConstantRanges = pushConstantSize > 0 ? &pushConstantRange : nullptr;
+
+	VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+		&pipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create pipeline layout!");
+	}
+
+	graphicsPipeline = defaultVariant ? variant(ShaderVariant()) : VK_NULL_HANDLE;
+}
+
+ShaderVariant& ShaderVariant::set(uint32_t constantId, uint32_t value) {
+	if (constantId >= MAX_SPECIALIZATION_CONSTANTS) {
+		throw std::runtime_error("too many specialization constants!");
+	}
+	values[constantId] = value;
+	count = std::max(count, constantId + 1);
+	return *this;
+}
+
+ShaderVariant& ShaderVariant::set(uint32_t constantId, float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return set(constantId, bits);
+}
+
+bool ShaderVariant::operator<(const ShaderVariant& other) const {
+	if (count != other.count) return count < other.count;
+	return std::lexicographical_compare(values, values + count, other.values, other.values + count);
+}
+
+VkPipeline Pipeline::variant(const ShaderVariant& constants) {
+	auto it = variants.find(constants);
+	if (it != variants.end()) return it->second;
+
+	// Every constant is 32 bits, stored in order
+	std::array<VkSpecializationMapEntry, MAX_SPECIALIZATION_CONSTANTS> mapEntries{};
+	for (uint32_t i = 0; i < constants.count; i++) {
+		mapEntries[i].constantID = i;
+		mapEntries[i].offset = i * sizeof(uint32_t);
+		mapEntries[i].size = sizeof(uint32_t);
+	}
+
+	VkSpecializationInfo specializationInfo{};
+	specializationInfo.mapEntryCount = constants.count;
+	specializationInfo.pMapEntries = mapEntries.data();
+	specializationInfo.dataSize = constants.count * sizeof(uint32_t);
+	specializationInfo.pData = constants.values;
+
+	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+	vertShaderStageInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+	vertShaderStageInfo.module = vertShaderModule;
+	vertShaderStageInfo.pName = "main";
+	vertShaderStageInfo.pSpecializationInfo = constants.count > 0 ? &specializationInfo : nullptr;
+
+	VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
+	fragShaderStageInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	fragShaderStageInfo.module = fragShaderModule;
+	fragShaderStageInfo.pName = "main";
+	fragShaderStageInfo.pSpecializationInfo = constants.count > 0 ? &specializationInfo : nullptr;
 
 	VkPipelineShaderStageCreateInfo shaderStages[] =
 	{ vertShaderStageInfo, fragShaderStageInfo };
@@ -1705,13 +3739,14 @@ void Pipeline::init(BaseProject* bp, const std::string& VertShader, const std::s
 	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
 	vertexInputInfo.sType =
 		VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	auto bindingDescription = Vertex::getBindingDescription();
+	auto bindingDescriptions = Vertex::getBindingDescriptions();
 	auto attributeDescriptions = Vertex::getAttributeDescriptions();
 
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.vertexAttributeDescriptionCount =
-		static_cast<uint32_t>(attributeDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+	// Non instanced pipelines only use the per-vertex binding and its 3 attributes
+	vertexInputInfo.vertexBindingDescriptionCount = instanced ? 2 : 1;
+	vertexInputInfo.vertexAttributeDescriptionCount = instanced ?
+		static_cast<uint32_t>(attributeDescriptions.size()) : 3;
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
 	vertexInputInfo.pVertexAttributeDescriptions =
 		attributeDescriptions.data();
 
@@ -1722,25 +3757,22 @@ void Pipeline::init(BaseProject* bp, const std::string& VertShader, const std::s
 	inputAssembly.primitiveRestartEnable = VK_FALSE;
 
 	// Lesson 19
-	VkViewport viewport{};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = (float)BP->swapChainExtent.width;
-	viewport.height = (float)BP->swapChainExtent.height;
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
-
-	VkRect2D scissor{};
-	scissor.offset = { 0, 0 };
-	scissor.extent = BP->swapChainExtent;
-
+	// Set while recording, see BaseProject::setViewport
 	VkPipelineViewportStateCreateInfo viewportState{};
 	viewportState.sType =
 		VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportState.viewportCount = 1;
-	viewportState.pViewports = &viewport;
 	viewportState.scissorCount = 1;
-	viewportState.pScissors = &scissor;
+
+	std::array<VkDynamicState, 2> dynamicStates = {
+		VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR
+	};
+
+	VkPipelineDynamicStateCreateInfo dynamicState{};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+	dynamicState.pDynamicStates = dynamicStates.data();
 
 	VkPipelineRasterizationStateCreateInfo rasterizer{};
 	rasterizer.sType =
@@ -1766,23 +3798,24 @@ void Pipeline::init(BaseProject* bp, const std::string& VertShader, const std::s
 	multisampling.alphaToCoverageEnable = VK_FALSE; // Optional
 	multisampling.alphaToOneEnable = VK_FALSE; // Optional
 
+	// Depth only pipelines leave the color untouched
 	VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-	colorBlendAttachment.colorWriteMask =
+	colorBlendAttachment.colorWriteMask = fragShaderModule == VK_NULL_HANDLE ? 0 :
 		VK_COLOR_COMPONENT_R_BIT |
 		VK_COLOR_COMPONENT_G_BIT |
 		VK_COLOR_COMPONENT_B_BIT |
 		VK_COLOR_COMPONENT_A_BIT;
-	colorBlendAttachment.blendEnable = VK_FALSE;
+	colorBlendAttachment.blendEnable = additiveBlend ? VK_TRUE : VK_FALSE;
 	colorBlendAttachment.srcColorBlendFactor =
 		VK_BLEND_FACTOR_ONE; // Optional
 	colorBlendAttachment.dstColorBlendFactor =
-		VK_BLEND_FACTOR_ZERO; // Optional
+		additiveBlend ? VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ZERO;
 	colorBlendAttachment.colorBlendOp =
 		VK_BLEND_OP_ADD; // Optional
 	colorBlendAttachment.srcAlphaBlendFactor =
 		VK_BLEND_FACTOR_ONE; // Optional
 	colorBlendAttachment.dstAlphaBlendFactor =
-		VK_BLEND_FACTOR_ZERO; // Optional
+		additiveBlend ? VK_BLEND_FACTOR_ONE : VK_BLEND_FACTOR_ZERO;
 	colorBlendAttachment.alphaBlendOp =
 		VK_BLEND_OP_ADD; // Optional
 
@@ -1798,34 +3831,13 @@ void Pipeline::init(BaseProject* bp, const std::string& VertShader, const std::s
 	colorBlending.blendConstants[2] = 0.0f; // Optional
 	colorBlending.blendConstants[3] = 0.0f; // Optional
 
-	// Lesson 21
-	std::vector<VkDescriptorSetLayout> DSL(D.size());
-	for (int i = 0; i < D.size(); i++) {
-		DSL[i] = D[i]->descriptorSetLayout;
-	}
-
-	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-	pipelineLayoutInfo.sType =
-		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	pipelineLayoutInfo.setLayoutCount = DSL.size();
-	pipelineLayoutInfo.pSetLayouts = DSL.data();
-	pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-	pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
-
-	VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
-		&pipelineLayout);
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to create pipeline layout!");
-	}
-
 	// Lesson 19
 	VkPipelineDepthStencilStateCreateInfo depthStencil{};
 	depthStencil.sType =
 		VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
 	depthStencil.depthTestEnable = VK_TRUE;
-	depthStencil.depthWriteEnable = VK_TRUE;
-	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+	depthStencil.depthWriteEnable = depthWrite ? VK_TRUE : VK_FALSE;
+	depthStencil.depthCompareOp = depthCompareOp;
 	depthStencil.depthBoundsTestEnable = VK_FALSE;
 	depthStencil.minDepthBounds = 0.0f; // Optional
 	depthStencil.maxDepthBounds = 1.0f; // Optional
@@ -1836,7 +3848,7 @@ void Pipeline::init(BaseProject* bp, const std::string& VertShader, const std::s
 	VkGraphicsPipelineCreateInfo pipelineInfo{};
 	pipelineInfo.sType =
 		VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	pipelineInfo.stageCount = 2;
+	pipelineInfo.stageCount = fragShaderModule == VK_NULL_HANDLE ? 1 : 2;
 	pipelineInfo.pStages = shaderStages;
 	pipelineInfo.pVertexInputState = &vertexInputInfo;
 	pipelineInfo.pInputAssemblyState = &inputAssembly;
@@ -1845,22 +3857,23 @@ void Pipeline::init(BaseProject* bp, const std::string& VertShader, const std::s
 	pipelineInfo.pMultisampleState = &multisampling;
 	pipelineInfo.pDepthStencilState = &depthStencil;
 	pipelineInfo.pColorBlendState = &colorBlending;
-	pipelineInfo.pDynamicState = nullptr; // Optional
+	pipelineInfo.pDynamicState = &dynamicState;
 	pipelineInfo.layout = pipelineLayout;
-	pipelineInfo.renderPass = BP->renderPass;
+	pipelineInfo.renderPass = renderPass;
 	pipelineInfo.subpass = 0;
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 	pipelineInfo.basePipelineIndex = -1; // Optional
 
-	result = vkCreateGraphicsPipelines(BP->device, VK_NULL_HANDLE, 1,
-		&pipelineInfo, nullptr, &graphicsPipeline);
+	VkPipeline pipeline;
+	VkResult result = vkCreateGraphicsPipelines(BP->device, BP->pipelineCache.cache, 1,
+		&pipelineInfo, nullptr, &pipeline);
 	if (result != VK_SUCCESS) {
 		PrintVkError(result);
 		throw std::runtime_error("failed to create graphics pipeline!");
 	}
 
-	vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
-	vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
+	variants[constants] = pipeline;
+	return pipeline;
 }
 
 // Lesson 18
@@ -1901,7 +3914,12 @@ VkShaderModule Pipeline::createShaderModule(const std::vector<char>& code) {
 }
 
 void Pipeline::cleanup() {
-	vkDestroyPipeline(BP->device, graphicsPipeline, nullptr);
+	for (auto& it : variants) {
+		vkDestroyPipeline(BP->device, it.second, nullptr);
+	}
+	variants.clear();
+	vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
+	vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
 	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
 }
 
@@ -1938,69 +3956,43 @@ void DescriptorSetLayout::cleanup() {
 void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL, std::vector<DescriptorSetElement> E) {
 	BP = bp;
 
-	// Create uniform buffer
-	uniformBuffers.resize(E.size());
-	uniformBuffersMemory.resize(E.size());
-	toFree.resize(E.size());
-
+	// Textures never change, so only sets with uniform blocks or storage buffers need a copy per frame
+	size_t setCount = 1;
 	for (int j = 0; j < E.size(); j++) {
-		uniformBuffers[j].resize(BP->swapChainImages.size());
-		uniformBuffersMemory[j].resize(BP->swapChainImages.size());
-		if (E[j].type == UNIFORM) {
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				VkDeviceSize bufferSize = E[j].size;
-				BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-					VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-					VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-					uniformBuffers[j][i], uniformBuffersMemory[j][i]);
-			}
-			toFree[j] = true;
-		}
-		else {
-			toFree[j] = false;
-		}
+		if (E[j].type == UNIFORM || E[j].type == STORAGE) setCount = BP->framesInFlight;
 	}
 
 	// Create Descriptor set
-	std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
+	std::vector<VkDescriptorSetLayout> layouts(setCount,
 		DSL->descriptorSetLayout);
-	VkDescriptorSetAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	allocInfo.descriptorPool = BP->descriptorPool;
-	allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->swapChainImages.size());
-	allocInfo.pSetLayouts = layouts.data();
 
-	descriptorSets.resize(BP->swapChainImages.size());
-
-	VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo,
+	descriptorSets.resize(setCount);
+	BP->allocateDescriptorSets(static_cast<uint32_t>(setCount), layouts.data(),
 		descriptorSets.data());
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to allocate descriptor sets!");
-	}
 
-	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+	for (size_t i = 0; i < setCount; i++) {
 		std::vector<VkWriteDescriptorSet> descriptorWrites(E.size());
+		std::vector<VkDescriptorBufferInfo> bufferInfos(E.size());
+		std::vector<VkDescriptorImageInfo> imageInfos(E.size());
 		for (int j = 0; j < E.size(); j++) {
 			if (E[j].type == UNIFORM) {
-				VkDescriptorBufferInfo bufferInfo{};
-				bufferInfo.buffer = uniformBuffers[j][i];
-				bufferInfo.offset = 0;
-				bufferInfo.range = E[j].size;
+				// The actual block is selected with a dynamic offset at bind time
+				bufferInfos[j].buffer = BP->uniformRing.buffers[i];
+				bufferInfos[j].offset = 0;
+				bufferInfos[j].range = E[j].size;
 
 				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 				descriptorWrites[j].dstSet = descriptorSets[i];
 				descriptorWrites[j].dstBinding = E[j].binding;
 				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 				descriptorWrites[j].descriptorCount = 1;
-				descriptorWrites[j].pBufferInfo = &bufferInfo;
+				descriptorWrites[j].pBufferInfo = &bufferInfos[j];
 			}
 			else if (E[j].type == TEXTURE) {
-				VkDescriptorImageInfo* imageInfo = new VkDescriptorImageInfo{};
-				imageInfo->imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfo->imageView = E[j].tex->textureImageView;
-				imageInfo->sampler = E[j].tex->textureSampler;
+				imageInfos[j].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+				imageInfos[j].imageView = E[j].tex->textureImageView;
+				imageInfos[j].sampler = E[j].tex->textureSampler;
 
 				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 				descriptorWrites[j].dstSet = descriptorSets[i];
@@ -2009,7 +4001,20 @@ void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL, std::vector<
 				descriptorWrites[j].descriptorType =
 					VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
 				descriptorWrites[j].descriptorCount = 1;
-				descriptorWrites[j].pImageInfo = imageInfo;
+				descriptorWrites[j].pImageInfo = &imageInfos[j];
+			}
+			else if (E[j].type == STORAGE) {
+				bufferInfos[j].buffer = (*E[j].buffers)[i];
+				bufferInfos[j].offset = 0;
+				bufferInfos[j].range = VK_WHOLE_SIZE;
+
+				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+				descriptorWrites[j].dstSet = descriptorSets[i];
+				descriptorWrites[j].dstBinding = E[j].binding;
+				descriptorWrites[j].dstArrayElement = 0;
+				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+				descriptorWrites[j].descriptorCount = 1;
+				descriptorWrites[j].pBufferInfo = &bufferInfos[j];
 			}
 		}
 		vkUpdateDescriptorSets(BP->device,
@@ -2020,12 +4025,2426 @@ void DescriptorSet::init(BaseProject* bp, DescriptorSetLayout* DSL, std::vector<
 }
 
 void DescriptorSet::cleanup() {
-	for (int j = 0; j < uniformBuffers.size(); j++) {
-		if (toFree[j]) {
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-				vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-				vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
-			}
+}
+
+void UniformBufferRing::init(BaseProject* bp, VkDeviceSize capacity) {
+	BP = bp;
+	size = capacity;
+	alignment = BP->physicalDeviceProperties.limits.minUniformBufferOffsetAlignment;
+	used = 0;
+
+	buffers.resize(BP->framesInFlight);
+	buffersMemory.resize(BP->framesInFlight);
+	mappedMemory.resize(BP->framesInFlight);
+
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		BP->createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			buffers[i], buffersMemory[i],
+			MEMORY_UNIFORM, "uniform ring");
+
+		// Mapped once, and left mapped until cleanup
+		VkResult result = vkMapMemory(BP->device, buffersMemory[i], 0, size, 0,
+			&mappedMemory[i]);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map uniform buffer ring!");
+		}
+	}
+}
+
+uint32_t UniformBufferRing::reserve(VkDeviceSize blockSize) {
+	// minUniformBufferOffsetAlignment is always a power of two
+	VkDeviceSize offset = (used + alignment - 1) & ~(alignment - 1);
+	if (offset + blockSize > size) {
+		throw std::runtime_error("uniform buffer ring is full!");
+	}
+	used = offset + blockSize;
+	return static_cast<uint32_t>(offset);
+}
+
+void* UniformBufferRing::data(size_t frame, uint32_t offset) {
+	return static_cast<char*>(mappedMemory[frame]) + offset;
+}
+
+void UniformBufferRing::cleanup() {
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		vkUnmapMemory(BP->device, buffersMemory[i]);
+		vkDestroyBuffer(BP->device, buffers[i], nullptr);
+		BP->freeMemory(buffersMemory[i]);
+	}
+}
+
+void InstanceBuffer::init(BaseProject* bp, uint32_t capacity) {
+	BP = bp;
+	this->capacity = capacity;
+	used = 0;
+
+	buffers.resize(BP->framesInFlight);
+	buffersMemory.resize(BP->framesInFlight);
+	mappedMemory.resize(BP->framesInFlight);
+
+	VkDeviceSize size = sizeof(InstanceData) * capacity;
+
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		BP->createBuffer(size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			buffers[i], buffersMemory[i],
+			MEMORY_MESH, "instance buffer");
+
+		void* data;
+		VkResult result = vkMapMemory(BP->device, buffersMemory[i], 0, size, 0, &data);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map instance buffer!");
+		}
+		mappedMemory[i] = static_cast<InstanceData*>(data);
+	}
+}
+
+uint32_t InstanceBuffer::reserve(uint32_t count) {
+	if (used + count > capacity) {
+		throw std::runtime_error("instance buffer is full!");
+	}
+	uint32_t firstInstance = used;
+	used += count;
+	return firstInstance;
+}
+
+void InstanceBuffer::bind(VkCommandBuffer commandBuffer, size_t frame) {
+	VkDeviceSize offsets[] = { 0 };
+	vkCmdBindVertexBuffers(commandBuffer, 1, 1, &buffers[frame], offsets);
+}
+
+void InstanceBuffer::cleanup() {
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		vkUnmapMemory(BP->device, buffersMemory[i]);
+		vkDestroyBuffer(BP->device, buffers[i], nullptr);
+		BP->freeMemory(buffersMemory[i]);
+	}
+}
+
+void TextureAtlas::init(BaseProject* bp, const std::vector<std::string>& files, int padding) {
+	BP = bp;
+
+	struct Image {
+		stbi_uc* pixels;
+		int width, height;
+		int x, y;
+	};
+	std::vector<Image> images(files.size());
+
+	int atlasWidth = 0;
+	for (size_t i = 0; i < files.size(); i++) {
+		int channels;
+		images[i].pixels = stbi_load(files[i].c_str(), &images[i].width, &images[i].height,
+			&channels, STBI_rgb_alpha);
+		if (!images[i].pixels) {
+			throw std::runtime_error("failed to load texture image!");
+		}
+		atlasWidth = std::max(atlasWidth, images[i].width + 2 * padding);
+	}
+
+	// Shelf packing: the images, from the tallest, fill rows as wide as the widest image
+	std::vector<size_t> order(files.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = i;
+	std::sort(order.begin(), order.end(), [&images](size_t a, size_t b) {
+		return images[a].height > images[b].height;
+	});
+
+	int shelfX = 0, shelfY = 0, shelfHeight = 0;
+	for (size_t i : order) {
+		int width = images[i].width + 2 * padding;
+		int height = images[i].height + 2 * padding;
+		if (shelfX + width > atlasWidth) {
+			shelfY += shelfHeight;
+			shelfX = 0;
+			shelfHeight = 0;
+		}
+		images[i].x = shelfX + padding;
+		images[i].y = shelfY + padding;
+		shelfX += width;
+		shelfHeight = std::max(shelfHeight, height);
+	}
+	int atlasHeight = shelfY + shelfHeight;
+
+	std::vector<stbi_uc> pixels(static_cast<size_t>(atlasWidth) * atlasHeight * 4, 0);
+	regions.resize(files.size());
+
+	for (size_t i = 0; i < images.size(); i++) {
+		Image& image = images[i];
+		for (int row = 0; row < image.height; row++) {
+			memcpy(&pixels[(static_cast<size_t>(image.y + row) * atlasWidth + image.x) * 4],
+				&image.pixels[static_cast<size_t>(row) * image.width * 4], image.width * 4);
+		}
+		stbi_image_free(image.pixels);
+
+		regions[i] = glm::vec4(
+			(float)image.x / atlasWidth, (float)image.y / atlasHeight,
+			(float)(image.x + image.width) / atlasWidth, (float)(image.y + image.height) / atlasHeight);
+	}
+
+	uint32_t maxMipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(padding, 1)))) + 1;
+	texture.init(bp, pixels.data(), atlasWidth, atlasHeight, "texture atlas", maxMipLevels);
+
+	std::cout << "Texture atlas: " << files.size() << " images in " << atlasWidth << "x" << atlasHeight << "\n";
+}
+
+void TextureAtlas::cleanup() {
+	texture.cleanup();
+}
+
+void SpriteBatch::init(BaseProject* bp, uint32_t capacity) {
+	BP = bp;
+	this->capacity = capacity;
+	count = 0;
+
+	vertexBuffers.resize(BP->framesInFlight);
+	vertexBuffersMemory.resize(BP->framesInFlight);
+	mappedVertices.resize(BP->framesInFlight);
+
+	VkDeviceSize vertexBufferSize = sizeof(Vertex) * 4 * capacity;
+
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		BP->createBuffer(vertexBufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			vertexBuffers[i], vertexBuffersMemory[i],
+			MEMORY_MESH, "sprite batch");
+
+		void* data;
+		VkResult result = vkMapMemory(BP->device, vertexBuffersMemory[i], 0, vertexBufferSize, 0, &data);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map sprite batch!");
+		}
+		mappedVertices[i] = static_cast<Vertex*>(data);
+	}
+
+	// The indices of the quads never change: two triangles every four vertices
+	VkDeviceSize indexBufferSize = sizeof(uint32_t) * 6 * capacity;
+
+	BP->createBuffer(indexBufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		indexBuffer, indexBufferMemory,
+		MEMORY_MESH, "sprite batch");
+
+	void* data;
+	vkMapMemory(BP->device, indexBufferMemory, 0, indexBufferSize, 0, &data);
+	uint32_t* indices = static_cast<uint32_t*>(data);
+	for (uint32_t quad = 0; quad < capacity; quad++) {
+		const uint32_t quadIndices[] = { 0, 1, 2, 2, 3, 0 };
+		for (int j = 0; j < 6; j++) {
+			indices[quad * 6 + j] = quad * 4 + quadIndices[j];
+		}
+	}
+	vkUnmapMemory(BP->device, indexBufferMemory);
+}
+
+void SpriteBatch::cleanup() {
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		vkUnmapMemory(BP->device, vertexBuffersMemory[i]);
+		vkDestroyBuffer(BP->device, vertexBuffers[i], nullptr);
+		BP->freeMemory(vertexBuffersMemory[i]);
+	}
+	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
+	BP->freeMemory(indexBufferMemory);
+}
+
+void SpriteBatch::begin() {
+	count = 0;
+}
+
+void SpriteBatch::add(size_t frame, const glm::vec4& region, glm::vec2 pos, glm::vec2 size,
+	float angle, glm::vec2 pivot, float depth) {
+	if (count == capacity) {
+		throw std::runtime_error("sprite batch is full!");
+	}
+
+	const glm::vec2 corners[] = { {0.0f, 0.0f}, {1.0f, 0.0f}, {1.0f, 1.0f}, {0.0f, 1.0f} };
+	float c = std::cos(angle);
+	float s = std::sin(angle);
+
+	Vertex* vertices = mappedVertices[frame] + count * 4;
+	for (int i = 0; i < 4; i++) {
+		glm::vec2 local = (corners[i] - pivot) * size;
+		glm::vec2 rotated(c * local.x - s * local.y, s * local.x + c * local.y);
+
+		vertices[i].pos = glm::vec3(pos + rotated, depth);
+		vertices[i].norm = glm::vec3(0.0f, 0.0f, 1.0f);
+		vertices[i].texCoord = glm::vec2(
+			region.x + corners[i].x * (region.z - region.x),
+			region.y + corners[i].y * (region.w - region.y));
+	}
+
+	count++;
+}
+
+void GpuDrawList::init(BaseProject* bp, Model* model, uint32_t capacity, const std::string& cullShader) {
+	BP = bp;
+	this->model = model;
+	this->capacity = capacity;
+	objectCount = 0;
+	lodDistance = 1.0f;
+
+	VkDeviceSize objectBufferSize = sizeof(GpuObject) * capacity;
+	BP->createBuffer(objectBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+		VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		objectBuffer, objectBufferMemory,
+		MEMORY_MESH, model->name + " objects");
+
+	void* data;
+	VkResult result = vkMapMemory(BP->device, objectBufferMemory, 0, objectBufferSize, 0, &data);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to map object buffer!");
+	}
+	objects = static_cast<GpuObject*>(data);
+
+	drawBuffers.resize(BP->framesInFlight);
+	drawBuffersMemory.resize(BP->framesInFlight);
+	countBuffers.resize(BP->framesInFlight);
+	countBuffersMemory.resize(BP->framesInFlight);
+
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		BP->createBuffer(sizeof(VkDrawIndexedIndirectCommand) * capacity,
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			drawBuffers[i], drawBuffersMemory[i],
+			MEMORY_MESH, model->name + " indirect draws");
+
+		BP->createBuffer(sizeof(uint32_t),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+			VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			countBuffers[i], countBuffersMemory[i],
+			MEMORY_MESH, model->name + " draw count");
+	}
+
+	centers.resize(capacity);
+	depths.resize(capacity);
+	order.resize(capacity);
+	orderBuffers.resize(BP->framesInFlight);
+	orderBuffersMemory.resize(BP->framesInFlight);
+	orderData.resize(BP->framesInFlight);
+
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		BP->createBuffer(sizeof(uint32_t) * capacity, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			orderBuffers[i], orderBuffersMemory[i],
+			MEMORY_MESH, model->name + " draw order");
+
+		result = vkMapMemory(BP->device, orderBuffersMemory[i], 0, sizeof(uint32_t) * capacity, 0, &data);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map draw order!");
+		}
+		orderData[i] = static_cast<uint32_t*>(data);
+	}
+
+	statsBuffers.resize(BP->framesInFlight);
+	statsBuffersMemory.resize(BP->framesInFlight);
+	stats.resize(BP->framesInFlight);
+
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		BP->createBuffer(sizeof(CullStats),
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			statsBuffers[i], statsBuffersMemory[i],
+			MEMORY_MESH, model->name + " cull stats");
+
+		result = vkMapMemory(BP->device, statsBuffersMemory[i], 0, sizeof(CullStats), 0, &data);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map cull stats!");
+		}
+		stats[i] = static_cast<CullStats*>(data);
+		*stats[i] = CullStats{};
+	}
+
+	cullUniforms = BP->uniformRing.reserve(sizeof(CullUniforms));
+	hasPreviousView = false;
+
+	layout.init(bp, {
+		{0, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_COMPUTE_BIT},
+		{1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+		{2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+		{3, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_COMPUTE_BIT},
+		{4, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT},
+		{5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT},
+		{6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT}
+		});
+
+	descriptorSets.resize(BP->framesInFlight);
+	std::vector<VkDescriptorSetLayout> layouts(BP->framesInFlight, layout.descriptorSetLayout);
+	BP->allocateDescriptorSets(BP->framesInFlight, layouts.data(), descriptorSets.data());
+
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		std::array<VkDescriptorBufferInfo, 6> bufferInfos{};
+		bufferInfos[0] = { objectBuffer, 0, VK_WHOLE_SIZE };
+		bufferInfos[1] = { drawBuffers[i], 0, VK_WHOLE_SIZE };
+		bufferInfos[2] = { countBuffers[i], 0, VK_WHOLE_SIZE };
+		bufferInfos[3] = { BP->uniformRing.buffers[i], 0, sizeof(CullUniforms) };
+		bufferInfos[4] = { statsBuffers[i], 0, VK_WHOLE_SIZE };
+		bufferInfos[5] = { orderBuffers[i], 0, VK_WHOLE_SIZE };
+		const uint32_t bufferBindings[] = { 0, 1, 2, 3, 5, 6 };
+
+		VkDescriptorImageInfo imageInfo{};
+		imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+		imageInfo.imageView = BP->depthPyramid.view;
+		imageInfo.sampler = BP->depthPyramid.sampler;
+
+		std::array<VkWriteDescriptorSet, 7> descriptorWrites{};
+		for (uint32_t j = 0; j < 7; j++) {
+			descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[j].dstSet = descriptorSets[i];
+			descriptorWrites[j].dstArrayElement = 0;
+			descriptorWrites[j].descriptorCount = 1;
+		}
+		for (uint32_t j = 0; j < 6; j++) {
+			descriptorWrites[j].dstBinding = bufferBindings[j];
+			descriptorWrites[j].descriptorType = bufferBindings[j] == 3 ?
+				VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			descriptorWrites[j].pBufferInfo = &bufferInfos[j];
+		}
+		descriptorWrites[6].dstBinding = 4;
+		descriptorWrites[6].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		descriptorWrites[6].pImageInfo = &imageInfo;
+
+		vkUpdateDescriptorSets(BP->device, static_cast<uint32_t>(descriptorWrites.size()),
+			descriptorWrites.data(), 0, nullptr);
+	}
+
+	// Compute pipeline of the culling pass
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &layout.descriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 0;
+
+	result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+		&cullPipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create pipeline layout!");
+	}
+
+	auto shaderCode = Pipeline::readFile(cullShader);
+
+	VkShaderModuleCreateInfo moduleInfo{};
+	moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleInfo.codeSize = shaderCode.size();
+	moduleInfo.pCode = reinterpret_cast<const uint32_t*>(shaderCode.data());
+
+	VkShaderModule shaderModule;
+	result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr, &shaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create shader module!");
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = shaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = cullPipelineLayout;
+
+	result = vkCreateComputePipelines(BP->device, BP->pipelineCache.cache, 1,
+		&pipelineInfo, nullptr, &cullPipeline);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create compute pipeline!");
+	}
+
+	vkDestroyShaderModule(BP->device, shaderModule, nullptr);
+}
+
+uint32_t GpuDrawList::add(const glm::mat4& transform, const ModelChunk& chunk) {
+	if (objectCount == capacity) {
+		throw std::runtime_error("draw list is full!");
+	}
+
+	GpuObject& object = objects[objectCount];
+	object.model = transform;
+	object.boundsMin = glm::vec4(chunk.boundsMin, 1.0f);
+	object.boundsMax = glm::vec4(chunk.boundsMax, 1.0f);
+	for (uint32_t lod = 0; lod < MAX_MODEL_LODS; lod++) {
+		const IndexRange& range = chunk.lods[std::min(lod, chunk.lodCount - 1)];
+		object.lodFirstIndex[lod] = range.firstIndex;
+		object.lodIndexCount[lod] = range.indexCount;
+	}
+	object.lodCount = chunk.lodCount;
+
+	centers[objectCount] = glm::vec3(transform * glm::vec4(0.5f * (chunk.boundsMin + chunk.boundsMax), 1.0f));
+	order[objectCount] = objectCount;
+
+	return objectCount++;
+}
+
+void GpuDrawList::setView(size_t frame, const Frustum& frustum, const glm::mat4& viewProj,
+	const glm::vec3& cameraPos) {
+	// The previous submission of the slot has been waited for: its counters are complete
+	lastStats = *stats[frame];
+
+	CullUniforms uniforms{};
+	for (int p = 0; p < 6; p++) {
+		uniforms.planes[p] = frustum.planes[p];
+	}
+	uniforms.cameraPos = glm::vec4(cameraPos, 1.0f);
+	uniforms.lodDistance = lodDistance;
+	uniforms.objectCount = objectCount;
+
+	// The depth pyramid read this frame was built with the view of the previous one
+	uniforms.prevViewProj = prevViewProj;
+	uniforms.cameraMotion = hasPreviousView ? glm::length(cameraPos - prevCameraPos) : 0.0f;
+	uniforms.pyramidSize = glm::vec2(BP->depthPyramid.width, BP->depthPyramid.height);
+	uniforms.pyramidLevels = BP->depthPyramid.levels;
+	uniforms.pyramidUvScale = BP->depthPyramid.uvScale;
+	uniforms.occlusionCulling = hasPreviousView ? 1 : 0;
+
+	BP->uniformRing.write(frame, cullUniforms, uniforms);
+
+	// Front to back: the view depth grows with the distance from the near plane.
+	// order still holds the order of the last frame, and the camera moves little
+	// between frames, so an insertion sort over it only moves the few objects
+	// that changed places: linear in the number of objects, while a full sort
+	// pays O(n log n) every frame however close to sorted the input is.
+	// A sudden turn of the camera can reverse the order: past a budget of moves
+	// the rest is left to std::sort, so the worst case is not quadratic.
+	const glm::vec4& nearPlane = frustum.planes[4];
+	for (uint32_t i = 0; i < objectCount; i++) {
+		depths[i] = glm::dot(glm::vec3(nearPlane), centers[i]) + nearPlane.w;
+	}
+	size_t moveBudget = size_t(objectCount) * 8;
+	for (uint32_t i = 1; i < objectCount; i++) {
+		uint32_t object = order[i];
+		float depth = depths[object];
+		uint32_t j = i;
+		for (; j > 0 && depths[order[j - 1]] > depth; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = object;
+
+		moveBudget -= std::min<size_t>(moveBudget, i - j);
+		if (moveBudget == 0) {
+			std::sort(order.begin(), order.begin() + objectCount, [this](uint32_t a, uint32_t b) {
+				return depths[a] < depths[b];
+			});
+			break;
 		}
 	}
-}
\ No newline at end of file
+	memcpy(orderData[frame], order.data(), sizeof(uint32_t) * objectCount);
+
+	prevViewProj = viewProj;
+	prevCameraPos = cameraPos;
+	hasPreviousView = true;
+}
+
+void GpuDrawList::cull(VkCommandBuffer commandBuffer, size_t frame) {
+	vkCmdFillBuffer(commandBuffer, countBuffers[frame], 0, sizeof(uint32_t), 0);
+	vkCmdFillBuffer(commandBuffer, statsBuffers[frame], 0, sizeof(CullStats), 0);
+
+	// The depth pyramid is synchronized by the frame graph, the cleared counters here
+	VkMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+		cullPipelineLayout, 0, 1, &descriptorSets[frame], 1, &cullUniforms);
+
+	// 64 objects per work group, as in the shader
+	vkCmdDispatch(commandBuffer, (objectCount + 63) / 64, 1, 1);
+
+	// The draws are read by a later pass of the frame graph, the statistics by the CPU
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+		0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+void GpuDrawList::bind(VkCommandBuffer commandBuffer, Pipeline& P, uint32_t set, size_t frame) {
+	vkCmdBindDescriptorSets(commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS,
+		P.pipelineLayout, set, 1, &descriptorSets[frame],
+		0, nullptr);
+}
+
+void GpuDrawList::cleanup() {
+	vkDestroyPipeline(BP->device, cullPipeline, nullptr);
+	vkDestroyPipelineLayout(BP->device, cullPipelineLayout, nullptr);
+	layout.cleanup();
+
+	vkUnmapMemory(BP->device, objectBufferMemory);
+	vkDestroyBuffer(BP->device, objectBuffer, nullptr);
+	BP->freeMemory(objectBufferMemory);
+
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		vkDestroyBuffer(BP->device, drawBuffers[i], nullptr);
+		BP->freeMemory(drawBuffersMemory[i]);
+		vkDestroyBuffer(BP->device, countBuffers[i], nullptr);
+		BP->freeMemory(countBuffersMemory[i]);
+
+		vkUnmapMemory(BP->device, statsBuffersMemory[i]);
+		vkDestroyBuffer(BP->device, statsBuffers[i], nullptr);
+		BP->freeMemory(statsBuffersMemory[i]);
+
+		vkUnmapMemory(BP->device, orderBuffersMemory[i]);
+		vkDestroyBuffer(BP->device, orderBuffers[i], nullptr);
+		BP->freeMemory(orderBuffersMemory[i]);
+	}
+}
+
+void DepthPyramid::init(BaseProject* bp, const std::string& shader) {
+	BP = bp;
+
+	// The first level has half the resolution of the depth buffer
+	width = std::max(1u, (BP->swapChainExtent.width + 1) / 2);
+	height = std::max(1u, (BP->swapChainExtent.height + 1) / 2);
+	levels = static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
+	uvScale = glm::vec2(1.0f);
+
+	BP->createImage(width, height, levels, VK_FORMAT_R32_SFLOAT,
+		VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		image, imageMemory,
+		MEMORY_ATTACHMENT, "depth pyramid");
+
+	view = BP->createImageView(image, VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, levels);
+
+	levelViews.resize(levels);
+	for (uint32_t level = 0; level < levels; level++) {
+		VkImageViewCreateInfo viewInfo{};
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewInfo.image = image;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.format = VK_FORMAT_R32_SFLOAT;
+		viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		viewInfo.subresourceRange.baseMipLevel = level;
+		viewInfo.subresourceRange.levelCount = 1;
+		viewInfo.subresourceRange.baseArrayLayer = 0;
+		viewInfo.subresourceRange.layerCount = 1;
+
+		VkResult result = vkCreateImageView(BP->device, &viewInfo, nullptr, &levelViews[level]);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create image view!");
+		}
+	}
+
+	// The shaders only use texelFetch
+	VkSamplerCreateInfo samplerInfo{};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.maxLod = static_cast<float>(levels);
+
+	VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr, &sampler);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create texture sampler!");
+	}
+
+	layout.init(bp, {
+		{0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT},
+		{1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT}
+		});
+
+	descriptorSets.resize(levels);
+	std::vector<VkDescriptorSetLayout> layouts(levels, layout.descriptorSetLayout);
+	BP->allocateDescriptorSets(levels, layouts.data(), descriptorSets.data());
+
+	for (uint32_t level = 0; level < levels; level++) {
+		VkDescriptorImageInfo sourceInfo{};
+		sourceInfo.sampler = sampler;
+		if (level == 0) {
+			sourceInfo.imageView = BP->depthImageView;
+			sourceInfo.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+		}
+		else {
+			sourceInfo.imageView = levelViews[level - 1];
+			sourceInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+		}
+
+		VkDescriptorImageInfo destinationInfo{};
+		destinationInfo.imageView = levelViews[level];
+		destinationInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+		std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
+		descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[0].dstSet = descriptorSets[level];
+		descriptorWrites[0].dstBinding = 0;
+		descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		descriptorWrites[0].descriptorCount = 1;
+		descriptorWrites[0].pImageInfo = &sourceInfo;
+
+		descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		descriptorWrites[1].dstSet = descriptorSets[level];
+		descriptorWrites[1].dstBinding = 1;
+		descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+		descriptorWrites[1].descriptorCount = 1;
+		descriptorWrites[1].pImageInfo = &destinationInfo;
+
+		vkUpdateDescriptorSets(BP->device, static_cast<uint32_t>(descriptorWrites.size()),
+			descriptorWrites.data(), 0, nullptr);
+	}
+
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = 4 * sizeof(int32_t);
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &layout.descriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+	result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+		&pipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create pipeline layout!");
+	}
+
+	auto shaderCode = Pipeline::readFile(shader);
+
+	VkShaderModuleCreateInfo moduleInfo{};
+	moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleInfo.codeSize = shaderCode.size();
+	moduleInfo.pCode = reinterpret_cast<const uint32_t*>(shaderCode.data());
+
+	VkShaderModule shaderModule;
+	result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr, &shaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create shader module!");
+	}
+
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	pipelineInfo.stage.module = shaderModule;
+	pipelineInfo.stage.pName = "main";
+	pipelineInfo.layout = pipelineLayout;
+
+	result = vkCreateComputePipelines(BP->device, BP->pipelineCache.cache, 1,
+		&pipelineInfo, nullptr, &pipeline);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create compute pipeline!");
+	}
+
+	vkDestroyShaderModule(BP->device, shaderModule, nullptr);
+
+	// The culling passes read the pyramid in the general layout, even before it is first built
+	VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, levels, 0, 1 };
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+	vkCmdPipelineBarrier(commandBuffer,
+		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+	BP->endSingleTimeCommands(commandBuffer);
+}
+
+void DepthPyramid::build(VkCommandBuffer commandBuffer) {
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+
+	// The whole depth buffer is reduced: what lies outside of the rendered area can
+	// only make the farthest depth of the texels on its border farther, never nearer
+	uvScale = glm::vec2(
+		BP->renderExtent.width / static_cast<float>(BP->swapChainExtent.width),
+		BP->renderExtent.height / static_cast<float>(BP->swapChainExtent.height));
+
+	int32_t sourceWidth = BP->swapChainExtent.width;
+	int32_t sourceHeight = BP->swapChainExtent.height;
+
+	for (uint32_t level = 0; level < levels; level++) {
+		int32_t levelWidth = std::max(1u, width >> level);
+		int32_t levelHeight = std::max(1u, height >> level);
+		int32_t sizes[4] = { sourceWidth, sourceHeight, levelWidth, levelHeight };
+
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+			pipelineLayout, 0, 1, &descriptorSets[level], 0, nullptr);
+		vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT,
+			0, sizeof(sizes), sizes);
+
+		// 8x8 texels per work group, as in the shader
+		vkCmdDispatch(commandBuffer, (levelWidth + 7) / 8, (levelHeight + 7) / 8, 1);
+
+		// Each level is read to build the next one
+		VkMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer,
+			VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+			0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+		sourceWidth = levelWidth;
+		sourceHeight = levelHeight;
+	}
+}
+
+void DepthPyramid::cleanup() {
+	vkDestroyPipeline(BP->device, pipeline, nullptr);
+	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+	layout.cleanup();
+	vkDestroySampler(BP->device, sampler, nullptr);
+	for (VkImageView levelView : levelViews) {
+		vkDestroyImageView(BP->device, levelView, nullptr);
+	}
+	vkDestroyImageView(BP->device, view, nullptr);
+	vkDestroyImage(BP->device, image, nullptr);
+	BP->freeMemory(imageMemory);
+}
+
+void Upscaler::init(BaseProject* bp, const std::string& VertShader, const std::string& FragShader) {
+	BP = bp;
+
+	VkSamplerCreateInfo samplerInfo{};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_LINEAR;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.maxLod = 0.0f;
+
+	VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr, &sampler);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create texture sampler!");
+	}
+
+	layout.init(bp, {
+		{0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}
+		});
+
+	BP->allocateDescriptorSets(1, &layout.descriptorSetLayout, &descriptorSet);
+
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.sampler = sampler;
+	imageInfo.imageView = BP->sceneColorImageView;
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	VkWriteDescriptorSet descriptorWrite{};
+	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrite.dstSet = descriptorSet;
+	descriptorWrite.dstBinding = 0;
+	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrite.descriptorCount = 1;
+	descriptorWrite.pImageInfo = &imageInfo;
+
+	vkUpdateDescriptorSets(BP->device, 1, &descriptorWrite, 0, nullptr);
+
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(UpscalePushConstants);
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &layout.descriptorSetLayout;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+	result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create pipeline layout!");
+	}
+
+	auto vertShaderCode = Pipeline::readFile(VertShader);
+	auto fragShaderCode = Pipeline::readFile(FragShader);
+
+	VkShaderModuleCreateInfo moduleInfo{};
+	moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+
+	VkShaderModule vertShaderModule;
+	moduleInfo.codeSize = vertShaderCode.size();
+	moduleInfo.pCode = reinterpret_cast<const uint32_t*>(vertShaderCode.data());
+	result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr, &vertShaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create shader module!");
+	}
+
+	VkShaderModule fragShaderModule;
+	moduleInfo.codeSize = fragShaderCode.size();
+	moduleInfo.pCode = reinterpret_cast<const uint32_t*>(fragShaderCode.data());
+	result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr, &fragShaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create shader module!");
+	}
+
+	std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages{};
+	shaderStages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+	shaderStages[0].module = vertShaderModule;
+	shaderStages[0].pName = "main";
+	shaderStages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	shaderStages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+	shaderStages[1].module = fragShaderModule;
+	shaderStages[1].pName = "main";
+
+	// A single triangle covering the screen, made in the vertex shader
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+	VkPipelineViewportStateCreateInfo viewportState{};
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportState.viewportCount = 1;
+	viewportState.scissorCount = 1;
+
+	std::array<VkDynamicState, 2> dynamicStates = {
+		VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR
+	};
+
+	VkPipelineDynamicStateCreateInfo dynamicState{};
+	dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+	dynamicState.pDynamicStates = dynamicStates.data();
+
+	VkPipelineRasterizationStateCreateInfo rasterizer{};
+	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizer.lineWidth = 1.0f;
+	rasterizer.cullMode = VK_CULL_MODE_NONE;
+	rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+	VkPipelineMultisampleStateCreateInfo multisampling{};
+	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	multisampling.minSampleShading = 1.0f;
+
+	VkPipelineColorBlendAttachmentState colorBlendAttachment{};
+	colorBlendAttachment.colorWriteMask =
+		VK_COLOR_COMPONENT_R_BIT |
+		VK_COLOR_COMPONENT_G_BIT |
+		VK_COLOR_COMPONENT_B_BIT |
+		VK_COLOR_COMPONENT_A_BIT;
+	colorBlendAttachment.blendEnable = VK_FALSE;
+
+	VkPipelineColorBlendStateCreateInfo colorBlending{};
+	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	colorBlending.attachmentCount = 1;
+	colorBlending.pAttachments = &colorBlendAttachment;
+
+	VkGraphicsPipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	pipelineInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
+	pipelineInfo.pStages = shaderStages.data();
+	pipelineInfo.pVertexInputState = &vertexInputInfo;
+	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.pViewportState = &viewportState;
+	pipelineInfo.pRasterizationState = &rasterizer;
+	pipelineInfo.pMultisampleState = &multisampling;
+	pipelineInfo.pColorBlendState = &colorBlending;
+	pipelineInfo.pDynamicState = &dynamicState;
+	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.renderPass = BP->overlayRenderPass;
+	pipelineInfo.subpass = 0;
+	pipelineInfo.basePipelineIndex = -1;
+
+	result = vkCreateGraphicsPipelines(BP->device, BP->pipelineCache.cache, 1,
+		&pipelineInfo, nullptr, &pipeline);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create graphics pipeline!");
+	}
+
+	vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
+	vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
+}
+
+void Upscaler::draw(VkCommandBuffer commandBuffer) {
+	glm::vec2 fullSize(BP->swapChainExtent.width, BP->swapChainExtent.height);
+	glm::vec2 renderSize(BP->renderExtent.width, BP->renderExtent.height);
+
+	UpscalePushConstants constants{};
+	constants.uvScale = renderSize / fullSize;
+	constants.uvMax = (renderSize - glm::vec2(0.5f)) / fullSize;
+	constants.texelSize = glm::vec2(1.0f) / fullSize;
+	// At the native resolution it is a plain copy
+	constants.sharpness = BP->renderExtent.width < BP->swapChainExtent.width ? UPSCALE_SHARPNESS : 0.0f;
+	constants.overdrawSteps = BP->overdrawView ? OVERDRAW_STEPS : 0.0f;
+
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+		pipelineLayout, 0, 1, &descriptorSet, 0, nullptr);
+	vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_FRAGMENT_BIT,
+		0, sizeof(constants), &constants);
+	vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+}
+
+void Upscaler::cleanup() {
+	vkDestroyPipeline(BP->device, pipeline, nullptr);
+	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+	layout.cleanup();
+	vkDestroySampler(BP->device, sampler, nullptr);
+}
+
+void LightClusters::init(BaseProject* bp, uint32_t maxLights, uint32_t maxIndices) {
+	BP = bp;
+	this->maxLights = maxLights;
+	this->maxIndices = maxIndices;
+
+	// Sized once, building the clusters does not allocate
+	lights.reserve(maxLights);
+	spotLights = 0;
+	clusterMin.resize(CLUSTER_COUNT);
+	clusterMax.resize(CLUSTER_COUNT);
+	clusterCounts.resize(CLUSTER_COUNT);
+	clusterCursors.resize(CLUSTER_COUNT);
+	clusterProj = glm::mat4(0.0f);
+	usedIndices = 0;
+	busiestCluster = 0;
+
+	lightBuffers.resize(BP->framesInFlight);
+	lightBuffersMemory.resize(BP->framesInFlight);
+	gridBuffers.resize(BP->framesInFlight);
+	gridBuffersMemory.resize(BP->framesInFlight);
+	indexBuffers.resize(BP->framesInFlight);
+	indexBuffersMemory.resize(BP->framesInFlight);
+	mappedLights.resize(BP->framesInFlight);
+	mappedGrid.resize(BP->framesInFlight);
+	mappedIndices.resize(BP->framesInFlight);
+
+	VkDeviceSize lightsSize = maxLights * sizeof(GpuLight);
+	VkDeviceSize gridSize = CLUSTER_COUNT * sizeof(glm::uvec2);
+	VkDeviceSize indicesSize = maxIndices * sizeof(uint32_t);
+
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		BP->createBuffer(lightsSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			lightBuffers[i], lightBuffersMemory[i],
+			MEMORY_UNIFORM, "lights");
+		BP->createBuffer(gridSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			gridBuffers[i], gridBuffersMemory[i],
+			MEMORY_UNIFORM, "light clusters");
+		BP->createBuffer(indicesSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			indexBuffers[i], indexBuffersMemory[i],
+			MEMORY_UNIFORM, "light cluster indices");
+
+		void* data;
+		VkResult result = vkMapMemory(BP->device, lightBuffersMemory[i], 0, lightsSize, 0, &data);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map lights!");
+		}
+		mappedLights[i] = static_cast<GpuLight*>(data);
+
+		result = vkMapMemory(BP->device, gridBuffersMemory[i], 0, gridSize, 0, &data);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map light clusters!");
+		}
+		mappedGrid[i] = static_cast<glm::uvec2*>(data);
+		// No light until the first build
+		memset(mappedGrid[i], 0, gridSize);
+
+		result = vkMapMemory(BP->device, indexBuffersMemory[i], 0, indicesSize, 0, &data);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to map light cluster indices!");
+		}
+		mappedIndices[i] = static_cast<uint32_t*>(data);
+	}
+}
+
+void LightClusters::cleanup() {
+	for (size_t i = 0; i < BP->framesInFlight; i++) {
+		vkUnmapMemory(BP->device, lightBuffersMemory[i]);
+		vkDestroyBuffer(BP->device, lightBuffers[i], nullptr);
+		BP->freeMemory(lightBuffersMemory[i]);
+		vkUnmapMemory(BP->device, gridBuffersMemory[i]);
+		vkDestroyBuffer(BP->device, gridBuffers[i], nullptr);
+		BP->freeMemory(gridBuffersMemory[i]);
+		vkUnmapMemory(BP->device, indexBuffersMemory[i]);
+		vkDestroyBuffer(BP->device, indexBuffers[i], nullptr);
+		BP->freeMemory(indexBuffersMemory[i]);
+	}
+}
+
+void LightClusters::clear() {
+	lights.clear();
+	spotLights = 0;
+}
+
+void LightClusters::addPointLight(const glm::vec3& pos, const glm::vec3& color, float size, float decay) {
+	if (lights.size() >= maxLights) {
+		throw std::runtime_error("too many lights!");
+	}
+
+	// color * (size / d)^decay < 1/256
+	float range = size * glm::pow(256.0f, 1.0f / decay);
+
+	GpuLight light;
+	light.positionRange = glm::vec4(pos, range);
+	light.color = glm::vec4(color, static_cast<float>(LIGHT_POINT));
+	light.direction = glm::vec4(0.0f);
+	light.params = glm::vec4(size, decay, 0.0f, 0.0f);
+	lights.push_back(light);
+}
+
+void LightClusters::addSpotLight(const glm::vec3& pos, const glm::vec3& dir, const glm::vec3& color,
+	float innerCone, float outerCone, float range, int shadowMap) {
+	if (lights.size() >= maxLights) {
+		throw std::runtime_error("too many lights!");
+	}
+
+	GpuLight light;
+	light.positionRange = glm::vec4(pos, range);
+	light.color = glm::vec4(color, static_cast<float>(LIGHT_SPOT));
+	light.direction = glm::vec4(glm::normalize(dir), 0.0f);
+	light.params = glm::vec4(
+		glm::cos(glm::radians(innerCone / 2.0f)),
+		glm::cos(glm::radians(outerCone / 2.0f)),
+		static_cast<float>(shadowMap), 0.0f);
+	lights.push_back(light);
+	spotLights++;
+}
+
+glm::vec4 LightClusters::shaderParams() {
+	float logRatio = std::log(farPlane / nearPlane);
+	return glm::vec4(
+		BP->renderExtent.width / static_cast<float>(CLUSTER_COUNT_X),
+		BP->renderExtent.height / static_cast<float>(CLUSTER_COUNT_Y),
+		CLUSTER_COUNT_Z / logRatio,
+		-CLUSTER_COUNT_Z * std::log(nearPlane) / logRatio);
+}
+
+uint32_t LightClusters::depthSlice(float depth) {
+	float slice = std::log(depth / nearPlane) / std::log(farPlane / nearPlane) * CLUSTER_COUNT_Z;
+	return static_cast<uint32_t>(glm::clamp(slice, 0.0f, CLUSTER_COUNT_Z - 1.0f));
+}
+
+void LightClusters::computeClusterBounds(const glm::mat4& proj) {
+	// A point at view depth d and NDC (x, y) is at (x d / P00, y d / P11, -d)
+	for (uint32_t z = 0; z < CLUSTER_COUNT_Z; z++) {
+		float nearDepth = nearPlane * glm::pow(farPlane / nearPlane, z / static_cast<float>(CLUSTER_COUNT_Z));
+		float farDepth = nearPlane * glm::pow(farPlane / nearPlane, (z + 1) / static_cast<float>(CLUSTER_COUNT_Z));
+
+		for (uint32_t y = 0; y < CLUSTER_COUNT_Y; y++) {
+			float ndcY0 = -1.0f + 2.0f * y / CLUSTER_COUNT_Y;
+			float ndcY1 = -1.0f + 2.0f * (y + 1) / CLUSTER_COUNT_Y;
+
+			for (uint32_t x = 0; x < CLUSTER_COUNT_X; x++) {
+				float ndcX0 = -1.0f + 2.0f * x / CLUSTER_COUNT_X;
+				float ndcX1 = -1.0f + 2.0f * (x + 1) / CLUSTER_COUNT_X;
+
+				glm::vec3 boundsMin(std::numeric_limits<float>::max());
+				glm::vec3 boundsMax(-std::numeric_limits<float>::max());
+				for (float depth : { nearDepth, farDepth }) {
+					for (float ndcX : { ndcX0, ndcX1 }) {
+						for (float ndcY : { ndcY0, ndcY1 }) {
+							glm::vec3 corner(ndcX * depth / proj[0][0], ndcY * depth / proj[1][1], -depth);
+							boundsMin = glm::min(boundsMin, corner);
+							boundsMax = glm::max(boundsMax, corner);
+						}
+					}
+				}
+
+				uint32_t cluster = x + CLUSTER_COUNT_X * (y + CLUSTER_COUNT_Y * z);
+				clusterMin[cluster] = boundsMin;
+				clusterMax[cluster] = boundsMax;
+			}
+		}
+	}
+	clusterProj = proj;
+}
+
+template <class F>
+void LightClusters::forEachCluster(const glm::vec3& center, float radius, F visit) {
+	float minDepth = -center.z - radius;
+	float maxDepth = -center.z + radius;
+	if (maxDepth < nearPlane || minDepth > farPlane) return;
+
+	uint32_t z0 = depthSlice(std::max(minDepth, nearPlane));
+	uint32_t z1 = depthSlice(std::min(maxDepth, farPlane));
+
+	// Screen rectangle of the box around the sphere, the whole screen if it crosses the near plane
+	uint32_t x0 = 0, x1 = CLUSTER_COUNT_X - 1;
+	uint32_t y0 = 0, y1 = CLUSTER_COUNT_Y - 1;
+	if (minDepth > nearPlane) {
+		glm::vec2 ndcMin(std::numeric_limits<float>::max());
+		glm::vec2 ndcMax(-std::numeric_limits<float>::max());
+		for (float depth : { minDepth, maxDepth }) {
+			for (float dx : { -radius, radius }) {
+				for (float dy : { -radius, radius }) {
+					glm::vec2 ndc(clusterProj[0][0] * (center.x + dx) / depth,
+						clusterProj[1][1] * (center.y + dy) / depth);
+					ndcMin = glm::min(ndcMin, ndc);
+					ndcMax = glm::max(ndcMax, ndc);
+				}
+			}
+		}
+		if (ndcMax.x < -1.0f || ndcMin.x > 1.0f || ndcMax.y < -1.0f || ndcMin.y > 1.0f) return;
+
+		auto tile = [](float ndc, uint32_t count) {
+			return static_cast<uint32_t>(glm::clamp((ndc + 1.0f) * 0.5f * count, 0.0f, count - 1.0f));
+		};
+		x0 = tile(ndcMin.x, CLUSTER_COUNT_X);
+		x1 = tile(ndcMax.x, CLUSTER_COUNT_X);
+		y0 = tile(ndcMin.y, CLUSTER_COUNT_Y);
+		y1 = tile(ndcMax.y, CLUSTER_COUNT_Y);
+	}
+
+	for (uint32_t z = z0; z <= z1; z++) {
+		for (uint32_t y = y0; y <= y1; y++) {
+			for (uint32_t x = x0; x <= x1; x++) {
+				uint32_t cluster = x + CLUSTER_COUNT_X * (y + CLUSTER_COUNT_Y * z);
+
+				// Sphere against the bounds of the cluster
+				glm::vec3 closest = glm::clamp(center, clusterMin[cluster], clusterMax[cluster]);
+				glm::vec3 offset = closest - center;
+				if (glm::dot(offset, offset) <= radius * radius) visit(cluster);
+			}
+		}
+	}
+}
+
+void LightClusters::build(size_t frame, const glm::mat4& view, const glm::mat4& proj,
+	float nearPlane, float farPlane) {
+	if (proj != clusterProj || nearPlane != this->nearPlane || farPlane != this->farPlane) {
+		this->nearPlane = nearPlane;
+		this->farPlane = farPlane;
+		computeClusterBounds(proj);
+	}
+
+	memcpy(mappedLights[frame], lights.data(), lights.size() * sizeof(GpuLight));
+	std::fill(clusterCounts.begin(), clusterCounts.end(), 0);
+
+	// View space bounding spheres: spot lights are bounded by the sphere around their cone
+	auto boundingSphere = [&](const GpuLight& light, glm::vec3& center, float& radius) {
+		glm::vec3 pos = glm::vec3(light.positionRange);
+		float range = light.positionRange.w;
+		if (light.color.w == LIGHT_SPOT) {
+			glm::vec3 dir = glm::vec3(light.direction);
+			float cosHalfCone = light.params.y;
+			if (cosHalfCone >= glm::sqrt(0.5f)) {
+				radius = range / (2.0f * cosHalfCone);
+				pos += dir * radius;
+			}
+			else {
+				radius = range * glm::sqrt(1.0f - cosHalfCone * cosHalfCone);
+				pos += dir * range * cosHalfCone;
+			}
+		}
+		else {
+			radius = range;
+		}
+		center = glm::vec3(view * glm::vec4(pos, 1.0f));
+	};
+
+	// Counts the lights of every cluster, then fills the lists
+	for (const GpuLight& light : lights) {
+		glm::vec3 center;
+		float radius;
+		boundingSphere(light, center, radius);
+		forEachCluster(center, radius, [&](uint32_t cluster) { clusterCounts[cluster]++; });
+	}
+
+	glm::uvec2* grid = mappedGrid[frame];
+	usedIndices = 0;
+	busiestCluster = 0;
+	for (uint32_t cluster = 0; cluster < CLUSTER_COUNT; cluster++) {
+		// Lights past the capacity of the index buffer are dropped
+		uint32_t count = std::min(clusterCounts[cluster], maxIndices - usedIndices);
+		grid[cluster] = glm::uvec2(usedIndices, count);
+		usedIndices += count;
+		busiestCluster = std::max(busiestCluster, count);
+		clusterCursors[cluster] = 0;
+	}
+
+	uint32_t* indices = mappedIndices[frame];
+	for (uint32_t i = 0; i < lights.size(); i++) {
+		glm::vec3 center;
+		float radius;
+		boundingSphere(lights[i], center, radius);
+		forEachCluster(center, radius, [&](uint32_t cluster) {
+			if (clusterCursors[cluster] < grid[cluster].y) {
+				indices[grid[cluster].x + clusterCursors[cluster]++] = i;
+			}
+		});
+	}
+}
+
+void ShadowMaps::init(BaseProject* bp, uint32_t count, uint32_t size, const std::string& VertShader) {
+	BP = bp;
+	this->count = count;
+	this->size = size;
+
+	if (count > MAX_SHADOW_MAPS) {
+		throw std::runtime_error("too many shadow maps!");
+	}
+
+	moveThreshold = 0.05f;
+	turnThreshold = 2.0f;
+	throttleDistance = 5.0f;
+
+	renders = 0;
+	triangles = 0;
+	recordingTime = 0.0f;
+	totalRenders = 0;
+	totalTriangles = 0;
+	frames = 0;
+
+	lights.resize(count);
+	for (ShadowedLight& light : lights) {
+		light.viewProj = glm::mat4(1.0f);
+		light.cacheValid = false;
+		light.framesSinceUpdate = 0;
+		light.render = false;
+	}
+
+	// Shadow map array
+	texture.BP = bp;
+	texture.mipLevels = 1;
+	BP->createImage(size, size, 1, VK_FORMAT_D32_SFLOAT,
+		VK_IMAGE_TILING_OPTIMAL,
+		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT |
+		VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+		texture.textureImage, texture.textureImageMemory,
+		MEMORY_ATTACHMENT, "shadow maps", count);
+
+	VkImageViewCreateInfo viewInfo{};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = texture.textureImage;
+	viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY;
+	viewInfo.format = VK_FORMAT_D32_SFLOAT;
+	viewInfo.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, count };
+
+	VkResult result = vkCreateImageView(BP->device, &viewInfo, nullptr, &texture.textureImageView);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create image view!");
+	}
+
+	layerViews.resize(count);
+	for (uint32_t shadow = 0; shadow < count; shadow++) {
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, shadow, 1 };
+		result = vkCreateImageView(BP->device, &viewInfo, nullptr, &layerViews[shadow]);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create image view!");
+		}
+	}
+
+	// Linear filtering of the comparisons: 2x2 percentage closer filtering.
+	// Outside of the map there is no shadow.
+	VkSamplerCreateInfo samplerInfo{};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_LINEAR;
+	samplerInfo.minFilter = VK_FILTER_LINEAR;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+	samplerInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+	samplerInfo.compareEnable = VK_TRUE;
+	samplerInfo.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	samplerInfo.maxLod = 0.0f;
+
+	result = vkCreateSampler(BP->device, &samplerInfo, nullptr, &texture.textureSampler);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create texture sampler!");
+	}
+
+	// Depth only render pass, the whole layer is rendered again
+	VkAttachmentDescription depthAttachment{};
+	depthAttachment.format = VK_FORMAT_D32_SFLOAT;
+	depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	depthAttachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	VkAttachmentReference depthAttachmentRef{};
+	depthAttachmentRef.attachment = 0;
+	depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+	VkSubpassDescription subpass{};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = 0;
+	subpass.pDepthStencilAttachment = &depthAttachmentRef;
+
+	// After the main passes that sampled the layer, before the fragment shaders of the next one
+	std::array<VkSubpassDependency, 2> dependencies{};
+	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[0].dstSubpass = 0;
+	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies[0].srcAccessMask = 0;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+		VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+	dependencies[1].srcSubpass = 0;
+	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+	VkRenderPassCreateInfo renderPassInfo{};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = 1;
+	renderPassInfo.pAttachments = &depthAttachment;
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+	renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+	renderPassInfo.pDependencies = dependencies.data();
+
+	result = vkCreateRenderPass(BP->device, &renderPassInfo, nullptr, &renderPass);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create render pass!");
+	}
+
+	layerFramebuffers.resize(count);
+	for (uint32_t shadow = 0; shadow < count; shadow++) {
+		VkFramebufferCreateInfo framebufferInfo{};
+		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		framebufferInfo.attachmentCount = 1;
+		framebufferInfo.width = size;
+		framebufferInfo.height = size;
+		framebufferInfo.layers = 1;
+		framebufferInfo.renderPass = renderPass;
+		framebufferInfo.pAttachments = &layerViews[shadow];
+		result = vkCreateFramebuffer(BP->device, &framebufferInfo, nullptr, &layerFramebuffers[shadow]);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create framebuffer!");
+		}
+	}
+
+	// Depth only pipeline: positions only, the light matrix times the model one in the push constants
+	VkPushConstantRange pushConstantRange{};
+	pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+	pushConstantRange.offset = 0;
+	pushConstantRange.size = sizeof(glm::mat4);
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 0;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
+	result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr, &pipelineLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create pipeline layout!");
+	}
+
+	auto vertShaderCode = Pipeline::readFile(VertShader);
+
+	VkShaderModuleCreateInfo moduleInfo{};
+	moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	moduleInfo.codeSize = vertShaderCode.size();
+	moduleInfo.pCode = reinterpret_cast<const uint32_t*>(vertShaderCode.data());
+
+	VkShaderModule vertShaderModule;
+	result = vkCreateShaderModule(BP->device, &moduleInfo, nullptr, &vertShaderModule);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create shader module!");
+	}
+
+	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+	vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+	vertShaderStageInfo.module = vertShaderModule;
+	vertShaderStageInfo.pName = "main";
+
+	auto bindingDescriptions = Vertex::getBindingDescriptions();
+	auto attributeDescriptions = Vertex::getAttributeDescriptions();
+
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+	vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInputInfo.vertexBindingDescriptionCount = 1;
+	vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
+	vertexInputInfo.vertexAttributeDescriptionCount = 1;
+	vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data();
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+	VkViewport viewport{};
+	viewport.width = (float)size;
+	viewport.height = (float)size;
+	viewport.minDepth = 0.0f;
+	viewport.maxDepth = 1.0f;
+
+	VkRect2D scissor{};
+	scissor.extent = { size, size };
+
+	VkPipelineViewportStateCreateInfo viewportState{};
+	viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewportState.viewportCount = 1;
+	viewportState.pViewports = &viewport;
+	viewportState.scissorCount = 1;
+	viewportState.pScissors = &scissor;
+
+	// Both faces: the terrain is an open surface. The bias keeps lit surfaces from shadowing themselves
+	VkPipelineRasterizationStateCreateInfo rasterizer{};
+	rasterizer.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterizer.depthClampEnable = VK_FALSE;
+	rasterizer.rasterizerDiscardEnable = VK_FALSE;
+	rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizer.lineWidth = 1.0f;
+	rasterizer.cullMode = VK_CULL_MODE_NONE;
+	rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	rasterizer.depthBiasEnable = VK_TRUE;
+	rasterizer.depthBiasConstantFactor = 1.25f;
+	rasterizer.depthBiasSlopeFactor = 1.75f;
+
+	VkPipelineMultisampleStateCreateInfo multisampling{};
+	multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+	multisampling.minSampleShading = 1.0f;
+
+	VkPipelineDepthStencilStateCreateInfo depthStencil{};
+	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	depthStencil.depthTestEnable = VK_TRUE;
+	depthStencil.depthWriteEnable = VK_TRUE;
+	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	depthStencil.maxDepthBounds = 1.0f;
+
+	VkPipelineColorBlendStateCreateInfo colorBlending{};
+	colorBlending.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	colorBlending.attachmentCount = 0;
+
+	VkGraphicsPipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	pipelineInfo.stageCount = 1;
+	pipelineInfo.pStages = &vertShaderStageInfo;
+	pipelineInfo.pVertexInputState = &vertexInputInfo;
+	pipelineInfo.pInputAssemblyState = &inputAssembly;
+	pipelineInfo.pViewportState = &viewportState;
+	pipelineInfo.pRasterizationState = &rasterizer;
+	pipelineInfo.pMultisampleState = &multisampling;
+	pipelineInfo.pDepthStencilState = &depthStencil;
+	pipelineInfo.pColorBlendState = &colorBlending;
+	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.renderPass = renderPass;
+	pipelineInfo.subpass = 0;
+	pipelineInfo.basePipelineIndex = -1;
+
+	result = vkCreateGraphicsPipelines(BP->device, BP->pipelineCache.cache, 1,
+		&pipelineInfo, nullptr, &pipeline);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create graphics pipeline!");
+	}
+
+	vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
+
+	// Nothing is in shadow until a light is first rendered
+	VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+
+	for (uint32_t shadow = 0; shadow < count; shadow++) {
+		layerBarrier(commandBuffer, shadow,
+			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+	}
+
+	VkClearDepthStencilValue clearValue = { 1.0f, 0 };
+	VkImageSubresourceRange range = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, count };
+	vkCmdClearDepthStencilImage(commandBuffer, texture.textureImage,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearValue, 1, &range);
+
+	for (uint32_t shadow = 0; shadow < count; shadow++) {
+		layerBarrier(commandBuffer, shadow,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	}
+
+	BP->endSingleTimeCommands(commandBuffer);
+}
+
+void ShadowMaps::cleanup() {
+	vkDestroyPipeline(BP->device, pipeline, nullptr);
+	vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+	for (uint32_t shadow = 0; shadow < count; shadow++) {
+		vkDestroyFramebuffer(BP->device, layerFramebuffers[shadow], nullptr);
+		vkDestroyImageView(BP->device, layerViews[shadow], nullptr);
+	}
+	vkDestroyRenderPass(BP->device, renderPass, nullptr);
+	texture.cleanup();
+}
+
+void ShadowMaps::setLight(uint32_t shadow, const glm::vec3& pos, const glm::vec3& dir, float outerCone,
+	float range, const glm::vec3& cameraPos) {
+	ShadowedLight& light = lights[shadow];
+	glm::vec3 direction = glm::normalize(dir);
+
+	// Throttled by the distance from the camera, except for the first update
+	uint32_t updateInterval = 1 + static_cast<uint32_t>(glm::length(pos - cameraPos) / throttleDistance);
+	light.framesSinceUpdate++;
+	bool due = !light.cacheValid || light.framesSinceUpdate >= updateInterval;
+
+	bool moved = !light.cacheValid ||
+		glm::length(pos - light.cachedPos) > moveThreshold ||
+		glm::dot(direction, light.cachedDir) < glm::cos(glm::radians(turnThreshold));
+
+	light.render = due && moved;
+	if (!light.render) return;
+
+	// The light matrix stays the one of the cache until it is rendered again: the margin
+	// keeps the cone inside the map while the light turns less than the threshold
+	light.framesSinceUpdate = 0;
+	glm::vec3 up = glm::abs(direction.z) < 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+	glm::mat4 proj = glm::perspective(glm::radians(outerCone + 2.0f * turnThreshold), 1.0f,
+		range / 1000.0f, range);
+	light.viewProj = proj * glm::lookAt(pos, pos + direction, up);
+	light.cachedPos = pos;
+	light.cachedDir = direction;
+	light.cacheValid = true;
+}
+
+void ShadowMaps::draw(VkCommandBuffer commandBuffer, const IndexRange& range, const glm::mat4& model) {
+	glm::mat4 lightModelViewProj = passViewProj * model;
+	vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT,
+		0, sizeof(glm::mat4), &lightModelViewProj);
+	vkCmdDrawIndexed(commandBuffer, range.indexCount, 1, range.firstIndex, 0, 0);
+	triangles += range.indexCount / 3;
+}
+
+void ShadowMaps::beginPass(VkCommandBuffer commandBuffer, VkFramebuffer framebuffer) {
+	VkClearValue clearValue{};
+	clearValue.depthStencil = { 1.0f, 0 };
+
+	VkRenderPassBeginInfo renderPassInfo{};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	renderPassInfo.renderPass = renderPass;
+	renderPassInfo.framebuffer = framebuffer;
+	renderPassInfo.renderArea.offset = { 0, 0 };
+	renderPassInfo.renderArea.extent = { size, size };
+	renderPassInfo.clearValueCount = 1;
+	renderPassInfo.pClearValues = &clearValue;
+
+	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+}
+
+void ShadowMaps::layerBarrier(VkCommandBuffer commandBuffer, uint32_t shadow, VkImageLayout oldLayout,
+	VkImageLayout newLayout, VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+	VkPipelineStageFlags dstStage, VkAccessFlags dstAccess) {
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = oldLayout;
+	barrier.newLayout = newLayout;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = texture.textureImage;
+	barrier.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, shadow, 1 };
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = dstAccess;
+
+	vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage,
+		0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+template <class D>
+void ShadowMaps::record(VkCommandBuffer commandBuffer, D drawCasters) {
+	auto recordingStart = std::chrono::high_resolution_clock::now();
+
+	renders = 0;
+	triangles = 0;
+
+	for (uint32_t shadow = 0; shadow < count; shadow++) {
+		ShadowedLight& light = lights[shadow];
+		if (!light.render) continue;
+
+		passViewProj = light.viewProj;
+		beginPass(commandBuffer, layerFramebuffers[shadow]);
+		drawCasters(shadow);
+		vkCmdEndRenderPass(commandBuffer);
+		renders++;
+
+		light.render = false;
+	}
+
+	recordingTime = std::chrono::duration<float, std::chrono::milliseconds::period>(
+		std::chrono::high_resolution_clock::now() - recordingStart).count();
+	totalRenders += renders;
+	totalTriangles += triangles;
+	frames++;
+}
+
+void TextureTable::init(BaseProject* bp, uint32_t capacity) {
+	BP = bp;
+	this->capacity = capacity;
+	count = 0;
+
+	// Unused slots are never read, and new textures can be added while the set is bound
+	VkDescriptorSetLayoutBinding binding{};
+	binding.binding = 0;
+	binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	binding.descriptorCount = capacity;
+	binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	binding.pImmutableSamplers = nullptr;
+
+	VkDescriptorBindingFlags bindingFlags =
+		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+		VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+
+	VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsInfo{};
+	bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+	bindingFlagsInfo.bindingCount = 1;
+	bindingFlagsInfo.pBindingFlags = &bindingFlags;
+
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.pNext = &bindingFlagsInfo;
+	layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+	layoutInfo.bindingCount = 1;
+	layoutInfo.pBindings = &binding;
+
+	layout.BP = bp;
+	VkResult result = vkCreateDescriptorSetLayout(BP->device, &layoutInfo,
+		nullptr, &layout.descriptorSetLayout);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create texture table layout!");
+	}
+
+	VkDescriptorPoolSize poolSize{};
+	poolSize.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	poolSize.descriptorCount = capacity;
+
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT;
+	poolInfo.poolSizeCount = 1;
+	poolInfo.pPoolSizes = &poolSize;
+	poolInfo.maxSets = 1;
+
+	result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr,
+		&descriptorPool);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create texture table pool!");
+	}
+
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout.descriptorSetLayout;
+
+	result = vkAllocateDescriptorSets(BP->device, &allocInfo, &descriptorSet);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate texture table!");
+	}
+}
+
+uint32_t TextureTable::add(Texture* tex) {
+	if (count >= capacity) {
+		throw std::runtime_error("texture table is full!");
+	}
+
+	VkDescriptorImageInfo imageInfo{};
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	imageInfo.imageView = tex->textureImageView;
+	imageInfo.sampler = tex->textureSampler;
+
+	VkWriteDescriptorSet descriptorWrite{};
+	descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	descriptorWrite.dstSet = descriptorSet;
+	descriptorWrite.dstBinding = 0;
+	descriptorWrite.dstArrayElement = count;
+	descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorWrite.descriptorCount = 1;
+	descriptorWrite.pImageInfo = &imageInfo;
+
+	vkUpdateDescriptorSets(BP->device, 1, &descriptorWrite, 0, nullptr);
+
+	return count++;
+}
+
+void TextureTable::bind(VkCommandBuffer commandBuffer, Pipeline& P, uint32_t set) {
+	vkCmdBindDescriptorSets(commandBuffer,
+		VK_PIPELINE_BIND_POINT_GRAPHICS,
+		P.pipelineLayout, set, 1, &descriptorSet,
+		0, nullptr);
+}
+
+void TextureTable::cleanup() {
+	vkDestroyDescriptorPool(BP->device, descriptorPool, nullptr);
+	layout.cleanup();
+}
+
+
+uint32_t GpuProfiler::addScope(const std::string& name) {
+	names.push_back(name);
+	return static_cast<uint32_t>(names.size() - 1);
+}
+
+void GpuProfiler::init(BaseProject* bp) {
+	BP = bp;
+
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(BP->physicalDevice, &queueFamilyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(BP->physicalDevice, &queueFamilyCount, queueFamilies.data());
+	uint32_t validBits = queueFamilies[BP->findQueueFamilies(BP->physicalDevice).graphicsFamily.value()].timestampValidBits;
+
+	tickPeriod = BP->physicalDeviceProperties.limits.timestampPeriod;
+	supported = validBits > 0 && tickPeriod > 0.0;
+	if (!supported) return;
+	tickMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+
+	uint32_t scopeCount = static_cast<uint32_t>(names.size());
+	results.resize(4 * scopeCount);
+	lastTimes.assign(scopeCount, -1.0f);
+	history.assign(scopeCount * GPU_PROFILER_HISTORY, 0.0f);
+	historyNext = 0;
+	historySize = 0;
+
+	queryPools.resize(BP->framesInFlight);
+	for (VkQueryPool& queryPool : queryPools) {
+		VkQueryPoolCreateInfo queryPoolInfo{};
+		queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		queryPoolInfo.queryCount = 2 * scopeCount;
+
+		VkResult result = vkCreateQueryPool(BP->device, &queryPoolInfo, nullptr, &queryPool);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create query pool!");
+		}
+	}
+
+	// A timestamp taken between two readings of the CPU clock. The submission latency
+	// makes the offset approximate, but the same for every GPU scope: their durations
+	// and order are exact, their position next to the CPU scopes within a fraction of a ms.
+	VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+	vkCmdResetQueryPool(commandBuffer, queryPools[0], 0, 1);
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPools[0], 0);
+	double cpuBefore = Trace::now();
+	BP->endSingleTimeCommands(commandBuffer);
+	double cpuAfter = Trace::now();
+
+	uint64_t timestamp = 0;
+	vkGetQueryPoolResults(BP->device, queryPools[0], 0, 1, sizeof(timestamp), &timestamp,
+		sizeof(timestamp), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+	traceOffset = 0.5 * (cpuBefore + cpuAfter) - (timestamp & tickMask) * tickPeriod / 1000.0;
+}
+
+void GpuProfiler::cleanup() {
+	for (VkQueryPool queryPool : queryPools) {
+		vkDestroyQueryPool(BP->device, queryPool, nullptr);
+	}
+	queryPools.clear();
+}
+
+void GpuProfiler::beginFrame(VkCommandBuffer commandBuffer, uint32_t frame) {
+	if (!supported) return;
+	vkCmdResetQueryPool(commandBuffer, queryPools[frame], 0, static_cast<uint32_t>(2 * names.size()));
+}
+
+void GpuProfiler::begin(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t scope) {
+	if (!supported) return;
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, queryPools[frame], 2 * scope);
+}
+
+void GpuProfiler::end(VkCommandBuffer commandBuffer, uint32_t frame, uint32_t scope) {
+	if (!supported) return;
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, queryPools[frame], 2 * scope + 1);
+}
+
+void GpuProfiler::readFrame(uint32_t frame) {
+	if (!supported) return;
+
+	// The scopes of passes culled by the frame graph, or not recorded this frame, stay unavailable
+	uint32_t queryCount = static_cast<uint32_t>(2 * names.size());
+	VkResult result = vkGetQueryPoolResults(BP->device, queryPools[frame], 0, queryCount,
+		results.size() * sizeof(uint64_t), results.data(), 2 * sizeof(uint64_t),
+		VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+	if (result != VK_SUCCESS && result != VK_NOT_READY) return;
+
+	for (uint32_t scope = 0; scope < names.size(); scope++) {
+		const uint64_t* query = &results[4 * scope];
+		float& slot = history[scope * GPU_PROFILER_HISTORY + historyNext];
+		if (query[1] == 0 || query[3] == 0) {
+			lastTimes[scope] = -1.0f;
+			slot = 0.0f;
+			continue;
+		}
+
+		uint64_t begin = query[0] & tickMask;
+		uint64_t ticks = ((query[2] & tickMask) - begin) & tickMask;
+		lastTimes[scope] = static_cast<float>(ticks * tickPeriod / 1000000.0);
+		slot = lastTimes[scope];
+
+		if (BP->trace.enabled()) {
+			BP->trace.add(names[scope].c_str(), TRACE_TRACK_GPU,
+				traceOffset + begin * tickPeriod / 1000.0, ticks * tickPeriod / 1000.0);
+		}
+	}
+
+	historyNext = (historyNext + 1) % GPU_PROFILER_HISTORY;
+	historySize = std::min(historySize + 1, GPU_PROFILER_HISTORY);
+}
+
+void GpuProfiler::printSummary(std::ostream& out) {
+	if (!supported) {
+		out << "GPU profile: timestamps not supported\n";
+		return;
+	}
+
+	out << "---- GPU profile (ms, last " << historySize << " frames) ----" << std::endl;
+	for (uint32_t scope = 0; scope < names.size(); scope++) {
+		float sum = 0.0f, peak = 0.0f;
+		for (uint32_t i = 0; i < historySize; i++) {
+			float time = history[scope * GPU_PROFILER_HISTORY + i];
+			sum += time;
+			peak = std::max(peak, time);
+		}
+
+		out << "  " << names[scope] << ": ";
+		if (lastTimes[scope] < 0.0f) out << "not recorded";
+		else out << lastTimes[scope];
+		out << ", average " << (historySize > 0 ? sum / historySize : 0.0f) << ", max " << peak << "\n";
+	}
+}
+// Pipeline stages, memory access, image layout and image usage of each FrameGraphAccess
+struct FrameGraphAccessInfo {
+	VkPipelineStageFlags stages;
+	VkAccessFlags access;
+	VkImageLayout layout;
+	VkImageUsageFlags usage;
+	bool write;
+};
+
+static const FrameGraphAccessInfo frameGraphAccesses[FRAME_GRAPH_ACCESS_COUNT] = {
+	// ACCESS_COLOR_ATTACHMENT
+	{ VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+		VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+		VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT, true },
+	// ACCESS_DEPTH_ATTACHMENT
+	{ VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT, true },
+	// ACCESS_FRAGMENT_SAMPLED
+	{ VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT, false },
+	// ACCESS_COMPUTE_SAMPLED_DEPTH
+	{ VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_IMAGE_USAGE_SAMPLED_BIT, false },
+	// ACCESS_COMPUTE_READ
+	{ VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+		VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_SAMPLED_BIT, false },
+	// ACCESS_COMPUTE_WRITE
+	{ VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+		VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_USAGE_STORAGE_BIT, true },
+	// ACCESS_INDIRECT_DRAW, buffers only
+	{ VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+		VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT,
+		VK_IMAGE_LAYOUT_UNDEFINED, 0, false },
+	// ACCESS_SHADOW_MAP
+	{ VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+		VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, true },
+};
+
+FrameGraphPass& FrameGraphPass::read(uint32_t resource, FrameGraphAccess access) {
+	if (frameGraphAccesses[access].write) {
+		throw std::runtime_error("frame graph pass " + name + " reads with a writing access!");
+	}
+	uses.push_back({ resource, access });
+	return *this;
+}
+
+FrameGraphPass& FrameGraphPass::write(uint32_t resource, FrameGraphAccess access) {
+	if (!frameGraphAccesses[access].write) {
+		throw std::runtime_error("frame graph pass " + name + " writes with a reading access!");
+	}
+	uses.push_back({ resource, access });
+	return *this;
+}
+
+void FrameGraph::init(BaseProject* bp) {
+	BP = bp;
+	transientSize = 0;
+	unaliasedSize = 0;
+}
+
+uint32_t FrameGraph::importBuffer(const std::string& name) {
+	FrameGraphResource resource{};
+	resource.name = name;
+	resources.push_back(resource);
+	return static_cast<uint32_t>(resources.size() - 1);
+}
+
+uint32_t FrameGraph::importImage(const std::string& name, VkImageAspectFlags aspect,
+	VkImageLayout layout) {
+	FrameGraphResource resource{};
+	resource.name = name;
+	resource.isImage = true;
+	resource.aspect = aspect;
+	resource.layout = layout;
+	resources.push_back(resource);
+	return static_cast<uint32_t>(resources.size() - 1);
+}
+
+uint32_t FrameGraph::importOutput(const std::string& name, VkImageLayout finalLayout,
+	VkPipelineStageFlags acquireStage) {
+	uint32_t output = importImage(name, VK_IMAGE_ASPECT_COLOR_BIT, finalLayout);
+	resources[output].output = true;
+	resources[output].acquireStage = acquireStage;
+	return output;
+}
+
+uint32_t FrameGraph::createImage(const std::string& name, VkFormat format,
+	VkImageAspectFlags aspect, VkExtent2D extent) {
+	uint32_t image = importImage(name, aspect, VK_IMAGE_LAYOUT_UNDEFINED);
+	resources[image].transient = true;
+	resources[image].format = format;
+	resources[image].extent = extent;
+	return image;
+}
+
+FrameGraphPass& FrameGraph::addPass(const std::string& name,
+	std::function<void(VkCommandBuffer)> execute) {
+	passes.emplace_back();
+	passes.back().name = name;
+	passes.back().execute = execute;
+	passes.back().alive = false;
+	passes.back().profilerScope = 0;
+	return passes.back();
+}
+
+void FrameGraph::compile() {
+	for (FrameGraphPass& pass : passes) {
+		for (FrameGraphPass::Use& use : pass.uses) {
+			if (resources[use.resource].isImage &&
+				frameGraphAccesses[use.access].layout == VK_IMAGE_LAYOUT_UNDEFINED) {
+				throw std::runtime_error("frame graph pass " + pass.name + " uses image " +
+					resources[use.resource].name + " with a buffer access!");
+			}
+		}
+	}
+
+	cullPasses();
+	createTransients();
+
+	// A first run finds the state of the resources at the end of a frame,
+	// where the next one starts: its barriers wait for the accesses of the previous one
+	std::vector<ResourceState> states(resources.size());
+	for (size_t i = 0; i < resources.size(); i++) {
+		states[i] = {};
+		states[i].layout = resources[i].transient || resources[i].output ?
+			VK_IMAGE_LAYOUT_UNDEFINED : resources[i].layout;
+	}
+	simulate(states, false);
+
+	std::vector<VkPipelineStageFlags> blockStages(memoryBlocks.size(), 0);
+	for (size_t i = 0; i < resources.size(); i++) {
+		if (resources[i].transient && resources[i].image != VK_NULL_HANDLE) {
+			blockStages[resources[i].memoryBlock] |= states[i].writeStages | states[i].readStages;
+		}
+	}
+
+	for (size_t i = 0; i < resources.size(); i++) {
+		FrameGraphResource& resource = resources[i];
+		if (resource.output) {
+			// Acquired again every frame, with undefined contents
+			states[i] = {};
+			states[i].writeStages = resource.acquireStage;
+		}
+		else if (resource.transient) {
+			// Contents discarded, but the memory is still in use by the images aliasing it
+			states[i] = {};
+			if (resource.image != VK_NULL_HANDLE) states[i].writeStages = blockStages[resource.memoryBlock];
+		}
+	}
+
+	for (FrameGraphPass& pass : passes) {
+		pass.barriers = {};
+		pass.barriers.memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	}
+	finalBarriers = {};
+	finalBarriers.memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+
+	simulate(states, true);
+
+	printSummary(std::cout);
+}
+
+void FrameGraph::cullPasses() {
+	// The passes writing an output are kept, then the ones writing what a kept pass reads:
+	// earlier in the frame, or for the resources kept between frames also later, in the previous one
+	for (FrameGraphPass& pass : passes) {
+		pass.alive = false;
+		for (FrameGraphPass::Use& use : pass.uses) {
+			if (frameGraphAccesses[use.access].write && resources[use.resource].output) pass.alive = true;
+		}
+	}
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t reader = 0; reader < passes.size(); reader++) {
+			if (!passes[reader].alive) continue;
+
+			for (FrameGraphPass::Use& read : passes[reader].uses) {
+				if (frameGraphAccesses[read.access].write) continue;
+
+				for (size_t writer = 0; writer < passes.size(); writer++) {
+					if (passes[writer].alive) continue;
+					if (resources[read.resource].transient && writer > reader) continue;
+
+					for (FrameGraphPass::Use& write : passes[writer].uses) {
+						if (write.resource == read.resource && frameGraphAccesses[write.access].write) {
+							passes[writer].alive = true;
+							changed = true;
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void FrameGraph::createTransients() {
+	std::vector<uint32_t> transients;
+	for (size_t i = 0; i < resources.size(); i++) {
+		if (!resources[i].transient) continue;
+		resources[i].usage = 0;
+		resources[i].firstPass = UINT32_MAX;
+		resources[i].lastPass = 0;
+		transients.push_back(static_cast<uint32_t>(i));
+	}
+
+	for (uint32_t p = 0; p < passes.size(); p++) {
+		if (!passes[p].alive) continue;
+
+		for (FrameGraphPass::Use& use : passes[p].uses) {
+			FrameGraphResource& resource = resources[use.resource];
+			if (!resource.transient) continue;
+
+			// Transient contents do not survive the frame
+			if (resource.firstPass == UINT32_MAX && !frameGraphAccesses[use.access].write) {
+				throw std::runtime_error("frame graph pass " + passes[p].name + " reads " +
+					resource.name + " before it is written!");
+			}
+			if (resource.firstPass == UINT32_MAX) resource.firstPass = p;
+			resource.lastPass = p;
+			resource.usage |= frameGraphAccesses[use.access].usage;
+		}
+	}
+
+	// Images used by no pass are not created
+	transients.erase(std::remove_if(transients.begin(), transients.end(),
+		[this](uint32_t i) { return resources[i].firstPass == UINT32_MAX; }), transients.end());
+	std::sort(transients.begin(), transients.end(), [this](uint32_t a, uint32_t b) {
+		return resources[a].firstPass < resources[b].firstPass;
+	});
+
+	for (uint32_t i : transients) {
+		FrameGraphResource& resource = resources[i];
+
+		VkImageCreateInfo imageInfo{};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.extent.width = resource.extent.width;
+		imageInfo.extent.height = resource.extent.height;
+		imageInfo.extent.depth = 1;
+		imageInfo.mipLevels = 1;
+		imageInfo.arrayLayers = 1;
+		imageInfo.format = resource.format;
+		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		imageInfo.usage = resource.usage;
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+
+		VkResult result = vkCreateImage(BP->device, &imageInfo, nullptr, &resource.image);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to create image!");
+		}
+		vkGetImageMemoryRequirements(BP->device, resource.image, &resource.requirements);
+		unaliasedSize += resource.requirements.size;
+	}
+
+	// In the order they are first used, the images share the memory of the first
+	// block whose images are all dead by then, and of a compatible memory type.
+	// Images are bound at the start of their block, which satisfies any alignment.
+	struct MemoryBlock {
+		VkDeviceSize size;
+		uint32_t memoryTypeBits;
+		uint32_t lastPass;
+	};
+	std::vector<MemoryBlock> blocks;
+
+	for (uint32_t i : transients) {
+		FrameGraphResource& resource = resources[i];
+
+		resource.memoryBlock = static_cast<uint32_t>(blocks.size());
+		for (uint32_t b = 0; b < blocks.size(); b++) {
+			if (blocks[b].lastPass < resource.firstPass &&
+				(blocks[b].memoryTypeBits & resource.requirements.memoryTypeBits)) {
+				resource.memoryBlock = b;
+				break;
+			}
+		}
+
+		if (resource.memoryBlock == blocks.size()) {
+			blocks.push_back({ resource.requirements.size, resource.requirements.memoryTypeBits,
+				resource.lastPass });
+		}
+		else {
+			MemoryBlock& block = blocks[resource.memoryBlock];
+			block.size = std::max(block.size, resource.requirements.size);
+			block.memoryTypeBits &= resource.requirements.memoryTypeBits;
+			block.lastPass = resource.lastPass;
+		}
+	}
+
+	memoryBlocks.resize(blocks.size());
+	for (size_t b = 0; b < blocks.size(); b++) {
+		VkMemoryAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+		allocInfo.allocationSize = blocks[b].size;
+		allocInfo.memoryTypeIndex = BP->findMemoryType(blocks[b].memoryTypeBits,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+		VkResult result = vkAllocateMemory(BP->device, &allocInfo, nullptr, &memoryBlocks[b]);
+		if (result != VK_SUCCESS) {
+			PrintVkError(result);
+			throw std::runtime_error("failed to allocate transient image memory!");
+		}
+		BP->memoryTracker.track(memoryBlocks[b], allocInfo.allocationSize,
+			allocInfo.memoryTypeIndex, MEMORY_ATTACHMENT, "frame graph transients");
+		transientSize += blocks[b].size;
+	}
+
+	for (uint32_t i : transients) {
+		FrameGraphResource& resource = resources[i];
+		vkBindImageMemory(BP->device, resource.image, memoryBlocks[resource.memoryBlock], 0);
+		resource.view = BP->createImageView(resource.image, resource.format, resource.aspect, 1);
+	}
+}
+
+void FrameGraph::simulate(std::vector<ResourceState>& states, bool recordBarriers) {
+	for (FrameGraphPass& pass : passes) {
+		if (!pass.alive) continue;
+
+		for (FrameGraphPass::Use& use : pass.uses) {
+			const FrameGraphAccessInfo& info = frameGraphAccesses[use.access];
+			this->use(states[use.resource], use.resource, info.stages, info.access, info.layout,
+				info.write, recordBarriers ? &pass.barriers : nullptr);
+		}
+	}
+
+	// Imported images go back to the layout they are kept in, outputs to the one they are presented in
+	for (uint32_t i = 0; i < resources.size(); i++) {
+		if (resources[i].isImage && !resources[i].transient && states[i].layout != resources[i].layout) {
+			use(states[i], i, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, resources[i].layout, false,
+				recordBarriers ? &finalBarriers : nullptr);
+		}
+	}
+}
+
+void FrameGraph::use(ResourceState& state, uint32_t resource, VkPipelineStageFlags stages,
+	VkAccessFlags access, VkImageLayout layout, bool write, FrameGraphBarriers* barriers) {
+	bool transition = resources[resource].isImage && state.layout != layout;
+
+	// Writes and layout transitions wait for every earlier access, reads for the last write,
+	// unless it has already been made visible to them
+	VkPipelineStageFlags srcStages = 0;
+	VkAccessFlags srcAccess = 0;
+	if (transition || write) {
+		srcStages = state.writeStages | state.readStages;
+		srcAccess = state.writeAccess;
+	}
+	else if ((stages & ~state.visibleStages) || (access & ~state.visibleAccess)) {
+		srcStages = state.writeStages;
+		srcAccess = state.writeAccess;
+	}
+
+	if (barriers && (srcStages || transition)) {
+		barriers->srcStages |= srcStages ? srcStages : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+		barriers->dstStages |= stages;
+
+		if (transition) {
+			VkImageMemoryBarrier barrier{};
+			barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			barrier.oldLayout = state.layout;
+			barrier.newLayout = layout;
+			barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.subresourceRange = { resources[resource].aspect,
+				0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS };
+			barrier.srcAccessMask = srcAccess;
+			barrier.dstAccessMask = access;
+
+			barriers->imageBarriers.push_back(barrier);
+			barriers->imageResources.push_back(resource);
+		}
+		else {
+			barriers->memoryBarrier.srcAccessMask |= srcAccess;
+			barriers->memoryBarrier.dstAccessMask |= access;
+		}
+	}
+
+	if (write) {
+		state.writeStages = stages;
+		state.writeAccess = access;
+		state.readStages = 0;
+		state.visibleStages = 0;
+		state.visibleAccess = 0;
+	}
+	else if (transition) {
+		// The transition happens before these stages: later reads in other stages wait for them
+		state.writeStages = stages;
+		state.writeAccess = 0;
+		state.readStages = stages;
+		state.visibleStages = stages;
+		state.visibleAccess = access;
+	}
+	else {
+		state.readStages |= stages;
+		if (srcStages) {
+			state.visibleStages |= stages;
+			state.visibleAccess |= access;
+		}
+	}
+
+	if (resources[resource].isImage) state.layout = layout;
+}
+
+void FrameGraph::execute(VkCommandBuffer commandBuffer) {
+	for (FrameGraphPass& pass : passes) {
+		if (!pass.alive) continue;
+
+		recordBarriers(commandBuffer, pass.barriers);
+		BP->gpuProfiler.begin(commandBuffer, static_cast<uint32_t>(BP->currentFrame), pass.profilerScope);
+		pass.execute(commandBuffer);
+		BP->gpuProfiler.end(commandBuffer, static_cast<uint32_t>(BP->currentFrame), pass.profilerScope);
+	}
+	recordBarriers(commandBuffer, finalBarriers);
+}
+
+void FrameGraph::recordBarriers(VkCommandBuffer commandBuffer, FrameGraphBarriers& barriers) {
+	if (!barriers.srcStages) return;
+
+	for (size_t i = 0; i < barriers.imageBarriers.size(); i++) {
+		barriers.imageBarriers[i].image = resources[barriers.imageResources[i]].image;
+	}
+
+	bool memory = barriers.memoryBarrier.srcAccessMask || barriers.memoryBarrier.dstAccessMask;
+	vkCmdPipelineBarrier(commandBuffer, barriers.srcStages, barriers.dstStages, 0,
+		memory ? 1 : 0, &barriers.memoryBarrier, 0, nullptr,
+		static_cast<uint32_t>(barriers.imageBarriers.size()), barriers.imageBarriers.data());
+}
+
+void FrameGraph::printSummary(std::ostream& out) {
+	out << "---- Frame graph ----" << std::endl;
+
+	uint32_t culled = 0;
+	uint32_t barrierCount = 0;
+	uint32_t transitions = static_cast<uint32_t>(finalBarriers.imageBarriers.size());
+	if (finalBarriers.srcStages) barrierCount++;
+
+	for (FrameGraphPass& pass : passes) {
+		out << pass.name << ":";
+		if (!pass.alive) {
+			out << " culled" << std::endl;
+			culled++;
+			continue;
+		}
+
+		for (FrameGraphPass::Use& use : pass.uses) {
+			out << (frameGraphAccesses[use.access].write ? " writes " : " reads ")
+				<< resources[use.resource].name << ",";
+		}
+		if (pass.barriers.srcStages) {
+			out << " after a barrier with " << pass.barriers.imageBarriers.size() << " transitions";
+			barrierCount++;
+			transitions += static_cast<uint32_t>(pass.barriers.imageBarriers.size());
+		}
+		out << std::endl;
+	}
+
+	out << passes.size() - culled << " passes (" << culled << " culled), "
+		<< barrierCount << " barriers and " << transitions << " layout transitions per frame" << std::endl;
+	out << "Transient images: " << memoryBlocks.size() << " memory blocks, "
+		<< MemoryTracker::formatSize(transientSize) << " ("
+		<< MemoryTracker::formatSize(unaliasedSize) << " without aliasing)" << std::endl;
+}
+
+void FrameGraph::cleanup() {
+	for (FrameGraphResource& resource : resources) {
+		if (!resource.transient || resource.image == VK_NULL_HANDLE) continue;
+		vkDestroyImageView(BP->device, resource.view, nullptr);
+		vkDestroyImage(BP->device, resource.image, nullptr);
+	}
+	for (VkDeviceMemory memory : memoryBlocks) {
+		BP->freeMemory(memory);
+	}
+	memoryBlocks.clear();
+	resources.clear();
+	passes.clear();
+}
@@ -0,0 +1,97 @@
+#include "PipelineCache.h"
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+
+void PipelineCache::init(VkDevice device, const VkPhysicalDeviceProperties& properties, const std::string& path) {
+	this->device = device;
+	this->properties = properties;
+	this->path = path;
+	warm = false;
+
+	std::vector<char> data;
+	std::ifstream file(path, std::ios::ate | std::ios::binary);
+	if (file.is_open()) {
+		data.resize((size_t)file.tellg());
+		file.seekg(0);
+		file.read(data.data(), data.size());
+		file.close();
+	}
+
+	// A cache of another driver or device is ignored, it would just be discarded by the driver
+	if (!data.empty() && !isCompatible(data.data(), data.size())) {
+		std::cout << "Pipeline cache " << path << " does not match the device, ignored\n";
+		data.clear();
+	}
+
+	VkPipelineCacheCreateInfo cacheInfo{};
+	cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cacheInfo.initialDataSize = data.size();
+	cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+	VkResult result = vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache);
+	if (result != VK_SUCCESS && !data.empty()) {
+		// Start from an empty cache rather than failing
+		cacheInfo.initialDataSize = 0;
+		cacheInfo.pInitialData = nullptr;
+		data.clear();
+		result = vkCreatePipelineCache(device, &cacheInfo, nullptr, &cache);
+	}
+	if (result != VK_SUCCESS) {
+		throw std::runtime_error("failed to create pipeline cache!");
+	}
+
+	warm = !data.empty();
+}
+
+bool PipelineCache::isCompatible(const char* data, size_t size) {
+	VkPipelineCacheHeaderVersionOne header;
+	if (size < sizeof(header)) return false;
+	std::memcpy(&header, data, sizeof(header));
+
+	return header.headerSize >= sizeof(header) &&
+		header.headerSize <= size &&
+		header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+		header.vendorID == properties.vendorID &&
+		header.deviceID == properties.deviceID &&
+		std::memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void PipelineCache::save() {
+	size_t size = 0;
+	if (vkGetPipelineCacheData(device, cache, &size, nullptr) != VK_SUCCESS || size == 0) return;
+
+	std::vector<char> data(size);
+	if (vkGetPipelineCacheData(device, cache, &size, data.data()) != VK_SUCCESS) return;
+
+	// Written next to the final file, then renamed over it
+	std::string temporaryPath = path + ".tmp";
+	std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		std::cout << "Cannot write the pipeline cache to " << temporaryPath << "\n";
+		return;
+	}
+	file.write(data.data(), size);
+	file.close();
+	if (!file) {
+		std::remove(temporaryPath.c_str());
+		std::cout << "Cannot write the pipeline cache to " << temporaryPath << "\n";
+		return;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temporaryPath, path, error);
+	if (error) {
+		std::remove(temporaryPath.c_str());
+		std::cout << "Cannot replace the pipeline cache " << path << ": " << error.message() << "\n";
+	}
+}
+
+void PipelineCache::cleanup() {
+	vkDestroyPipelineCache(device, cache, nullptr);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <vulkan/vulkan.h>
+#include <string>
+
+// VkPipelineCache kept on disk between runs, so that the driver does not
+// compile the shaders of the pipelines again at every launch.
+// The file is only used if its header matches the device, and it is
+// replaced atomically, so that a crash while saving never corrupts it.
+class PipelineCache
+{
+private:
+	VkDevice device;
+	VkPhysicalDeviceProperties properties;
+	std::string path;
+	bool warm;
+
+	bool isCompatible(const char* data, size_t size);
+
+public:
+	VkPipelineCache cache = VK_NULL_HANDLE;
+
+	void init(VkDevice device, const VkPhysicalDeviceProperties& properties, const std::string& path);
+	// Writes the cache to disk, to be called before cleanup()
+	void save();
+	void cleanup();
+
+	// The cache has been loaded from disk
+	bool isWarm() { return warm; }
+};
@@ -0,0 +1,247 @@
+#include "TerrainBake.h"
+#include "WorkerPool.h"
+#include <glm/gtc/constants.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+
+// Start of the file of a saved bake, followed by its texels
+struct TerrainBakeHeader {
+	char magic[4];
+	uint32_t size;
+	uint64_t key;
+	float boundsMin[2];
+	float boundsMax[2];
+};
+
+static const char TERRAIN_BAKE_MAGIC[4] = { 'T', 'B', 'K', '1' };
+
+
+uint64_t TerrainBake::key(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices,
+	uint32_t size, uint32_t rayCount, float maxDistance) {
+	// FNV-1a over the whole input
+	uint64_t hash = 14695981039346656037ull;
+	auto add = [&hash](const void* data, size_t bytes) {
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < bytes; i++) {
+			hash = (hash ^ p[i]) * 1099511628211ull;
+		}
+	};
+
+	// Component by component: with aligned gentypes a vec3 has 4 bytes of padding,
+	// left uninitialized, that would change the key from one run to the next
+	for (const glm::vec3& p : positions) {
+		add(&p.x, sizeof(p.x));
+		add(&p.y, sizeof(p.y));
+		add(&p.z, sizeof(p.z));
+	}
+	add(indices.data(), indices.size() * sizeof(uint32_t));
+	add(&size, sizeof(size));
+	add(&rayCount, sizeof(rayCount));
+	add(&maxDistance, sizeof(maxDistance));
+	return hash;
+}
+
+void TerrainBake::build(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices, uint32_t size) {
+	this->size = size;
+
+	boundsMin = glm::vec2(FLT_MAX);
+	boundsMax = glm::vec2(-FLT_MAX);
+	minHeight = FLT_MAX;
+	maxHeight = -FLT_MAX;
+	for (const glm::vec3& p : positions) {
+		boundsMin.x = std::min(boundsMin.x, p.x);
+		boundsMin.y = std::min(boundsMin.y, p.y);
+		boundsMax.x = std::max(boundsMax.x, p.x);
+		boundsMax.y = std::max(boundsMax.y, p.y);
+		minHeight = std::min(minHeight, p.z);
+		maxHeight = std::max(maxHeight, p.z);
+	}
+
+	heights.assign(size * size, -FLT_MAX);
+	glm::vec2 scale = glm::vec2(static_cast<float>(size)) / (boundsMax - boundsMin);
+
+	// The highest triangle at the center of every texel
+	for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+		// in texel space, with the texel centers at integer coordinates
+		glm::vec3 v[3];
+		for (int k = 0; k < 3; k++) {
+			const glm::vec3& p = positions[indices[t + k]];
+			v[k] = glm::vec3((p.x - boundsMin.x) * scale.x - 0.5f, (p.y - boundsMin.y) * scale.y - 0.5f, p.z);
+		}
+
+		float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+		if (std::abs(area) < 1e-12f) continue;
+
+		int x0 = std::max(0, static_cast<int>(std::ceil(std::min({ v[0].x, v[1].x, v[2].x }))));
+		int x1 = std::min(static_cast<int>(size) - 1, static_cast<int>(std::floor(std::max({ v[0].x, v[1].x, v[2].x }))));
+		int y0 = std::max(0, static_cast<int>(std::ceil(std::min({ v[0].y, v[1].y, v[2].y }))));
+		int y1 = std::min(static_cast<int>(size) - 1, static_cast<int>(std::floor(std::max({ v[0].y, v[1].y, v[2].y }))));
+
+		for (int y = y0; y <= y1; y++) {
+			for (int x = x0; x <= x1; x++) {
+				float w0 = ((v[1].x - x) * (v[2].y - y) - (v[2].x - x) * (v[1].y - y)) / area;
+				float w1 = ((v[2].x - x) * (v[0].y - y) - (v[0].x - x) * (v[2].y - y)) / area;
+				float w2 = 1.0f - w0 - w1;
+				if (w0 < -1e-5f || w1 < -1e-5f || w2 < -1e-5f) continue;
+
+				float& h = heights[y * size + x];
+				h = std::max(h, w0 * v[0].z + w1 * v[1].z + w2 * v[2].z);
+			}
+		}
+	}
+
+	// Texels no triangle covers are at the bottom
+	for (float& h : heights) {
+		if (h == -FLT_MAX) h = minHeight;
+	}
+}
+
+float TerrainBake::height(float x, float y) const {
+	int x0 = std::min(static_cast<int>(x), static_cast<int>(size) - 2);
+	int y0 = std::min(static_cast<int>(y), static_cast<int>(size) - 2);
+	float fx = x - x0;
+	float fy = y - y0;
+
+	const float* row0 = &heights[y0 * size + x0];
+	const float* row1 = row0 + size;
+	return (row0[0] * (1.0f - fx) + row0[1] * fx) * (1.0f - fy) +
+		(row1[0] * (1.0f - fx) + row1[1] * fx) * fy;
+}
+
+void TerrainBake::bake(WorkerPool& workers, uint32_t rayCount, float maxDistance) {
+	// Spread evenly over the upper hemisphere (a Fibonacci spiral): every ray stands for the same solid angle
+	std::vector<glm::vec3> directions(rayCount);
+	const float goldenAngle = glm::pi<float>() * (3.0f - std::sqrt(5.0f));
+	for (uint32_t i = 0; i < rayCount; i++) {
+		float z = 1.0f - (i + 0.5f) / rayCount;
+		float r = std::sqrt(1.0f - z * z);
+		float phi = i * goldenAngle;
+		directions[i] = glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+	}
+
+	texels.assign(size * size * 4, 0);
+
+	auto bakeRows = [&](uint32_t row, uint32_t) {
+		bakeRow(row, directions, maxDistance);
+	};
+	workers.run(size, bakeRows);
+}
+
+void TerrainBake::bakeRow(uint32_t row, const std::vector<glm::vec3>& directions, float maxDistance) {
+	glm::vec2 cellSize = (boundsMax - boundsMin) / glm::vec2(static_cast<float>(size));
+	float step = std::min(cellSize.x, cellSize.y);
+	uint32_t steps = static_cast<uint32_t>(maxDistance / step);
+	float last = static_cast<float>(size - 1);
+
+	uint32_t up = std::min(row + 1, size - 1);
+	uint32_t down = row > 0 ? row - 1 : 0;
+
+	for (uint32_t x = 0; x < size; x++) {
+		float h = heights[row * size + x];
+
+		// from the slopes between the neighbours
+		uint32_t right = std::min(x + 1, size - 1);
+		uint32_t left = x > 0 ? x - 1 : 0;
+		float dzdx = (heights[row * size + right] - heights[row * size + left]) / ((right - left) * cellSize.x);
+		float dzdy = (heights[up * size + x] - heights[down * size + x]) / ((up - down) * cellSize.y);
+		glm::vec3 normal = glm::normalize(glm::vec3(-dzdx, -dzdy, 1.0f));
+
+		float occlusionSum = 0.0f, occlusionWeight = 0.0f;
+		float skySum = 0.0f, skyWeight = 0.0f;
+
+		for (const glm::vec3& d : directions) {
+			// texel space on the ground, world units in height
+			glm::vec3 delta(d.x * step / cellSize.x, d.y * step / cellSize.y, d.z * step);
+			// slightly above the surface, that does not occlude itself
+			glm::vec3 p(static_cast<float>(x), static_cast<float>(row), h + 0.1f * step);
+
+			bool hit = false;
+			for (uint32_t s = 0; s < steps; s++) {
+				p += delta;
+				if (p.z > maxHeight) break;
+				if (p.x < 0.0f || p.y < 0.0f || p.x > last || p.y > last) break;
+				if (p.z < height(p.x, p.y)) {
+					hit = true;
+					break;
+				}
+			}
+
+			float cosNormal = std::max(glm::dot(normal, d), 0.0f);
+			occlusionWeight += cosNormal;
+			skyWeight += d.z;
+			if (!hit) {
+				occlusionSum += cosNormal;
+				skySum += d.z;
+			}
+		}
+
+		uint8_t* texel = &texels[(row * size + x) * 4];
+		texel[0] = static_cast<uint8_t>(occlusionSum / std::max(occlusionWeight, 1e-6f) * 255.0f + 0.5f);
+		texel[1] = static_cast<uint8_t>(skySum / std::max(skyWeight, 1e-6f) * 255.0f + 0.5f);
+		texel[2] = 0;
+		texel[3] = 255;
+	}
+}
+
+bool TerrainBake::load(const std::string& path, uint64_t key) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open()) return false;
+
+	TerrainBakeHeader header;
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!file || std::memcmp(header.magic, TERRAIN_BAKE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.key != key || header.size == 0) {
+		return false;
+	}
+
+	std::vector<uint8_t> data(static_cast<size_t>(header.size) * header.size * 4);
+	file.read(reinterpret_cast<char*>(data.data()), data.size());
+	if (!file) return false;
+
+	size = header.size;
+	boundsMin = glm::vec2(header.boundsMin[0], header.boundsMin[1]);
+	boundsMax = glm::vec2(header.boundsMax[0], header.boundsMax[1]);
+	texels = std::move(data);
+	return true;
+}
+
+void TerrainBake::save(const std::string& path, uint64_t key) {
+	TerrainBakeHeader header{};
+	std::memcpy(header.magic, TERRAIN_BAKE_MAGIC, sizeof(header.magic));
+	header.size = size;
+	header.key = key;
+	header.boundsMin[0] = boundsMin.x;
+	header.boundsMin[1] = boundsMin.y;
+	header.boundsMax[0] = boundsMax.x;
+	header.boundsMax[1] = boundsMax.y;
+
+	// Written next to the final file, then renamed over it, as the pipeline cache
+	std::string temporaryPath = path + ".tmp";
+	std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		std::cout << "Cannot write the terrain bake to " << temporaryPath << "\n";
+		return;
+	}
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(texels.data()), texels.size());
+	file.close();
+	if (!file) {
+		std::remove(temporaryPath.c_str());
+		std::cout << "Cannot write the terrain bake to " << temporaryPath << "\n";
+		return;
+	}
+
+	std::error_code error;
+	std::filesystem::rename(temporaryPath, path, error);
+	if (error) {
+		std::remove(temporaryPath.c_str());
+		std::cout << "Cannot replace the terrain bake " << path << ": " << error.message() << "\n";
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+class WorkerPool;
+
+// Ambient occlusion and sky visibility of a static terrain, baked on the CPU.
+// The triangles are rasterized into a height field over the xy plane (z up), then rays
+// are cast from every texel over the upper hemisphere and marched through the height field,
+// one row of texels per job of a WorkerPool.
+// The result covers the xy bounds of the terrain, as RGBA texels: ambient occlusion
+// (visibility weighted by the cosine with the normal) in red, sky visibility (weighted by
+// the cosine with the zenith, what a uniform sky lights) in green.
+class TerrainBake
+{
+private:
+	std::vector<float> heights;
+	float minHeight = 0.0f;
+	float maxHeight = 0.0f;
+
+	float height(float x, float y) const;
+	void bakeRow(uint32_t row, const std::vector<glm::vec3>& directions, float maxDistance);
+
+public:
+	uint32_t size = 0;
+	glm::vec2 boundsMin = glm::vec2(0.0f);
+	glm::vec2 boundsMax = glm::vec2(0.0f);
+	std::vector<uint8_t> texels;
+
+	// Identifies the input of a bake, with the arguments of build() and bake(), to reuse a saved one
+	static uint64_t key(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices,
+		uint32_t size, uint32_t rayCount, float maxDistance);
+
+	// The height field, size x size texels, from an indexed triangle list
+	void build(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices, uint32_t size);
+	// rayCount rays per texel, reaching at most maxDistance (in world units) away
+	void bake(WorkerPool& workers, uint32_t rayCount, float maxDistance);
+
+	// A bake saved by a previous run with the same key, false if there is none
+	bool load(const std::string& path, uint64_t key);
+	void save(const std::string& path, uint64_t key);
+};
@@ -0,0 +1,88 @@
+#include "Trace.h"
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+
+void Trace::init(size_t capacity) {
+	events.resize(capacity);
+	count = 0;
+	dropped = 0;
+}
+
+double Trace::now() {
+	return std::chrono::duration<double, std::micro>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::setTrackName(uint32_t track, const std::string& name) {
+	if (trackNames.size() <= track) trackNames.resize(track + 1);
+	trackNames[track] = name;
+}
+
+void Trace::add(const char* name, uint32_t track, double start, double duration) {
+	if (count == events.size()) {
+		dropped++;
+		return;
+	}
+	events[count++] = { name, track, start, duration };
+}
+
+// Only quotes and backslashes can appear in the names of the scopes
+static void writeString(std::ofstream& file, const char* string) {
+	file << '"';
+	for (const char* c = string; *c; c++) {
+		if (*c == '"' || *c == '\\') file << '\\';
+		file << *c;
+	}
+	file << '"';
+}
+
+bool Trace::write(const std::string& path) {
+	std::ofstream file(path);
+	if (!file) {
+		std::cout << "Cannot write the trace to " << path << "\n";
+		return false;
+	}
+
+	// microseconds with nanosecond resolution
+	file << std::fixed << std::setprecision(3);
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	bool first = true;
+
+	for (uint32_t track = 0; track < trackNames.size(); track++) {
+		if (trackNames[track].empty()) continue;
+		file << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << track
+			<< ",\"args\":{\"name\":";
+		writeString(file, trackNames[track].c_str());
+		file << "}}";
+		first = false;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const Event& event = events[i];
+		file << (first ? "" : ",\n") << "{\"ph\":\"X\",\"name\":";
+		writeString(file, event.name);
+		file << ",\"pid\":1,\"tid\":" << event.track << ",\"ts\":" << event.start
+			<< ",\"dur\":" << event.duration << "}";
+		first = false;
+	}
+
+	file << "\n]}\n";
+	file.close();
+	bool written = !file.fail();
+
+	std::cout << "Trace: " << count << " events written to " << path;
+	if (dropped > 0) std::cout << ", " << dropped << " dropped (buffer full)";
+	std::cout << "\n";
+	return written;
+}
+
+TraceScope::TraceScope(Trace& trace, const char* name, uint32_t track)
+	: trace(trace), name(name), track(track), start(trace.enabled() ? Trace::now() : 0.0) {
+}
+
+TraceScope::~TraceScope() {
+	if (trace.enabled()) trace.add(name, track, start, Trace::now() - start);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Timed events of the CPU and the GPU on a common clock, written at exit in the
+// Chrome trace event format (chrome://tracing, Perfetto). Events go in a buffer
+// allocated by init(): adding one never touches the heap, and the events past its
+// capacity are dropped. Not thread safe: events are added by the main thread.
+class Trace
+{
+private:
+	struct Event {
+		const char* name;
+		uint32_t track;
+		double start;
+		double duration;
+	};
+
+	std::vector<Event> events;
+	size_t count = 0;
+	size_t dropped = 0;
+	std::vector<std::string> trackNames;
+
+public:
+	// Capacity 0 (or no init) disables the trace
+	void init(size_t capacity);
+
+	bool enabled() const { return !events.empty(); }
+
+	// Microseconds on a steady clock, the time base of every event
+	static double now();
+
+	// A row of the trace, such as a thread or the GPU queue
+	void setTrackName(uint32_t track, const std::string& name);
+	// name must outlive the trace, start and duration are in microseconds
+	void add(const char* name, uint32_t track, double start, double duration);
+
+	bool write(const std::string& path);
+};
+
+// Adds an event for its own lifetime
+class TraceScope
+{
+private:
+	Trace& trace;
+	const char* name;
+	uint32_t track;
+	double start;
+
+public:
+	TraceScope(Trace& trace, const char* name, uint32_t track);
+	~TraceScope();
+};
@@ -0,0 +1,67 @@
+#include "WorkerPool.h"
+
+
+void WorkerPool::init(uint32_t threadCount) {
+	stopping = false;
+	for (uint32_t i = 0; i < threadCount; i++) {
+		threads.emplace_back(&WorkerPool::workerLoop, this, i + 1);
+	}
+}
+
+void WorkerPool::cleanup() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	startCondition.notify_all();
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	threads.clear();
+}
+
+void WorkerPool::dispatch(uint32_t count, void (*function)(void*, uint32_t, uint32_t), void* context) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobFunction = function;
+		jobContext = context;
+		jobCount = count;
+		nextJob = 0;
+		busyThreads = threads.size();
+		generation++;
+	}
+	startCondition.notify_all();
+
+	runJobs(0);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	doneCondition.wait(lock, [this] { return busyThreads == 0; });
+}
+
+void WorkerPool::workerLoop(uint32_t worker) {
+	uint64_t lastGeneration = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			startCondition.wait(lock, [&] { return stopping || generation != lastGeneration; });
+			if (stopping) return;
+			lastGeneration = generation;
+		}
+
+		runJobs(worker);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busyThreads--;
+		}
+		doneCondition.notify_one();
+	}
+}
+
+void WorkerPool::runJobs(uint32_t worker) {
+	for (uint32_t job = nextJob++; job < jobCount; job = nextJob++) {
+		jobFunction(jobContext, job, worker);
+	}
+}
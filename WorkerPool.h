@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads that run a batch of jobs in parallel.
+// The calling thread works on the batch too, as worker 0, and run() returns
+// when every job is done. Jobs are picked dynamically, so the worker running
+// a job is not known in advance.
+class WorkerPool
+{
+private:
+	std::vector<std::thread> threads;
+	std::mutex mutex;
+	std::condition_variable startCondition;
+	std::condition_variable doneCondition;
+	uint64_t generation = 0;
+	size_t busyThreads = 0;
+	bool stopping = false;
+
+	void (*jobFunction)(void* context, uint32_t job, uint32_t worker) = nullptr;
+	void* jobContext = nullptr;
+	uint32_t jobCount = 0;
+	std::atomic<uint32_t> nextJob;
+
+	void workerLoop(uint32_t worker);
+	void runJobs(uint32_t worker);
+	void dispatch(uint32_t count, void (*function)(void*, uint32_t, uint32_t), void* context);
+
+public:
+	// threadCount: threads created besides the calling one
+	void init(uint32_t threadCount);
+	void cleanup();
+
+	uint32_t workerCount() { return static_cast<uint32_t>(threads.size()) + 1; }
+
+	// Calls function(job, worker) for every job in [0, count).
+	// Does not allocate: the callable is passed by reference.
+	template <class F>
+	void run(uint32_t count, F& function) {
+		dispatch(count, [](void* context, uint32_t job, uint32_t worker) {
+			(*static_cast<F*>(context))(job, worker);
+		}, &function);
+	}
+};
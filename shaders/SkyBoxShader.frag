@@ -1,47 +1,63 @@
 #version 450
 //#extension GL_ARB_separate_shader_objects : enable
+#extension GL_EXT_nonuniform_qualifier : require
 
 layout(set = 0, binding = 0) uniform SkyboxUniformBufferObject {
 	mat4 model;
 	mat4 view;
 	mat4 proj;
-	vec4 skyColor;
-	vec4 progress; // ( night, sunrise, day, sunset )
+	vec4 time; // x: time of day in [0, 1]
 } subo;
 
+// Compiled in by the pipeline variant: between sunrise and sunset there are no stars
+layout(constant_id = 0) const bool DAYTIME_ONLY = false;
+
 layout(location = 0) in vec2 fragTexCoord;
 layout(location = 1) in vec3 fragPos;
 
-layout(set = 0, binding = 1) uniform sampler2D starsTexture;
-layout(set = 0, binding = 2) uniform sampler2D cloudsTexture;
+layout(set = 1, binding = 0) uniform sampler2D textures[];
+
+layout(push_constant) uniform SkyboxPushConstants {
+	uint starsTexture;
+	uint cloudsTexture;
+	uint skyLutTexture;
+} spc;
 
 
 layout(location = 0) out vec4 outColor;
 
+// Rows of the sky lookup table (SkyLutRow), baked at load time for the whole day
+const int SKY_LUT_COLOR = 0;
+const int SKY_LUT_SUN = 2;
+const int SKY_LUT_MOON = 3;
+const int SKY_LUT_ROWS = 4;
+
+vec4 skyLut(int row) {
+	// wraps around midnight with the repeat addressing of the sampler
+	return texture(textures[spc.skyLutTexture], vec2(subo.time.x, (float(row) + 0.5) / float(SKY_LUT_ROWS)));
+}
+
 void main() {
 
-	vec4 color = subo.skyColor;
+	vec4 sky = skyLut(SKY_LUT_COLOR);
+	vec4 color = vec4(sky.rgb, 1.0);
 
-	color += vec4(texture(cloudsTexture, fragTexCoord).rgb, 1.0); // clouds
+	color += vec4(texture(textures[spc.cloudsTexture], fragTexCoord).rgb, 1.0); // clouds
 
-	if(subo.progress.x >= 0.0){
-		//night
-		color += vec4(texture(starsTexture, fragTexCoord).rgb, 1.0); // stars
-	}
-	else if(subo.progress.y >= 0.0){
-		//sunrise
-		color += vec4(texture(starsTexture, fragTexCoord).rgb, 1.0) * (1.0 - subo.progress.y); // stars fade out
+	if(!DAYTIME_ONLY){
+		// stars, faded in and out around the sunset and the sunrise
+		color += vec4(texture(textures[spc.starsTexture], fragTexCoord).rgb, 1.0) * sky.a;
 	}
-	/*else if(subo.progress.z >= 0.0){
-		//day
 
-	}*/
-	else if(subo.progress.w >= 0.0){
-		//sunset
-		color += vec4(texture(starsTexture, fragTexCoord).rgb, 1.0) * subo.progress.w; // stars fade in
-	}
+	// sun and moon discs, in the direction of the cube fragment from its center
+	vec3 dir = normalize(fragPos * 2.0 - 1.0);
+	vec4 sun = skyLut(SKY_LUT_SUN);
+	vec4 moon = skyLut(SKY_LUT_MOON);
+	float sunCos = dot(dir, normalize(sun.xyz * 2.0 - 1.0));
+	float moonCos = dot(dir, normalize(moon.xyz * 2.0 - 1.0));
+	color.rgb += vec3(1.0, 0.9, 0.7) * pow(max(sunCos, 0.0), 512.0) * sun.a;
+	color.rgb += vec3(0.6) * smoothstep(0.9994, 0.9996, moonCos) * moon.a;
 
-	
 	outColor = color;
 
-}
\ No newline at end of file
+}
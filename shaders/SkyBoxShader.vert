@@ -5,8 +5,7 @@ layout(set = 0, binding = 0) uniform SkyboxUniformBufferObject {
 	mat4 model;
 	mat4 view;
 	mat4 proj;
-	vec3 skyColor;
-	vec4 progress;
+	vec4 time;
 } subo;
 
 layout(location = 0) in vec3 inPosition;
@@ -20,7 +19,7 @@ void main()
 {
     fragTexCoord = inTexCoord;
     vec4 pos = subo.proj * subo.view * subo.model * vec4(inPosition, 1.0);
-    //gl_Position = pos.xyww;
 	fragPos = 0.5 * (inPosition + vec3(1.0, 1.0, 1.0));//;
-	gl_Position = pos;
+	// On the far plane: drawn last, the sky only shades the pixels nothing else covers
+	gl_Position = pos.xyww;
 }  
\ No newline at end of file
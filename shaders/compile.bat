@@ -1,5 +1,9 @@
 glslc shader.frag -o frag.spv
 glslc shader.vert -o vert.spv
+glslc shaderInstanced.vert -o vertInstanced.spv
+glslc shaderIndirect.vert -o vertIndirect.spv
+glslc shadow.vert -o shadowVert.spv
+glslc overdraw.frag -o overdrawFrag.spv
 
 glslc SkyBoxShader.frag -o SkyBoxFrag.spv
 glslc SkyBoxShader.vert -o SkyBoxVert.spv
@@ -7,5 +11,11 @@ glslc SkyBoxShader.vert -o SkyBoxVert.spv
 glslc hoverlayShader.frag -o hoverlayFrag.spv
 glslc hoverlayShader.vert -o hoverlayVert.spv
 
+glslc upscale.frag -o upscaleFrag.spv
+glslc upscale.vert -o upscaleVert.spv
+
+glslc cull.comp -o cullComp.spv
+glslc depthPyramid.comp -o depthPyramidComp.spv
+
 pause
 exit
\ No newline at end of file
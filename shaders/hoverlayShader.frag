@@ -1,6 +1,12 @@
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
 
-layout(set = 0, binding = 1) uniform sampler2D texSampler;
+layout(set = 0, binding = 0) uniform sampler2D textures[];
+
+layout(push_constant) uniform HoverlayPushConstants {
+	mat4 transform;
+	uint texture;
+} hubo;
 
 layout(location = 0) in vec2 fragTexCoord;
 layout(location = 1) in vec3 fragPos;
@@ -9,7 +15,11 @@ layout(location = 0) out vec4 outColor;
 
 void main() {
 
-	vec4 color = vec4(texture(texSampler, fragTexCoord).rgb, 1.0);//vec4(1.0, 0.0, 0.0, 1.0);
+	vec4 color = texture(textures[hubo.texture], fragTexCoord);
+
+	// Sprites are quads: their transparent texels are not drawn
+	if (color.a < 0.5) discard;
+	color.a = 1.0;
 	
 	outColor = color;
 
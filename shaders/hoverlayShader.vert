@@ -1,8 +1,8 @@
 #version 450
 
-layout(set = 0, binding = 0) uniform HoverlayUniformBufferObject {
-	mat4 model;
-    mat4 proj;
+layout(push_constant) uniform HoverlayPushConstants {
+	mat4 transform; // proj, the sprites are already placed in HUD space
+	uint texture;
 } hubo;
 
 layout(location = 0) in vec3 inPosition;
@@ -15,7 +15,7 @@ layout(location = 1) out vec3 fragPos;
 void main()
 {
     fragTexCoord = inTexCoord;
-    vec4 pos = hubo.proj * hubo.model * vec4(inPosition, 1.0);
+    vec4 pos = hubo.transform * vec4(inPosition, 1.0);
     //gl_Position = pos.xyww;
 	fragPos = inPosition;//0.5 * (inPosition + vec3(1.0, 1.0, 1.0));//;
 	gl_Position = pos;
@@ -0,0 +1,12 @@
+#version 450
+
+// Overdraw view: with additive blending, every fragment shaded adds one layer
+// to the red channel of the scene color: 1 / OVERDRAW_STEPS, set by the code.
+// upscale.frag shows the count as a heatmap.
+layout(constant_id = 0) const float OVERDRAW_STEPS = 16.0;
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+	outColor = vec4(1.0 / OVERDRAW_STEPS, 0.0, 0.0, 0.0);
+}
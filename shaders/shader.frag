@@ -1,25 +1,50 @@
 #version 450
+#extension GL_EXT_nonuniform_qualifier : require
 
-layout(set = 1, binding = 1) uniform sampler2D texSampler;
+// Bindless texture table, indexed with the texture of the current draw
+layout(set = 1, binding = 0) uniform sampler2D textures[];
+
+layout(push_constant) uniform ObjectPushConstants {
+	mat4 model;
+	uint texture;
+	uint aoTexture;		// baked ambient occlusion of the terrain, NO_BAKED_AO for the other objects
+	vec4 aoTransform;	// from world xy to the coordinates of aoTexture
+} ubo;
+
+const uint NO_BAKED_AO = 0xFFFFFFFFu;
 
 layout(set = 0, binding = 0, std140) uniform GlobalUniformBufferObject {
 	mat4 view;
 	mat4 proj;
-	vec3 leftHeadLightPos;
-	vec3 leftHeadLightDir;
-	vec3 rightHeadLightPos;
-	vec3 rightHeadLightDir;
-	vec3 headLightsColor;
-	vec3 leftRearLightPos;
-	vec3 rightRearLightPos;
-	vec3 rearLightsColor;
 	vec3 skyColor;
-	/*float rearLightSize;
-	float rearLightDecay;
-	float headLightSize;
-	float headLightDecay;*/
+	vec4 clusterParams;
+	mat4 shadowViewProj[4];	// MAX_SHADOW_MAPS
 } gubo;
 
+// Lights of the scene, binned in clusters, see LightClusters
+struct Light {
+	vec4 positionRange;
+	vec4 color;			// w: 0 point, 1 spot
+	vec4 direction;
+	vec4 params;		// point: size, decay. spot: cos of the inner and outer half cones, shadow map or -1
+};
+
+layout(set = 0, binding = 1, std430) readonly buffer Lights {
+	Light lights[];
+};
+
+// Offset and count of the indices of every cluster
+layout(set = 0, binding = 2, std430) readonly buffer Clusters {
+	uvec2 clusters[];
+};
+
+layout(set = 0, binding = 3, std430) readonly buffer ClusterLightIndices {
+	uint lightIndices[];
+};
+
+// One layer per shadowed spot light, see ShadowMaps
+layout(set = 0, binding = 4) uniform sampler2DArrayShadow shadowMaps;
+
 /*layout(set = 0, binding = 2) uniform LightsUniformBufferObject {
 	vec3 leftHeadLightPos;
 	vec3 leftHeadLightDir;
@@ -28,6 +53,13 @@ layout(set = 0, binding = 0, std140) uniform GlobalUniformBufferObject {
 	vec3 headLightsColor;
 } lubo;*/
 
+// Compiled in by the pipeline variant, see lightingVariant() in MonsterTruckSimulator.cpp
+layout(constant_id = 0) const uint CLUSTER_COUNT_X = 16;
+layout(constant_id = 1) const uint CLUSTER_COUNT_Y = 9;
+layout(constant_id = 2) const uint CLUSTER_COUNT_Z = 24;
+// Without spot lights in the scene only the point lights are left
+layout(constant_id = 3) const bool SPOT_LIGHTS = true;
+
 layout(location = 0) in vec3 fragViewDir;
 layout(location = 1) in vec3 fragNorm;
 layout(location = 2) in vec2 fragTexCoord;
@@ -46,23 +78,23 @@ vec3 pointLight(vec3 lightColor, vec3 lightPos, float lightSize, float lightDeca
 	return lightColor * pow(g / length(lx), decay);
 }
 
-vec3 spotLight(vec3 lightColor, vec3 lightPos, vec3 lightDir, vec3 fragPos) {
-
-	float outerCone = 60.0;
-	float innerCone = 0.0;
-
-	float g = 2.0;
-	float decay = 0.0;
+vec3 spotLight(vec3 lightColor, vec3 lightPos, vec3 lightDir, float cosInner, float cosOuter, vec3 fragPos) {
 
+	// decay 0: the light does not fade with the distance
 	vec3 lx = lightPos - fragPos;
 	vec3 lxn = normalize(lx);
 
 	float cosAlpha = dot(lxn, lightDir);
-	float Cin = cos(radians(innerCone/2));
-	float Cout = cos(radians(outerCone/2));
-	float dimmingEffect = clamp((cosAlpha - Cout) / (Cin - Cout), 0.0, 1.0);
+	float dimmingEffect = clamp((cosAlpha - cosOuter) / (cosInner - cosOuter), 0.0, 1.0);
 	
-	return lightColor * pow(g / length(lx), decay) * dimmingEffect;
+	return lightColor * dimmingEffect;
+}
+
+// 1 lit, 0 in shadow, filtered by the comparison sampler
+float spotShadow(int shadowMap, vec3 fragPos) {
+	vec4 lightClip = gubo.shadowViewProj[shadowMap] * vec4(fragPos, 1.0);
+	vec3 lightNdc = lightClip.xyz / lightClip.w;
+	return texture(shadowMaps, vec4(lightNdc.xy * 0.5 + 0.5, float(shadowMap), lightNdc.z));
 }
 
 vec3 lambertDiffuse(vec3 lx, vec3 lightDir, vec3 norm, vec3 diffColor){
@@ -85,7 +117,7 @@ vec3 hemisphericAmbient(){
 }
 
 void main() {
-	const vec3  diffColor = texture(texSampler, fragTexCoord).rgb;
+	const vec3  diffColor = texture(textures[ubo.texture], fragTexCoord).rgb;
 	const vec3  specColor = vec3(1.0f, 1.0f, 1.0f);
 	//const float specPower = 20.0f;
 	//const vec3  L = vec3(0.4, 0.0, 0.3);//vec3(-0.4830f, 0.8365f, -0.2588f);
@@ -105,34 +137,48 @@ void main() {
 	vec3 d = vec3(0.0, 0.0, 1.0);
 	vec3 skyColor = gubo.skyColor + 0.04;//vec3(0.0, 0.8, 1.0);
 
+	// Baked by TerrainBake: ambient occlusion (r) and the part of the sky in view (g)
+	vec2 baked = vec2(1.0);
+	if (ubo.aoTexture != NO_BAKED_AO) {
+		baked = texture(textures[ubo.aoTexture], fragPos.xy * ubo.aoTransform.xy + ubo.aoTransform.zw).rg;
+	}
+
 	vec3 groundColor = vec3(0.0);
-	vec3 ambientSky = ((dot(norm, d) + 1.0) / 2) * skyColor;
+	vec3 ambientSky = ((dot(norm, d) + 1.0) / 2) * skyColor * baked.g;
 	vec3 ambientGround = ((1 - dot(norm, d)) / 2) * groundColor;
 	//vec3 eyeDir = -vec3(gubo.view * vec4(0, 0, 0, 1));
 
-	vec3 ambient = (ambientSky + ambientGround) * diffColor;
-
-	// SPOTLIGHTS
-	vec3 nLeftSpotLightDir = -normalize(gubo.leftHeadLightDir);
-	vec3 nRightSpotLightDir = -normalize(gubo.rightHeadLightDir);
-
-	vec3 leftSpotHeadLight = spotLight(gubo.headLightsColor, gubo.leftHeadLightPos, nLeftSpotLightDir, fragPos) * lambertPhongBRDF(gubo.leftHeadLightPos, gubo.leftHeadLightDir, norm, eyeDir, fragPos, diffColor, specColor, 2.0);
-	vec3 rightSpotHeadLight = spotLight(gubo.headLightsColor, gubo.rightHeadLightPos, nRightSpotLightDir, fragPos) * lambertPhongBRDF(gubo.rightHeadLightPos, gubo.rightHeadLightDir, norm, eyeDir, fragPos, diffColor, specColor, 2.0);
-
-	// POINTLIGHTS
-	float rearLightSize = 0.01;
-	float rearLightDecay = 2.0;
-
-	float headLightSize = 0.013;
-	float headLightDecay = 6.0;
-
-	vec3 leftRearLight = pointLight(gubo.rearLightsColor, gubo.leftRearLightPos, rearLightSize, rearLightDecay, fragPos);
-	vec3 righRearLight = pointLight(gubo.rearLightsColor, gubo.rightRearLightPos, rearLightSize, rearLightDecay, fragPos);
-
-	vec3 leftPointHeadLight = pointLight(gubo.headLightsColor, gubo.leftHeadLightPos, headLightSize, headLightDecay, fragPos);
-	vec3 rightPointHeadLight = pointLight(gubo.headLightsColor, gubo.rightHeadLightPos, headLightSize, headLightDecay, fragPos);
+	vec3 ambient = (ambientSky + ambientGround) * diffColor * baked.r;
+
+	// Cluster of the fragment, from its tile and its view depth
+	float viewDepth = -(gubo.view * vec4(fragPos, 1.0)).z;
+	uvec3 cluster = uvec3(
+		min(uvec2(gl_FragCoord.xy / gubo.clusterParams.xy), uvec2(CLUSTER_COUNT_X, CLUSTER_COUNT_Y) - 1),
+		uint(clamp(log(viewDepth) * gubo.clusterParams.z + gubo.clusterParams.w, 0.0, float(CLUSTER_COUNT_Z - 1))));
+	uvec2 clusterLights = clusters[cluster.x + CLUSTER_COUNT_X * (cluster.y + CLUSTER_COUNT_Y * cluster.z)];
+
+	vec3 lightSum = vec3(0.0);
+
+	for (uint i = 0; i < clusterLights.y; i++) {
+		Light light = lights[lightIndices[clusterLights.x + i]];
+		vec3 lightPos = light.positionRange.xyz;
+
+		if (light.color.w == 1.0) {
+			// SPOTLIGHTS
+			if (SPOT_LIGHTS) {
+				vec3 lightDir = light.direction.xyz;
+				float shadow = light.params.z >= 0.0 ? spotShadow(int(light.params.z), fragPos) : 1.0;
+				lightSum += shadow * spotLight(light.color.rgb, lightPos, -lightDir, light.params.x, light.params.y, fragPos) *
+					lambertPhongBRDF(lightPos, lightDir, norm, eyeDir, fragPos, diffColor, specColor, 2.0);
+			}
+		}
+		else {
+			// POINTLIGHTS
+			lightSum += pointLight(light.color.rgb, lightPos, light.params.x, light.params.y, fragPos);
+		}
+	}
 	
 	//outColor = vec4(clamp(leftSpotHeadLight + rightSpotHeadLight + leftRearLight + ambient + diffuse + specular, vec3(0.0f), vec3(1.0f)), 1.0f);
-	outColor = vec4(clamp(leftSpotHeadLight + rightSpotHeadLight + leftRearLight + righRearLight + leftPointHeadLight + rightPointHeadLight + ambient/6, vec3(0.0f), vec3(1.0f)), texture(texSampler, fragTexCoord).a);
+	outColor = vec4(clamp(lightSum + ambient/6, vec3(0.0f), vec3(1.0f)), texture(textures[ubo.texture], fragTexCoord).a);
 
 }
\ No newline at end of file
@@ -3,23 +3,14 @@
 layout(set = 0, binding = 0, std140) uniform GlobalUniformBufferObject {
 	mat4 view;
 	mat4 proj;
-	vec3 leftHeadLightPos;
-	vec3 leftHeadLightDir;
-	vec3 rightHeadLightPos;
-	vec3 rightHeadLightDir;
-	vec3 headLightsColor;
-	vec3 leftRearLightPos;
-	vec3 rightRearLightPos;
-	vec3 rearLightsColor;
 	vec3 skyColor;
-	/*float rearLightSize;
-	float rearLightDecay;
-	float headLightSize;
-	float headLightDecay;*/
+	vec4 clusterParams;
+	mat4 shadowViewProj[4];	// MAX_SHADOW_MAPS
 } gubo;
 
-layout(set = 1, binding = 0) uniform UniformBufferObject {
+layout(push_constant) uniform ObjectPushConstants {
 	mat4 model;
+	uint texture;
 } ubo;
 
 layout(location = 0) in vec3 pos;
@@ -31,6 +22,9 @@ layout(location = 1) out vec3 fragNorm;
 layout(location = 2) out vec2 fragTexCoord;
 layout(location = 3) out vec3 fragPos;
 
+// The depth pre-pass and the EQUAL test of the lighting pass need the same depth
+invariant gl_Position;
+
 void main() {
 	gl_Position = gubo.proj * gubo.view * ubo.model * vec4(pos, 1.0);
 	fragViewDir  = (gubo.view[3]).xyz - (ubo.model * vec4(pos,  1.0)).xyz;
@@ -0,0 +1,49 @@
+#version 450
+
+layout(set = 0, binding = 0, std140) uniform GlobalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+	vec3 skyColor;
+	vec4 clusterParams;
+	mat4 shadowViewProj[4];	// MAX_SHADOW_MAPS
+} gubo;
+
+layout(push_constant) uniform ObjectPushConstants {
+	mat4 model;
+	uint texture;
+} ubo;
+
+// Objects of the GPU driven draw list, the indirect draws use their index as first instance
+struct ObjectData {
+	mat4 model;
+	vec4 boundsMin;
+	vec4 boundsMax;
+	uvec4 lodFirstIndex;
+	uvec4 lodIndexCount;
+	uint lodCount;
+};
+
+layout(set = 2, binding = 0, std430) readonly buffer Objects {
+	ObjectData objects[];
+};
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+layout(location = 0) out vec3 fragViewDir;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragTexCoord;
+layout(location = 3) out vec3 fragPos;
+
+// The depth pre-pass and the EQUAL test of the lighting pass need the same depth
+invariant gl_Position;
+
+void main() {
+	mat4 model = ubo.model * objects[gl_InstanceIndex].model;
+	gl_Position = gubo.proj * gubo.view * model * vec4(pos, 1.0);
+	fragViewDir  = (gubo.view[3]).xyz - (model * vec4(pos,  1.0)).xyz;
+	fragNorm     = transpose(inverse(mat3(model))) * norm;
+	fragPos = (model * vec4(pos, 1.0)).xyz;
+	fragTexCoord = texCoord;
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#version 450
+
+layout(set = 0, binding = 0, std140) uniform GlobalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+	vec3 skyColor;
+	vec4 clusterParams;
+	mat4 shadowViewProj[4];	// MAX_SHADOW_MAPS
+} gubo;
+
+layout(push_constant) uniform ObjectPushConstants {
+	mat4 model;
+	uint texture;
+} ubo;
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+// Per-instance model matrix, the one of the push constants is applied on top of it
+layout(location = 3) in mat4 instanceModel;
+
+layout(location = 0) out vec3 fragViewDir;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragTexCoord;
+layout(location = 3) out vec3 fragPos;
+
+// The depth pre-pass and the EQUAL test of the lighting pass need the same depth
+invariant gl_Position;
+
+void main() {
+	mat4 model = ubo.model * instanceModel;
+	gl_Position = gubo.proj * gubo.view * model * vec4(pos, 1.0);
+	fragViewDir  = (gubo.view[3]).xyz - (model * vec4(pos,  1.0)).xyz;
+	fragNorm     = transpose(inverse(mat3(model))) * norm;
+	fragPos = (model * vec4(pos, 1.0)).xyz;
+	fragTexCoord = texCoord;
+}
\ No newline at end of file
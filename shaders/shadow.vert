@@ -0,0 +1,12 @@
+#version 450
+
+// Depth only pass of the shadow maps, see ShadowMaps
+layout(push_constant) uniform ShadowPushConstants {
+	mat4 lightModelViewProj;
+} pc;
+
+layout(location = 0) in vec3 inPosition;
+
+void main() {
+	gl_Position = pc.lightModelViewProj * vec4(inPosition, 1.0);
+}
@@ -0,0 +1,55 @@
+#version 450
+
+// The scene color, of which only the rendered area is read
+layout(set = 0, binding = 0) uniform sampler2D scene;
+
+layout(push_constant) uniform UpscalePushConstants {
+	vec2 uvScale;
+	vec2 uvMax;
+	vec2 texelSize;
+	float sharpness;
+	float overdrawSteps;	// overdraw view, 0 otherwise
+} pc;
+
+layout(location = 0) in vec2 fragUV;
+
+layout(location = 0) out vec4 outColor;
+
+vec3 sampleScene(vec2 uv) {
+	return texture(scene, min(uv, pc.uvMax)).rgb;
+}
+
+// Black where nothing was drawn, then from blue for a single layer to red for 8 or more
+vec3 heatmap(float layers) {
+	if (layers < 0.5) return vec3(0.0);
+
+	vec3 colors[5] = vec3[](vec3(0.0, 0.0, 1.0), vec3(0.0, 1.0, 1.0), vec3(0.0, 1.0, 0.0),
+		vec3(1.0, 1.0, 0.0), vec3(1.0, 0.0, 0.0));
+	float x = clamp((layers - 1.0) / 7.0, 0.0, 1.0) * 4.0;
+	int i = min(int(x), 3);
+	return mix(colors[i], colors[i + 1], x - float(i));
+}
+
+void main() {
+	vec2 uv = fragUV * pc.uvScale;
+
+	// Counts are not filtered: the texel under the pixel
+	if (pc.overdrawSteps > 0.0) {
+		float layers = texelFetch(scene, ivec2(min(uv, pc.uvMax) / pc.texelSize), 0).r * pc.overdrawSteps;
+		outColor = vec4(heatmap(round(layers)), 1.0);
+		return;
+	}
+
+	vec3 center = sampleScene(uv);
+
+	// Bilinear, then the detail lost by the filter brought back with its neighbours
+	if (pc.sharpness > 0.0) {
+		vec3 neighbours = sampleScene(uv + vec2(pc.texelSize.x, 0.0)) +
+			sampleScene(uv - vec2(pc.texelSize.x, 0.0)) +
+			sampleScene(uv + vec2(0.0, pc.texelSize.y)) +
+			sampleScene(uv - vec2(0.0, pc.texelSize.y));
+		center = clamp(center * (1.0 + 4.0 * pc.sharpness) - neighbours * pc.sharpness, 0.0, 1.0);
+	}
+
+	outColor = vec4(center, 1.0);
+}